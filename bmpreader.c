@@ -0,0 +1,6739 @@
+#define _GNU_SOURCE // O_DIRECT
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <stdarg.h>
+#include <malloc.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <dirent.h>
+#include <glob.h>
+#include <strings.h>
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#endif
+#if defined( __linux__ ) && __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#if defined( __linux__ ) && __has_include( <linux/fs.h> )
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#include "bmpreader.h"
+
+#define IMAGE_ALIGNMENT 64 // cache line
+#define FUSED_STRIP_BYTES ( 4 * 1024 * 1024 ) // per output, small enough to stay in cache until written
+#define OUTPUT_CHUNK_BYTES FUSED_STRIP_BYTES   // unit of the asynchronous output writes, a strip fits
+#define OUTPUT_STREAM_CHUNKS 2                // per output file: one being filled, one being written
+#define DIRECT_IO_ALIGNMENT 4096              // O_DIRECT buffers, offsets and sizes
+#define ASYNC_RING_ENTRIES 64
+#define ASYNC_RING_SUBMIT_RETRIES 1000        // a write the kernel keeps refusing for about a second fails
+#define ASYNC_WRITER_THREADS 4                // without io_uring
+#define BUFFER_POOL_CLASSES 169               // size classes from 64 bytes to 256 TiB
+#define BATCH_SMALL_FILE_BYTES ( 8 * 1024 * 1024 ) // smaller inputs are scheduled a whole file per worker
+#define MAX_NUMA_NODES 64
+#define MAX_BITMAP_ROW_BYTES 0x7FFFFFFCull     // strides are int32_t
+#define MAX_BITMAP_IMAGE_BYTES ( 1ull << 40 )  // pixel arrays beyond 1 TiB are taken for hostile headers
+#define CACHE_HASH_CHUNK_BYTES ( 1024 * 1024 ) // streamed inputs are hashed ahead of the strip pass in chunks of this size
+#define CACHE_FORMAT_VERSION 1                 // bump when the same options would produce different outputs
+#define FILTER_CHAIN_TILE_PIXELS 1024 // 3 KB of BGR, every op of a chain runs over it while it sits in L1
+#define PIPELINE_DEPTH 3 // strips in flight when streaming: one reading, one filtering, one writing
+#define CONVOLUTION_MAX_RADIUS 64
+#define CONVOLUTION_WEIGHT_BITS 14      // integer weights of a separable pass add up to 1 << 14
+#define CONVOLUTION_FRACTION_BITS 7     // fraction bits kept between the horizontal and vertical pass
+#define CONVOLUTION_TILE_PIXELS 256     // tile width; a tile's horizontal pass output stays in L2
+#define CONVOLUTION_TILE_ROWS 64
+#define RESIZE_BAND_ROWS 16             // output rows sharing one horizontal pass over their source rows
+#define MAX_RESIZE_SIZE 30000
+#define TRANSPOSE_BLOCK_PIXELS 16       // transposes stop subdividing at this size, a few lines per row
+#define TRANSPOSE_BAND_ROWS 64          // destination rows handed to a worker at once
+
+typedef struct
+{
+    int fd;
+    uint8_t* data;
+    size_t size;
+} MappedFile;
+
+// ---------- RUN STATISTICS ----------
+
+static const char* gRunStageNames[ NUM_RUN_STAGES ] = { "header", "read", "filter", "write" };
+
+typedef struct
+{
+    RUN_STAGE stage;
+    uint64_t wallStart;
+    uint64_t cpuStart;
+} StageTimer;
+
+static RunStats gRunStats;
+
+// progress messages on stdout; --quiet (and the benchmark) turn them off
+static int gVerbose = 1;
+
+void setVerbose( int aVerbose )
+{
+    gVerbose = aVerbose;
+}
+
+void logMessage( const char* aFormat, ... )
+{
+    if( gVerbose )
+    {
+        va_list theArguments;
+        va_start( theArguments, aFormat );
+        vprintf( aFormat, theArguments );
+        va_end( theArguments );
+    }
+}
+
+uint64_t readClockNanoseconds( clockid_t aClock )
+{
+    struct timespec theTime;
+    clock_gettime( aClock, &theTime );
+    return ( uint64_t )theTime.tv_sec * 1000000000ull + theTime.tv_nsec;
+}
+
+static inline void addRunCounter( uint64_t* aCounter, uint64_t aValue )
+{
+    __atomic_fetch_add( aCounter, aValue, __ATOMIC_RELAXED );
+}
+
+StageTimer beginStage( RUN_STAGE aStage )
+{
+    StageTimer theTimer;
+    theTimer.stage = aStage;
+    theTimer.wallStart = readClockNanoseconds( CLOCK_MONOTONIC );
+    theTimer.cpuStart = readClockNanoseconds( CLOCK_PROCESS_CPUTIME_ID );
+    return theTimer;
+}
+
+void endStage( const StageTimer* aTimer )
+{
+    addRunCounter( &gRunStats.wallNanoseconds[ aTimer->stage ], readClockNanoseconds( CLOCK_MONOTONIC ) - aTimer->wallStart );
+    addRunCounter( &gRunStats.cpuNanoseconds[ aTimer->stage ], readClockNanoseconds( CLOCK_PROCESS_CPUTIME_ID ) - aTimer->cpuStart );
+    addRunCounter( &gRunStats.calls[ aTimer->stage ], 1 );
+}
+
+// ---------- BUFFER POOL ----------
+
+// image, strip and scratch buffers are recycled by size class, so a long run settles into reusing
+// the same few buffers instead of going back to the heap for every image
+typedef struct BufferHeader // sits in the bytes right before every buffer
+{
+    struct BufferHeader* next;  // free list link while the buffer is idle in a pool
+    void* block;                // start of the allocation
+    size_t size;                // usable bytes, the size of its class
+    int sizeClass;
+} BufferHeader;
+
+typedef struct BufferPool
+{
+    pthread_mutex_t lock;
+    BufferHeader* idle[ BUFFER_POOL_CLASSES ];
+    uint64_t idleBytes;
+    uint64_t maxIdleBytes;      // buffers released beyond this go back to the heap
+} BufferPool;
+
+// four classes per power of two from 64 bytes up, so a buffer is at most 25% larger than asked for
+static int getBufferClass( size_t aSize, size_t* aClassSize )
+{
+    if( aSize <= IMAGE_ALIGNMENT )
+    {
+        *aClassSize = IMAGE_ALIGNMENT;
+        return 0;
+    }
+    int theBit = 63 - __builtin_clzll( ( unsigned long long )( aSize - 1 ) );
+    size_t theQuarter = ( ( aSize - 1 ) >> ( theBit - 2 ) ) & 3;
+    if( theBit >= 48 )
+    {
+        return BUFFER_POOL_CLASSES;
+    }
+    *aClassSize = ( 5 + theQuarter ) << ( theBit - 2 );
+    return ( theBit - 6 ) * 4 + ( int )theQuarter + 1;
+}
+
+// aMaxIdleBytes bounds what the pool holds on to between images
+BufferPool* createBufferPool( uint64_t aMaxIdleBytes )
+{
+    BufferPool* thePool = calloc( 1, sizeof( BufferPool ) );
+    if( thePool )
+    {
+        pthread_mutex_init( &thePool->lock, NULL );
+        thePool->maxIdleBytes = aMaxIdleBytes;
+    }
+    return thePool;
+}
+
+void destroyBufferPool( BufferPool* aPool )
+{
+    if( aPool )
+    {
+        for( int i = 0; i < BUFFER_POOL_CLASSES; i++ )
+        {
+            while( aPool->idle[ i ] )
+            {
+                BufferHeader* theHeader = aPool->idle[ i ];
+                aPool->idle[ i ] = theHeader->next;
+                free( theHeader->block );
+            }
+        }
+        pthread_mutex_destroy( &aPool->lock );
+        free( aPool );
+    }
+}
+
+// cache line aligned, page aligned from a page up so O_DIRECT can write it; the contents are
+// undefined. aPool may be NULL to allocate it fresh, tracked for the allocation high-water mark
+void* allocateImageBuffer( BufferPool* aPool, size_t aSize )
+{
+    size_t theSize;
+    int theClass = getBufferClass( aSize, &theSize );
+    if( theClass >= BUFFER_POOL_CLASSES )
+    {
+        return NULL;
+    }
+
+    BufferHeader* theHeader = NULL;
+    if( aPool )
+    {
+        pthread_mutex_lock( &aPool->lock );
+        theHeader = aPool->idle[ theClass ];
+        if( theHeader )
+        {
+            aPool->idle[ theClass ] = theHeader->next;
+            aPool->idleBytes -= theSize;
+        }
+        pthread_mutex_unlock( &aPool->lock );
+    }
+    if( theHeader )
+    {
+        addRunCounter( &gRunStats.bufferReuses, 1 );
+    }
+    else
+    {
+        size_t theAlignment = theSize >= DIRECT_IO_ALIGNMENT ? DIRECT_IO_ALIGNMENT : IMAGE_ALIGNMENT;
+        void* theBlock;
+        if( posix_memalign( &theBlock, theAlignment, theAlignment + theSize ) != 0 )
+        {
+            return NULL;
+        }
+        theHeader = ( BufferHeader* )( ( uint8_t* )theBlock + theAlignment ) - 1;
+        theHeader->block = theBlock;
+        theHeader->size = theSize;
+        theHeader->sizeClass = theClass;
+        addRunCounter( &gRunStats.bufferAllocations, 1 );
+    }
+
+    uint64_t theAllocated = __atomic_add_fetch( &gRunStats.allocatedBytes, theSize, __ATOMIC_RELAXED );
+    uint64_t thePeak = __atomic_load_n( &gRunStats.peakAllocatedBytes, __ATOMIC_RELAXED );
+    while( theAllocated > thePeak && !__atomic_compare_exchange_n( &gRunStats.peakAllocatedBytes, &thePeak, theAllocated, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED ) )
+    {
+    }
+    return theHeader + 1;
+}
+
+// hands aBuffer back to aPool, or to the heap if aPool is NULL or full; any pool takes any buffer
+void freeImageBuffer( BufferPool* aPool, void* aBuffer )
+{
+    if( !aBuffer )
+    {
+        return;
+    }
+    BufferHeader* theHeader = ( BufferHeader* )aBuffer - 1;
+    __atomic_sub_fetch( &gRunStats.allocatedBytes, ( uint64_t )theHeader->size, __ATOMIC_RELAXED );
+    if( aPool )
+    {
+        pthread_mutex_lock( &aPool->lock );
+        if( aPool->idleBytes + theHeader->size <= aPool->maxIdleBytes )
+        {
+            theHeader->next = aPool->idle[ theHeader->sizeClass ];
+            aPool->idle[ theHeader->sizeClass ] = theHeader;
+            aPool->idleBytes += theHeader->size;
+            theHeader = NULL;
+        }
+        pthread_mutex_unlock( &aPool->lock );
+    }
+    if( theHeader )
+    {
+        free( theHeader->block );
+    }
+}
+
+// ---------- HEADER READ FUNCTIONS ----------
+
+BITMAPFILEHEADER readBitmapFileHeader( FILE* aFile )
+{
+    BITMAPFILEHEADER theHeader;
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesRead, fread( &theHeader, 1, sizeof( BITMAPFILEHEADER ), aFile ) );
+        logMessage( "Bitmap file header read.\n" );
+    }
+    return theHeader;
+}
+
+BITMAPCOREHEADER readBitmapCoreHeader( FILE* aFile )
+{
+    BITMAPCOREHEADER theHeader;
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesRead, fread( &theHeader, 1, sizeof( BITMAPCOREHEADER ), aFile ) );
+        logMessage( "Information header read: BITMAP CORE\n" );
+    }
+    return theHeader;
+}
+
+BITMAPINFOHEADER readBitmapInfoHeader( FILE* aFile )
+{
+    BITMAPINFOHEADER theHeader;
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesRead, fread( &theHeader, 1, sizeof( BITMAPINFOHEADER ), aFile ) );
+        logMessage( "Information header read: BITMAP INFO\n" );
+    }
+    return theHeader;
+}
+
+BITMAPV4HEADER readBitmapV4Header( FILE* aFile )
+{
+    BITMAPV4HEADER theHeader;
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesRead, fread( &theHeader, 1, sizeof( BITMAPV4HEADER ), aFile ) );
+        logMessage( "Information header read: BITMAP V4\n" );
+    }
+    return theHeader;
+}
+
+BITMAPV5HEADER readBitmapV5Header( FILE* aFile )
+{
+    BITMAPV5HEADER theHeader;
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesRead, fread( &theHeader, 1, sizeof( BITMAPV5HEADER ), aFile ) );
+        logMessage( "Information header read: BITMAP V5\n" );
+    }
+    return theHeader;
+}
+
+// ---------- HEADER WRITE FUNCTIONS ----------
+
+void writeBitmapFileHeader( BITMAPFILEHEADER aHeader, FILE* aFile )
+{
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( &aHeader, 1, sizeof( BITMAPFILEHEADER ), aFile ) );
+    }
+}
+
+void writeBitmapCoreHeader( BITMAPCOREHEADER aHeader, FILE* aFile )
+{
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( &aHeader, 1, sizeof( BITMAPCOREHEADER ), aFile ) );
+    }
+}
+
+void writeBitmapInfoHeader( BITMAPINFOHEADER aHeader, FILE* aFile )
+{
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( &aHeader, 1, sizeof( BITMAPINFOHEADER ), aFile ) );
+    }
+}
+
+void writeBitmapV4Header( BITMAPV4HEADER aHeader, FILE* aFile )
+{
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( &aHeader, 1, sizeof( BITMAPV4HEADER ), aFile ) );
+    }
+}
+
+void writeBitmapV5Header( BITMAPV5HEADER aHeader, FILE* aFile )
+{
+    if( aFile )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( &aHeader, 1, sizeof( BITMAPV5HEADER ), aFile ) );
+    }
+}
+
+// ---------- COMBINED HEADER FUNCTIONS ----------
+
+// offset just past the information header; only equal to image_offset when there is no palette
+uint32_t getBitmapHeaderEnd( const BitmapHeaders* aHeaders )
+{
+    // header_size sits at the same place in every variant
+    return sizeof( BITMAPFILEHEADER ) + aHeaders->infoHeader.header_size;
+}
+
+// bytes taken by one palette entry: RGBTRIPLE for core headers, RGBQUAD for the rest
+uint32_t getBitmapPaletteEntrySize( const BitmapHeaders* aHeaders )
+{
+    return getBitmapHeaderEnd( aHeaders ) == BITMAPCOREHEADER_IMAGE_OFFSET ? 3 : 4;
+}
+
+// a plain info header keeps its bit masks right after itself, V4 and V5 headers have fields for them
+uint32_t getBitmapMaskBytes( const BitmapHeaders* aHeaders )
+{
+    return getBitmapHeaderEnd( aHeaders ) == BITMAPINFOHEADER_IMAGE_OFFSET && aHeaders->compression == BITMAP_COMPRESSION_BITFIELDS ? 3 * sizeof( uint32_t ) : 0;
+}
+
+// bit masks and palette, everything this program stores between the headers and the pixels
+uint32_t getBitmapColorTableSize( const BitmapHeaders* aHeaders )
+{
+    return getBitmapMaskBytes( aHeaders ) + aHeaders->numColors * getBitmapPaletteEntrySize( aHeaders );
+}
+
+// bytes in a row as stored on disk, padding included; in 64 bits, so no header width can overflow it
+static uint64_t calculateRowBytes( int32_t aImageWidth, uint16_t aBitsPerPixel )
+{
+    uint64_t theWidth = aImageWidth > 0 ? ( uint64_t )aImageWidth : 0;
+    return ( ( uint64_t )aBitsPerPixel * theWidth + 31 ) / 32 * 4;
+}
+
+// picks up the width, height, bit count and compression from whichever information header was read;
+// returns 0 for pixel formats that cannot be processed
+int finishBitmapHeaders( BitmapHeaders* aHeaders )
+{
+    switch( getBitmapHeaderEnd( aHeaders ) )
+    {
+        case BITMAPCOREHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->width = aHeaders->coreHeader.width_px;
+            aHeaders->height = aHeaders->coreHeader.height_px;
+            aHeaders->bitsPerPixel = aHeaders->coreHeader.bits_per_pixel;
+            aHeaders->compression = BITMAP_COMPRESSION_RGB;
+            break;
+        }
+        case BITMAPINFOHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->width = aHeaders->infoHeader.width_px;
+            aHeaders->height = aHeaders->infoHeader.height_px;
+            aHeaders->bitsPerPixel = aHeaders->infoHeader.bits_per_pixel;
+            aHeaders->compression = aHeaders->infoHeader.compression;
+            break;
+        }
+        case BITMAPV4HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->width = aHeaders->v4Header.bV4Width;
+            aHeaders->height = aHeaders->v4Header.bV4Height;
+            aHeaders->bitsPerPixel = aHeaders->v4Header.bV4BitCount;
+            aHeaders->compression = aHeaders->v4Header.bV4V4Compression;
+            if( aHeaders->compression == BITMAP_COMPRESSION_BITFIELDS )
+            {
+                aHeaders->colorMasks[ 0 ] = aHeaders->v4Header.bV4BlueMask;
+                aHeaders->colorMasks[ 1 ] = aHeaders->v4Header.bV4GreenMask;
+                aHeaders->colorMasks[ 2 ] = aHeaders->v4Header.bV4RedMask;
+            }
+            break;
+        }
+        case BITMAPV5HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->width = aHeaders->v5Header.bV5Width;
+            aHeaders->height = aHeaders->v5Header.bV5Height;
+            aHeaders->bitsPerPixel = aHeaders->v5Header.bV5BitCount;
+            aHeaders->compression = aHeaders->v5Header.bV5Compression;
+            if( aHeaders->compression == BITMAP_COMPRESSION_BITFIELDS )
+            {
+                aHeaders->colorMasks[ 0 ] = aHeaders->v5Header.bV5BlueMask;
+                aHeaders->colorMasks[ 1 ] = aHeaders->v5Header.bV5GreenMask;
+                aHeaders->colorMasks[ 2 ] = aHeaders->v5Header.bV5RedMask;
+            }
+            break;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
+    if( aHeaders->height == INT32_MIN || aHeaders->width < 0 )
+    {
+        return 0;
+    }
+    aHeaders->topDown = aHeaders->height < 0;
+    aHeaders->height = abs( aHeaders->height );
+
+    // rejected before anything is allocated from them
+    uint64_t theRowBytes = calculateRowBytes( aHeaders->width, aHeaders->bitsPerPixel );
+    if( theRowBytes > MAX_BITMAP_ROW_BYTES || theRowBytes * aHeaders->height > MAX_BITMAP_IMAGE_BYTES ||
+        theRowBytes * aHeaders->height > SIZE_MAX )
+    {
+        return 0;
+    }
+
+    // uncompressed 16 and 32 bpp pixels use fixed masks, 5-5-5 and 8-8-8
+    if( aHeaders->compression == BITMAP_COMPRESSION_RGB && aHeaders->bitsPerPixel == 16 )
+    {
+        aHeaders->colorMasks[ 0 ] = 0x001F;
+        aHeaders->colorMasks[ 1 ] = 0x03E0;
+        aHeaders->colorMasks[ 2 ] = 0x7C00;
+    }
+    else if( aHeaders->compression == BITMAP_COMPRESSION_RGB && aHeaders->bitsPerPixel == 32 )
+    {
+        aHeaders->colorMasks[ 0 ] = 0x000000FF;
+        aHeaders->colorMasks[ 1 ] = 0x0000FF00;
+        aHeaders->colorMasks[ 2 ] = 0x00FF0000;
+    }
+
+    switch( aHeaders->bitsPerPixel )
+    {
+        case 4:
+        {
+            return aHeaders->compression == BITMAP_COMPRESSION_RGB || ( aHeaders->compression == BITMAP_COMPRESSION_RLE4 && !aHeaders->topDown );
+        }
+        case 8:
+        {
+            return aHeaders->compression == BITMAP_COMPRESSION_RGB || ( aHeaders->compression == BITMAP_COMPRESSION_RLE8 && !aHeaders->topDown );
+        }
+        case 1:
+        case 24:
+        {
+            return aHeaders->compression == BITMAP_COMPRESSION_RGB;
+        }
+        case 16:
+        case 32:
+        {
+            return aHeaders->compression == BITMAP_COMPRESSION_RGB || aHeaders->compression == BITMAP_COMPRESSION_BITFIELDS;
+        }
+    }
+    return 0;
+}
+
+// picks up the bit masks and palette stored between the information header and the pixels
+void readBitmapColorTable( BitmapHeaders* aHeaders, const uint8_t* aTable, size_t aSize )
+{
+    size_t theMaskBytes = getBitmapMaskBytes( aHeaders );
+    if( theMaskBytes && aSize >= theMaskBytes )
+    {
+        // stored red, green, blue
+        for( int c = 0; c < 3; c++ )
+        {
+            memcpy( &aHeaders->colorMasks[ 2 - c ], aTable + c * sizeof( uint32_t ), sizeof( uint32_t ) );
+        }
+    }
+
+    aHeaders->numColors = 0;
+    if( aHeaders->bitsPerPixel <= 8 )
+    {
+        uint32_t theMaxColors = 1u << aHeaders->bitsPerPixel;
+        uint32_t theEntrySize = getBitmapPaletteEntrySize( aHeaders );
+
+        // num_colors sits at the same place in the info, V4 and V5 headers, 0 means all of them
+        uint32_t theNumColors = theMaxColors;
+        if( theEntrySize == 4 && aHeaders->infoHeader.num_colors > 0 && aHeaders->infoHeader.num_colors < theMaxColors )
+        {
+            theNumColors = aHeaders->infoHeader.num_colors;
+        }
+        size_t theAvailable = aSize > theMaskBytes ? ( aSize - theMaskBytes ) / theEntrySize : 0;
+        if( theNumColors > theAvailable )
+        {
+            theNumColors = ( uint32_t )theAvailable;
+        }
+
+        for( uint32_t i = 0; i < theNumColors; i++ )
+        {
+            const uint8_t* theEntry = aTable + theMaskBytes + i * theEntrySize;
+            aHeaders->palette[ i ].blue = theEntry[ 0 ];
+            aHeaders->palette[ i ].green = theEntry[ 1 ];
+            aHeaders->palette[ i ].red = theEntry[ 2 ];
+        }
+        aHeaders->numColors = theNumColors;
+    }
+}
+
+// reads every header and the color table, leaving aFile at the first pixel
+int readBitmapHeaders( FILE* aFile, BitmapHeaders* aHeaders )
+{
+    StageTimer theTimer = beginStage( stageHeader );
+    memset( aHeaders, 0, sizeof( BitmapHeaders ) );
+    aHeaders->fileHeader = readBitmapFileHeader( aFile );
+
+    // the information header variant is told apart by its size, the first field of every variant
+    uint32_t theHeaderSize = 0;
+    if( fread( &theHeaderSize, sizeof( uint32_t ), 1, aFile ) != 1 || fseek( aFile, -( long )sizeof( uint32_t ), SEEK_CUR ) != 0 )
+    {
+        endStage( &theTimer );
+        return 0;
+    }
+
+    switch( sizeof( BITMAPFILEHEADER ) + theHeaderSize )
+    {
+        case BITMAPCOREHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->coreHeader = readBitmapCoreHeader( aFile );
+            break;
+        }
+        case BITMAPINFOHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->infoHeader = readBitmapInfoHeader( aFile );
+            break;
+        }
+        case BITMAPV4HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v4Header = readBitmapV4Header( aFile );
+            break;
+        }
+        case BITMAPV5HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v5Header = readBitmapV5Header( aFile );
+            break;
+        }
+    }
+
+    int theResult = finishBitmapHeaders( aHeaders ) && aHeaders->fileHeader.image_offset >= getBitmapHeaderEnd( aHeaders );
+    if( theResult )
+    {
+        uint8_t theTable[ 3 * sizeof( uint32_t ) + 256 * 4 ];
+        size_t theTableSize = aHeaders->fileHeader.image_offset - getBitmapHeaderEnd( aHeaders );
+        if( theTableSize > sizeof( theTable ) )
+        {
+            theTableSize = sizeof( theTable );
+        }
+        theTableSize = fread( theTable, 1, theTableSize, aFile );
+        addRunCounter( &gRunStats.bytesRead, theTableSize );
+        readBitmapColorTable( aHeaders, theTable, theTableSize );
+
+        // anything else stored before the pixels is skipped
+        theResult = fseek( aFile, aHeaders->fileHeader.image_offset, SEEK_SET ) == 0;
+    }
+    endStage( &theTimer );
+    return theResult;
+}
+
+void writeBitmapHeaders( const BitmapHeaders* aHeaders, FILE* aFile )
+{
+    writeBitmapFileHeader( aHeaders->fileHeader, aFile );
+    switch( getBitmapHeaderEnd( aHeaders ) )
+    {
+        case BITMAPCOREHEADER_IMAGE_OFFSET:
+        {
+            writeBitmapCoreHeader( aHeaders->coreHeader, aFile );
+            break;
+        }
+        case BITMAPINFOHEADER_IMAGE_OFFSET:
+        {
+            writeBitmapInfoHeader( aHeaders->infoHeader, aFile );
+            break;
+        }
+        case BITMAPV4HEADER_IMAGE_OFFSET:
+        {
+            writeBitmapV4Header( aHeaders->v4Header, aFile );
+            break;
+        }
+        case BITMAPV5HEADER_IMAGE_OFFSET:
+        {
+            writeBitmapV5Header( aHeaders->v5Header, aFile );
+            break;
+        }
+    }
+}
+
+// writes what getBitmapColorTableSize accounts for, right after the headers
+void writeBitmapColorTable( const BitmapHeaders* aHeaders, FILE* aFile )
+{
+    uint8_t theTable[ 3 * sizeof( uint32_t ) + 256 * 4 ];
+    uint32_t theMaskBytes = getBitmapMaskBytes( aHeaders );
+    uint32_t theEntrySize = getBitmapPaletteEntrySize( aHeaders );
+    for( uint32_t c = 0; c < theMaskBytes / sizeof( uint32_t ); c++ )
+    {
+        memcpy( theTable + c * sizeof( uint32_t ), &aHeaders->colorMasks[ 2 - c ], sizeof( uint32_t ) );
+    }
+    for( uint32_t i = 0; i < aHeaders->numColors; i++ )
+    {
+        uint8_t* theEntry = theTable + theMaskBytes + i * theEntrySize;
+        theEntry[ 0 ] = aHeaders->palette[ i ].blue;
+        theEntry[ 1 ] = aHeaders->palette[ i ].green;
+        theEntry[ 2 ] = aHeaders->palette[ i ].red;
+        if( theEntrySize == 4 )
+        {
+            theEntry[ 3 ] = 0;
+        }
+    }
+
+    uint32_t theSize = getBitmapColorTableSize( aHeaders );
+    if( aFile && theSize > 0 )
+    {
+        addRunCounter( &gRunStats.bytesWritten, fwrite( theTable, 1, theSize, aFile ) );
+    }
+}
+
+// ---------- IMAGE DATA FUNCTIONS ----------
+
+int calculatePaddingSize( int32_t aImageWidth, uint16_t aBitsPerPixel )
+{
+    // number of pixels in a row, divide by 8 to convert bits to bytes, a partial byte counts whole
+    uint64_t thePixelDataPerRow = ( ( uint64_t )aBitsPerPixel * ( aImageWidth > 0 ? aImageWidth : 0 ) + 7 ) / 8;
+
+    // padding must bring row size to next multiple of 4
+    return ( int )( calculateRowBytes( aImageWidth, aBitsPerPixel ) - thePixelDataPerRow );
+}
+
+// finishBitmapHeaders keeps the stride of every image read within MAX_BITMAP_ROW_BYTES
+uint32_t calculateRowStride( int32_t aImageWidth, uint16_t aBitsPerPixel )
+{
+    return ( uint32_t )calculateRowBytes( aImageWidth, aBitsPerPixel );
+}
+
+// updates the dimensions and bit count, along with every size field derived from them; aHeight
+// is the number of rows, topDown decides the sign stored (core headers are always bottom-up)
+void setBitmapHeaderGeometry( BitmapHeaders* aHeaders, int32_t aWidth, int32_t aHeight, uint16_t aBitsPerPixel )
+{
+    // the size fields are 32 bits, the pixels of larger images are still written in full
+    uint32_t theImageSize = ( uint32_t )( calculateRowBytes( aWidth, aBitsPerPixel ) * ( uint64_t )abs( aHeight ) );
+    int32_t theHeight = aHeaders->topDown ? -abs( aHeight ) : abs( aHeight );
+    aHeaders->fileHeader.size = aHeaders->fileHeader.image_offset + theImageSize;
+    switch( getBitmapHeaderEnd( aHeaders ) )
+    {
+        case BITMAPCOREHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->coreHeader.width_px = ( uint16_t )aWidth;
+            aHeaders->coreHeader.height_px = ( uint16_t )abs( aHeight );
+            aHeaders->coreHeader.bits_per_pixel = aBitsPerPixel;
+            break;
+        }
+        case BITMAPINFOHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->infoHeader.width_px = aWidth;
+            aHeaders->infoHeader.height_px = theHeight;
+            aHeaders->infoHeader.bits_per_pixel = aBitsPerPixel;
+            aHeaders->infoHeader.image_size_bytes = theImageSize;
+            break;
+        }
+        case BITMAPV4HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v4Header.bV4Width = aWidth;
+            aHeaders->v4Header.bV4Height = theHeight;
+            aHeaders->v4Header.bV4BitCount = aBitsPerPixel;
+            aHeaders->v4Header.bV4SizeImage = theImageSize;
+            break;
+        }
+        case BITMAPV5HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v5Header.bV5Width = aWidth;
+            aHeaders->v5Header.bV5Height = theHeight;
+            aHeaders->v5Header.bV5BitCount = aBitsPerPixel;
+            aHeaders->v5Header.bV5SizeImage = theImageSize;
+            break;
+        }
+    }
+    finishBitmapHeaders( aHeaders );
+}
+
+// gives the image a palette of aNumColors entries, filled in by the caller, and moves the pixels
+// behind it; call setBitmapHeaderGeometry afterwards so the sizes follow
+void setBitmapHeaderPalette( BitmapHeaders* aHeaders, uint32_t aNumColors )
+{
+    if( getBitmapHeaderEnd( aHeaders ) != BITMAPCOREHEADER_IMAGE_OFFSET )
+    {
+        // compression and the color counts sit at the same place in the info, V4 and V5 headers
+        aHeaders->infoHeader.compression = BITMAP_COMPRESSION_RGB;
+        aHeaders->infoHeader.num_colors = aNumColors;
+        aHeaders->infoHeader.important_colors = 0;
+    }
+    aHeaders->compression = BITMAP_COMPRESSION_RGB;
+    aHeaders->numColors = aNumColors;
+    aHeaders->fileHeader.image_offset = getBitmapHeaderEnd( aHeaders ) + getBitmapColorTableSize( aHeaders );
+}
+
+// switches the pixel storage, e.g. to write an uncompressed copy of an RLE image; core headers have no choice
+void setBitmapHeaderCompression( BitmapHeaders* aHeaders, uint32_t aCompression )
+{
+    if( getBitmapHeaderEnd( aHeaders ) != BITMAPCOREHEADER_IMAGE_OFFSET )
+    {
+        // compression sits at the same place in the info, V4 and V5 headers
+        aHeaders->infoHeader.compression = aCompression;
+        aHeaders->compression = aCompression;
+    }
+}
+
+// a 256 level gray ramp, for 8 bpp gray outputs
+void setGrayBitmapPalette( BitmapHeaders* aHeaders )
+{
+    for( int i = 0; i < 256; i++ )
+    {
+        aHeaders->palette[ i ].blue = ( uint8_t )i;
+        aHeaders->palette[ i ].green = ( uint8_t )i;
+        aHeaders->palette[ i ].red = ( uint8_t )i;
+    }
+    setBitmapHeaderPalette( aHeaders, 256 );
+}
+
+// headers for a new uncompressed image; aImageOffset selects the information header variant
+BitmapHeaders createBitmapHeaders( uint32_t aImageOffset, int32_t aWidth, int32_t aHeight, uint16_t aBitsPerPixel )
+{
+    BitmapHeaders theHeaders;
+    memset( &theHeaders, 0, sizeof( BitmapHeaders ) );
+    theHeaders.fileHeader.type = 0x4D42; // "BM"
+    theHeaders.fileHeader.image_offset = aImageOffset;
+
+    // header_size and the plane count sit at the same place in every variant
+    theHeaders.infoHeader.header_size = aImageOffset - sizeof( BITMAPFILEHEADER );
+    if( aImageOffset == BITMAPCOREHEADER_IMAGE_OFFSET )
+    {
+        theHeaders.coreHeader.num_planes = 1;
+    }
+    else
+    {
+        theHeaders.infoHeader.num_planes = 1;
+        theHeaders.infoHeader.x_resolution_ppm = 2835; // 72 dpi
+        theHeaders.infoHeader.y_resolution_ppm = 2835;
+    }
+
+    setBitmapHeaderGeometry( &theHeaders, aWidth, aHeight, aBitsPerPixel );
+    return theHeaders;
+}
+
+BitmapColor* imageRow( const BitmapImage* aImage, int32_t aRow )
+{
+    return ( BitmapColor* )( aImage->data + ( ptrdiff_t )aRow * aImage->stride );
+}
+
+// reverses the row order of aImage without moving any pixels; doing it twice restores the image
+void flipImageRows( BitmapImage* aImage )
+{
+    if( aImage->height > 0 )
+    {
+        aImage->data += ( ptrdiff_t )( aImage->height - 1 ) * aImage->stride;
+    }
+    aImage->stride = -aImage->stride;
+}
+
+// aBuffers may be NULL to allocate the pixels fresh
+BitmapImage allocateImageMemory( BufferPool* aBuffers, int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel )
+{
+    BitmapImage theImage;
+    theImage.width = aImageWidth > 0 ? aImageWidth : 0;
+    theImage.height = aImageHeight > 0 ? aImageHeight : 0;
+    theImage.bitsPerPixel = aBitsPerPixel;
+    theImage.stride = calculateRowStride( theImage.width, aBitsPerPixel );
+    theImage.data = NULL;
+
+    // one allocation for the whole image, rows laid out exactly like the pixel array on disk
+    size_t theSize = ( size_t )theImage.stride * theImage.height;
+    if( theSize > 0 )
+    {
+        theImage.data = allocateImageBuffer( aBuffers, theSize );
+    }
+
+    return theImage;
+}
+
+void clearImagePadding( BitmapImage* aImage )
+{
+    uint32_t theRowBytes = ( aImage->bitsPerPixel * aImage->width + 7 ) / 8;
+    if( theRowBytes < ( uint32_t )aImage->stride )
+    {
+        for( int32_t y = 0; y < aImage->height; y++ )
+        {
+            memset( aImage->data + ( size_t )y * aImage->stride + theRowBytes, 0, aImage->stride - theRowBytes );
+        }
+    }
+}
+
+int calculateStripRows( const BitmapImage* aImage, size_t aStripBytes )
+{
+    int theStripRows = aImage->stride != 0 ? ( int )( aStripBytes / abs( aImage->stride ) ) : 1;
+    if( theStripRows < 1 )
+    {
+        theStripRows = 1;
+    }
+    if( theStripRows > aImage->height )
+    {
+        theStripRows = aImage->height;
+    }
+    return theStripRows;
+}
+
+BitmapImage readImageData( BufferPool* aBuffers, int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel, FILE* aFile )
+{
+    BitmapImage theImage = allocateImageMemory( aBuffers, aImageWidth, aImageHeight, aBitsPerPixel );
+    if( !theImage.data )
+    {
+        return theImage;
+    }
+
+    // the buffer has the same layout as the pixel array, so it all comes in with one read
+    StageTimer theTimer = beginStage( stageRead );
+    size_t theSize = ( size_t )theImage.stride * theImage.height;
+    size_t theBytesRead = fread( theImage.data, sizeof( uint8_t ), theSize, aFile );
+    addRunCounter( &gRunStats.bytesRead, theBytesRead );
+    if( theBytesRead < theSize )
+    {
+        // truncated file, missing rows come out black
+        memset( theImage.data + theBytesRead, 0, theSize - theBytesRead );
+    }
+
+    // padding bytes in the file are not guaranteed to be zero, output files should have clean padding
+    clearImagePadding( &theImage );
+    endStage( &theTimer );
+
+    return theImage;
+}
+
+void copyImageData( BitmapImage* aDataDest, const BitmapImage* aDataSrc )
+{
+    memcpy( aDataDest->data, aDataSrc->data, ( size_t )aDataSrc->stride * aDataSrc->height );
+}
+
+void freeImageData( BufferPool* aBuffers, BitmapImage* aImage )
+{
+    if( aImage->stride < 0 )
+    {
+        // the allocation starts at the last row of a reversed image
+        flipImageRows( aImage );
+    }
+    freeImageBuffer( aBuffers, aImage->data );
+    aImage->data = NULL;
+}
+
+void writeImageData( const BitmapImage* aImage, FILE* aFile )
+{
+    // the padding lives in the buffer, so the whole pixel array goes out with one write
+    StageTimer theTimer = beginStage( stageWrite );
+    addRunCounter( &gRunStats.bytesWritten, fwrite( aImage->data, sizeof( uint8_t ), ( size_t )aImage->stride * aImage->height, aFile ) );
+    endStage( &theTimer );
+}
+
+// ---------- MEMORY MAPPED INPUT ----------
+
+int mapBitmapFile( const char* aFilename, MappedFile* aMapping )
+{
+    aMapping->fd = open( aFilename, O_RDONLY );
+    aMapping->data = NULL;
+    aMapping->size = 0;
+    if( aMapping->fd < 0 )
+    {
+        return 0;
+    }
+
+    struct stat theStat;
+    if( fstat( aMapping->fd, &theStat ) != 0 || theStat.st_size < ( off_t )sizeof( BITMAPFILEHEADER ) )
+    {
+        close( aMapping->fd );
+        aMapping->fd = -1;
+        return 0;
+    }
+
+    void* theData = mmap( NULL, theStat.st_size, PROT_READ, MAP_PRIVATE, aMapping->fd, 0 );
+    if( theData == MAP_FAILED )
+    {
+        close( aMapping->fd );
+        aMapping->fd = -1;
+        return 0;
+    }
+
+    // pixels are consumed front to back, let the kernel read ahead aggressively
+    madvise( theData, theStat.st_size, MADV_SEQUENTIAL );
+
+    aMapping->data = ( uint8_t* )theData;
+    aMapping->size = theStat.st_size;
+    return 1;
+}
+
+void unmapBitmapFile( MappedFile* aMapping )
+{
+    if( aMapping->data )
+    {
+        munmap( aMapping->data, aMapping->size );
+        aMapping->data = NULL;
+    }
+    if( aMapping->fd >= 0 )
+    {
+        close( aMapping->fd );
+        aMapping->fd = -1;
+    }
+}
+
+// headers are taken straight from the mapping, no stdio in between
+int mapBitmapHeaders( const MappedFile* aMapping, BitmapHeaders* aHeaders )
+{
+    StageTimer theTimer = beginStage( stageHeader );
+    memset( aHeaders, 0, sizeof( BitmapHeaders ) );
+    if( aMapping->size < sizeof( BITMAPFILEHEADER ) + sizeof( uint32_t ) )
+    {
+        endStage( &theTimer );
+        return 0;
+    }
+    aHeaders->fileHeader = *( const BITMAPFILEHEADER* )aMapping->data;
+    logMessage( "Bitmap file header read.\n" );
+
+    // the information header variant is told apart by its size, the first field of every variant
+    const uint8_t* theInfoHeader = aMapping->data + sizeof( BITMAPFILEHEADER );
+    uint32_t theHeaderSize;
+    memcpy( &theHeaderSize, theInfoHeader, sizeof( uint32_t ) );
+    if( theHeaderSize > aMapping->size - sizeof( BITMAPFILEHEADER ) || aHeaders->fileHeader.image_offset > aMapping->size
+        || aHeaders->fileHeader.image_offset < sizeof( BITMAPFILEHEADER ) + theHeaderSize )
+    {
+        endStage( &theTimer );
+        return 0;
+    }
+
+    switch( sizeof( BITMAPFILEHEADER ) + theHeaderSize )
+    {
+        case BITMAPCOREHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->coreHeader = *( const BITMAPCOREHEADER* )theInfoHeader;
+            logMessage( "Information header read: BITMAP CORE\n" );
+            break;
+        }
+        case BITMAPINFOHEADER_IMAGE_OFFSET:
+        {
+            aHeaders->infoHeader = *( const BITMAPINFOHEADER* )theInfoHeader;
+            logMessage( "Information header read: BITMAP INFO\n" );
+            break;
+        }
+        case BITMAPV4HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v4Header = *( const BITMAPV4HEADER* )theInfoHeader;
+            logMessage( "Information header read: BITMAP V4\n" );
+            break;
+        }
+        case BITMAPV5HEADER_IMAGE_OFFSET:
+        {
+            aHeaders->v5Header = *( const BITMAPV5HEADER* )theInfoHeader;
+            logMessage( "Information header read: BITMAP V5\n" );
+            break;
+        }
+    }
+    int theResult = finishBitmapHeaders( aHeaders );
+    if( theResult )
+    {
+        uint32_t theHeaderEnd = getBitmapHeaderEnd( aHeaders );
+        readBitmapColorTable( aHeaders, aMapping->data + theHeaderEnd, aHeaders->fileHeader.image_offset - theHeaderEnd );
+    }
+    addRunCounter( &gRunStats.bytesRead, aHeaders->fileHeader.image_offset );
+    endStage( &theTimer );
+    return theResult;
+}
+
+// returns an image whose rows point into the mapping, nothing is copied; only a truncated file is
+// copied into a buffer from aBuffers, its missing rows black as readImageData makes them, and
+// *aOwned is set so the caller frees it
+BitmapImage mapImageData( BufferPool* aBuffers, const BitmapHeaders* aHeaders, const MappedFile* aMapping, int* aOwned )
+{
+    BitmapImage theImage;
+    theImage.width = aHeaders->width > 0 ? aHeaders->width : 0;
+    theImage.height = aHeaders->height > 0 ? aHeaders->height : 0;
+    theImage.bitsPerPixel = aHeaders->bitsPerPixel;
+    theImage.stride = calculateRowStride( theImage.width, theImage.bitsPerPixel );
+    theImage.data = NULL;
+    *aOwned = 0;
+
+    size_t theSize = ( size_t )theImage.stride * theImage.height;
+    size_t theOffset = aHeaders->fileHeader.image_offset;
+    if( theOffset + theSize <= aMapping->size )
+    {
+        theImage.data = aMapping->data + theOffset;
+        return theImage;
+    }
+
+    theImage = allocateImageMemory( aBuffers, theImage.width, theImage.height, theImage.bitsPerPixel );
+    if( theImage.data )
+    {
+        size_t theAvailable = theOffset < aMapping->size ? aMapping->size - theOffset : 0;
+        memcpy( theImage.data, aMapping->data + theOffset, theAvailable );
+        memset( theImage.data + theAvailable, 0, theSize - theAvailable );
+        clearImagePadding( &theImage );
+        *aOwned = 1;
+    }
+    return theImage;
+}
+
+// ---------- CPU TOPOLOGY ----------
+
+// parses a sysfs cpulist such as "0-3,8-11"
+static void parseCpuList( const char* aList, cpu_set_t* aSet )
+{
+    CPU_ZERO( aSet );
+    const char* c = aList;
+    for( ;; )
+    {
+        char* theEnd;
+        long theFirst = strtol( c, &theEnd, 10 );
+        if( theEnd == c )
+        {
+            return;
+        }
+        long theLast = theFirst;
+        if( *theEnd == '-' )
+        {
+            c = theEnd + 1;
+            theLast = strtol( c, &theEnd, 10 );
+        }
+        for( long i = theFirst; i <= theLast && i < CPU_SETSIZE; i++ )
+        {
+            CPU_SET( i, aSet );
+        }
+        if( *theEnd != ',' )
+        {
+            return;
+        }
+        c = theEnd + 1;
+    }
+}
+
+// picks a CPU for each of aNumThreads workers out of the ones this process may run on; workers
+// are split into contiguous groups, one per NUMA node, so neighbouring bands of rows share a node
+static void assignWorkerCpus( int aNumThreads, int* aCpus, int* aNodes )
+{
+    cpu_set_t theAllowed;
+    if( sched_getaffinity( 0, sizeof( theAllowed ), &theAllowed ) != 0 )
+    {
+        CPU_ZERO( &theAllowed );
+        for( int i = 0; i < getDefaultThreadCount() && i < CPU_SETSIZE; i++ )
+        {
+            CPU_SET( i, &theAllowed );
+        }
+    }
+
+    static cpu_set_t theNodeCpus[ MAX_NUMA_NODES ];
+    int theNodeIds[ MAX_NUMA_NODES ];
+    int theNumNodes = 0;
+    for( int n = 0; n < MAX_NUMA_NODES; n++ )
+    {
+        char thePath[ 64 ];
+        char theList[ 1024 ];
+        snprintf( thePath, sizeof( thePath ), "/sys/devices/system/node/node%d/cpulist", n );
+        FILE* theFile = fopen( thePath, "r" );
+        if( !theFile )
+        {
+            continue;
+        }
+        int theRead = fgets( theList, sizeof( theList ), theFile ) != NULL;
+        fclose( theFile );
+
+        // memory only nodes and nodes outside our affinity mask get no workers
+        cpu_set_t theCpus;
+        parseCpuList( theRead ? theList : "", &theCpus );
+        CPU_AND( &theCpus, &theCpus, &theAllowed );
+        if( CPU_COUNT( &theCpus ) > 0 )
+        {
+            theNodeCpus[ theNumNodes ] = theCpus;
+            theNodeIds[ theNumNodes ] = n;
+            theNumNodes++;
+        }
+    }
+    if( theNumNodes == 0 )
+    {
+        // no NUMA information: a single node
+        theNodeCpus[ 0 ] = theAllowed;
+        theNodeIds[ 0 ] = 0;
+        theNumNodes = 1;
+    }
+
+    for( int i = 0; i < aNumThreads; i++ )
+    {
+        int theNode = ( int )( ( int64_t )i * theNumNodes / aNumThreads );
+        int theFirstWorker = ( int )( ( ( int64_t )theNode * aNumThreads + theNumNodes - 1 ) / theNumNodes );
+        int theSlot = ( i - theFirstWorker ) % CPU_COUNT( &theNodeCpus[ theNode ] );
+        for( int theCpu = 0; theCpu < CPU_SETSIZE; theCpu++ )
+        {
+            if( CPU_ISSET( theCpu, &theNodeCpus[ theNode ] ) && theSlot-- == 0 )
+            {
+                aCpus[ i ] = theCpu;
+                break;
+            }
+        }
+        aNodes[ i ] = theNodeIds[ theNode ];
+    }
+}
+
+// ---------- WORKER POOL ----------
+
+// processes the half-open index range [aBegin, aEnd) of a parallel job
+typedef void ( *WorkerTask )( void* aContext, int aBegin, int aEnd );
+
+typedef struct
+{
+    struct WorkerPool* pool;
+    int index;
+    int cpu;                   // pinned pools only
+    int node;
+    uint64_t busyNanoseconds;  // time spent inside tasks, only written by the owning thread
+} __attribute__(( aligned( 64 ) )) WorkerSlot;
+
+typedef struct WorkerPool
+{
+    pthread_t* threads;        // background workers, the calling thread is the last worker unless pinned
+    WorkerSlot* slots;         // one per thread, the calling thread uses the last one
+    int numThreads;            // total number of threads working on a job
+    int pinned;                // every worker is a background thread bound to one CPU
+    pthread_mutex_t lock;
+    pthread_cond_t workReady;  // signalled when a new job is published
+    pthread_cond_t workDone;   // signalled when the last busy worker runs out of chunks
+    WorkerTask task;
+    void* context;
+    int nextIndex;             // shared queue: next chunk to hand out
+    int endIndex;
+    int chunkSize;
+    int busyWorkers;
+    int banded;                // the job is split into one fixed band per worker instead of a shared queue
+    int pendingBands;
+    unsigned long generation;  // bumped once per job so sleeping workers notice new work
+    int shutdown;
+} WorkerPool;
+
+int getDefaultThreadCount( void )
+{
+    long theCount = sysconf( _SC_NPROCESSORS_ONLN );
+    return theCount > 0 ? ( int )theCount : 1;
+}
+
+// claims chunks of job aGeneration only: a worker that woke late for a job which has since been
+// completed must not take chunks of the next one, above all not the bands of a banded job
+static void runWorkerChunks( WorkerPool* aPool, WorkerSlot* aSlot, unsigned long aGeneration )
+{
+    for( ;; )
+    {
+        pthread_mutex_lock( &aPool->lock );
+        int theBegin = aPool->nextIndex;
+        int theEnd = aPool->endIndex;
+        WorkerTask theTask = aPool->task;
+        void* theContext = aPool->context;
+        if( aPool->generation != aGeneration || theBegin >= theEnd )
+        {
+            pthread_mutex_unlock( &aPool->lock );
+            return;
+        }
+        aPool->nextIndex = theBegin + aPool->chunkSize;
+        pthread_mutex_unlock( &aPool->lock );
+
+        if( theEnd > theBegin + aPool->chunkSize )
+        {
+            theEnd = theBegin + aPool->chunkSize;
+        }
+        uint64_t theStart = readClockNanoseconds( CLOCK_MONOTONIC );
+        theTask( theContext, theBegin, theEnd );
+        aSlot->busyNanoseconds += readClockNanoseconds( CLOCK_MONOTONIC ) - theStart;
+    }
+}
+
+// worker aSlot's share of a banded job, always the same range of indices for the same count
+static void runWorkerBand( WorkerPool* aPool, WorkerSlot* aSlot )
+{
+    pthread_mutex_lock( &aPool->lock );
+    WorkerTask theTask = aPool->task;
+    void* theContext = aPool->context;
+    int theCount = aPool->endIndex;
+    int theChunkSize = aPool->chunkSize;
+    pthread_mutex_unlock( &aPool->lock );
+
+    int theBegin = ( int )( ( int64_t )theCount * aSlot->index / aPool->numThreads );
+    int theEnd = ( int )( ( int64_t )theCount * ( aSlot->index + 1 ) / aPool->numThreads );
+    uint64_t theStart = readClockNanoseconds( CLOCK_MONOTONIC );
+    for( int i = theBegin; i < theEnd; i += theChunkSize )
+    {
+        theTask( theContext, i, theEnd - i > theChunkSize ? i + theChunkSize : theEnd );
+    }
+    aSlot->busyNanoseconds += readClockNanoseconds( CLOCK_MONOTONIC ) - theStart;
+
+    pthread_mutex_lock( &aPool->lock );
+    if( --aPool->pendingBands == 0 )
+    {
+        pthread_cond_signal( &aPool->workDone );
+    }
+    pthread_mutex_unlock( &aPool->lock );
+}
+
+static void* workerPoolThread( void* args )
+{
+    WorkerSlot* theSlot = ( WorkerSlot* )args;
+    WorkerPool* thePool = theSlot->pool;
+    unsigned long theSeenGeneration = 0;
+
+    pthread_mutex_lock( &thePool->lock );
+    for( ;; )
+    {
+        while( !thePool->shutdown && thePool->generation == theSeenGeneration )
+        {
+            pthread_cond_wait( &thePool->workReady, &thePool->lock );
+        }
+        if( thePool->shutdown )
+        {
+            break;
+        }
+
+        theSeenGeneration = thePool->generation;
+        if( thePool->banded )
+        {
+            pthread_mutex_unlock( &thePool->lock );
+            runWorkerBand( thePool, theSlot );
+            pthread_mutex_lock( &thePool->lock );
+            continue;
+        }
+        thePool->busyWorkers++;
+        pthread_mutex_unlock( &thePool->lock );
+
+        runWorkerChunks( thePool, theSlot, theSeenGeneration );
+
+        pthread_mutex_lock( &thePool->lock );
+        thePool->busyWorkers--;
+        if( thePool->busyWorkers == 0 )
+        {
+            pthread_cond_signal( &thePool->workDone );
+        }
+    }
+    pthread_mutex_unlock( &thePool->lock );
+
+    return NULL;
+}
+
+// a pinned pool binds its workers to CPUs spread over the NUMA nodes and has the calling thread
+// wait instead of working, so every band of a banded job runs on a known node
+WorkerPool* createWorkerPool( int aNumThreads, int aPinned )
+{
+    WorkerPool* thePool = calloc( 1, sizeof( WorkerPool ) );
+    if( !thePool )
+    {
+        return NULL;
+    }
+
+    thePool->numThreads = aNumThreads > 0 ? aNumThreads : 1;
+    pthread_mutex_init( &thePool->lock, NULL );
+    pthread_cond_init( &thePool->workReady, NULL );
+    pthread_cond_init( &thePool->workDone, NULL );
+
+    thePool->threads = malloc( sizeof( pthread_t ) * thePool->numThreads );
+    if( posix_memalign( ( void** )&thePool->slots, sizeof( WorkerSlot ), sizeof( WorkerSlot ) * thePool->numThreads ) != 0 )
+    {
+        thePool->slots = NULL;
+    }
+    if( !thePool->threads || !thePool->slots )
+    {
+        free( thePool->threads );
+        free( thePool->slots );
+        free( thePool );
+        return NULL;
+    }
+    int* theCpus = aPinned ? malloc( sizeof( int ) * 2 * thePool->numThreads ) : NULL;
+    int* theNodes = theCpus ? theCpus + thePool->numThreads : NULL;
+    aPinned = theCpus != NULL;
+    if( aPinned )
+    {
+        assignWorkerCpus( thePool->numThreads, theCpus, theNodes );
+    }
+    for( int i = 0; i < thePool->numThreads; i++ )
+    {
+        thePool->slots[ i ].pool = thePool;
+        thePool->slots[ i ].index = i;
+        thePool->slots[ i ].cpu = aPinned ? theCpus[ i ] : -1;
+        thePool->slots[ i ].node = aPinned ? theNodes[ i ] : -1;
+        thePool->slots[ i ].busyNanoseconds = 0;
+    }
+    free( theCpus );
+
+    // the thread that calls runParallel works too, so only numThreads - 1 are spawned unless pinned;
+    // pinned threads start on their CPU, so their stacks are allocated on its node
+    thePool->pinned = aPinned;
+    int theNumSpawned = aPinned ? thePool->numThreads : thePool->numThreads - 1;
+    for( int i = 0; i < theNumSpawned; i++ )
+    {
+        pthread_attr_t theAttributes;
+        pthread_attr_init( &theAttributes );
+        if( aPinned )
+        {
+            cpu_set_t theCpu;
+            CPU_ZERO( &theCpu );
+            CPU_SET( thePool->slots[ i ].cpu, &theCpu );
+            pthread_attr_setaffinity_np( &theAttributes, sizeof( theCpu ), &theCpu );
+        }
+        int theCreated = pthread_create( &thePool->threads[ i ], &theAttributes, workerPoolThread, &thePool->slots[ i ] ) == 0;
+        pthread_attr_destroy( &theAttributes );
+        if( !theCreated )
+        {
+            // the calling thread takes over the first slot that has no thread, a pinned pool just shrinks
+            thePool->numThreads = aPinned ? i : i + 1;
+            if( thePool->numThreads == 0 )
+            {
+                thePool->numThreads = 1;
+                thePool->pinned = 0;
+            }
+            break;
+        }
+    }
+
+    return thePool;
+}
+
+void destroyWorkerPool( WorkerPool* aPool )
+{
+    if( aPool )
+    {
+        pthread_mutex_lock( &aPool->lock );
+        aPool->shutdown = 1;
+        pthread_cond_broadcast( &aPool->workReady );
+        pthread_mutex_unlock( &aPool->lock );
+
+        for( int i = 0; i < ( aPool->pinned ? aPool->numThreads : aPool->numThreads - 1 ); i++ )
+        {
+            pthread_join( aPool->threads[ i ], NULL );
+        }
+
+        pthread_cond_destroy( &aPool->workDone );
+        pthread_cond_destroy( &aPool->workReady );
+        pthread_mutex_destroy( &aPool->lock );
+        free( aPool->threads );
+        free( aPool->slots );
+        free( aPool );
+    }
+}
+
+// returns the generation of the new job
+static unsigned long publishWorkerJob( WorkerPool* aPool, int aCount, int aChunkSize, WorkerTask aTask, void* aContext, int aBanded )
+{
+    pthread_mutex_lock( &aPool->lock );
+    aPool->task = aTask;
+    aPool->context = aContext;
+    aPool->nextIndex = 0;
+    aPool->endIndex = aCount;
+    aPool->chunkSize = aChunkSize > 0 ? aChunkSize : 1;
+    aPool->banded = aBanded;
+    aPool->pendingBands = aBanded ? aPool->numThreads : 0;
+    unsigned long theGeneration = ++aPool->generation;
+    pthread_cond_broadcast( &aPool->workReady );
+    pthread_mutex_unlock( &aPool->lock );
+    return theGeneration;
+}
+
+// splits [0, aCount) into chunks of aChunkSize and blocks until every chunk has been processed
+void runParallel( WorkerPool* aPool, int aCount, int aChunkSize, WorkerTask aTask, void* aContext )
+{
+    if( aCount <= 0 )
+    {
+        return;
+    }
+
+    if( !aPool || ( aPool->numThreads <= 1 && !aPool->pinned ) )
+    {
+        uint64_t theStart = readClockNanoseconds( CLOCK_MONOTONIC );
+        aTask( aContext, 0, aCount );
+        if( aPool )
+        {
+            aPool->slots[ 0 ].busyNanoseconds += readClockNanoseconds( CLOCK_MONOTONIC ) - theStart;
+        }
+        return;
+    }
+
+    unsigned long theGeneration = publishWorkerJob( aPool, aCount, aChunkSize, aTask, aContext, 0 );
+    if( !aPool->pinned )
+    {
+        runWorkerChunks( aPool, &aPool->slots[ aPool->numThreads - 1 ], theGeneration );
+    }
+
+    pthread_mutex_lock( &aPool->lock );
+    while( aPool->nextIndex < aPool->endIndex || aPool->busyWorkers > 0 )
+    {
+        pthread_cond_wait( &aPool->workDone, &aPool->lock );
+    }
+    pthread_mutex_unlock( &aPool->lock );
+}
+
+// like runParallel, but a pinned pool gives every worker the same fixed band of [0, aCount) each time,
+// so passes over the same rows touch memory from the node that first touched it
+void runParallelBands( WorkerPool* aPool, int aCount, int aChunkSize, WorkerTask aTask, void* aContext )
+{
+    if( !aPool || !aPool->pinned || aCount <= 0 )
+    {
+        runParallel( aPool, aCount, aChunkSize, aTask, aContext );
+        return;
+    }
+
+    publishWorkerJob( aPool, aCount, aChunkSize, aTask, aContext, 1 );
+    pthread_mutex_lock( &aPool->lock );
+    while( aPool->pendingBands > 0 )
+    {
+        pthread_cond_wait( &aPool->workDone, &aPool->lock );
+    }
+    pthread_mutex_unlock( &aPool->lock );
+}
+
+// ---------- CONTENT HASHING ----------
+
+#define HASH_PRIME_1 11400714785074694791ull
+#define HASH_PRIME_2 14029467366897019727ull
+#define HASH_PRIME_3 1609587929392839161ull
+#define HASH_PRIME_4 9650029242287828579ull
+#define HASH_PRIME_5 2870177450012600261ull
+
+static inline uint64_t rotateLeft64( uint64_t aValue, int aBits )
+{
+    return ( aValue << aBits ) | ( aValue >> ( 64 - aBits ) );
+}
+
+static inline uint64_t readLittle64( const uint8_t* aData )
+{
+    uint64_t theValue;
+    memcpy( &theValue, aData, sizeof( theValue ) );
+    return theValue;
+}
+
+static inline uint64_t hashRound( uint64_t aAccumulator, uint64_t aInput )
+{
+    return rotateLeft64( aAccumulator + aInput * HASH_PRIME_2, 31 ) * HASH_PRIME_1;
+}
+
+static inline uint64_t hashMergeRound( uint64_t aHash, uint64_t aAccumulator )
+{
+    return ( aHash ^ hashRound( 0, aAccumulator ) ) * HASH_PRIME_1 + HASH_PRIME_4;
+}
+
+// XXH64: four independent lanes over 32 byte stripes, several GB/s on one core
+uint64_t hashBytes( const void* aData, size_t aSize, uint64_t aSeed )
+{
+    const uint8_t* theData = ( const uint8_t* )aData;
+    const uint8_t* theEnd = theData + aSize;
+    uint64_t theHash;
+    if( aSize >= 32 )
+    {
+        uint64_t theLanes[ 4 ] = { aSeed + HASH_PRIME_1 + HASH_PRIME_2, aSeed + HASH_PRIME_2, aSeed, aSeed - HASH_PRIME_1 };
+        for( ; theData + 32 <= theEnd; theData += 32 )
+        {
+            for( int i = 0; i < 4; i++ )
+            {
+                theLanes[ i ] = hashRound( theLanes[ i ], readLittle64( theData + 8 * i ) );
+            }
+        }
+        theHash = rotateLeft64( theLanes[ 0 ], 1 ) + rotateLeft64( theLanes[ 1 ], 7 ) + rotateLeft64( theLanes[ 2 ], 12 ) + rotateLeft64( theLanes[ 3 ], 18 );
+        for( int i = 0; i < 4; i++ )
+        {
+            theHash = hashMergeRound( theHash, theLanes[ i ] );
+        }
+    }
+    else
+    {
+        theHash = aSeed + HASH_PRIME_5;
+    }
+
+    theHash += aSize;
+    for( ; theData + 8 <= theEnd; theData += 8 )
+    {
+        theHash = rotateLeft64( theHash ^ hashRound( 0, readLittle64( theData ) ), 27 ) * HASH_PRIME_1 + HASH_PRIME_4;
+    }
+    if( theData + 4 <= theEnd )
+    {
+        uint32_t theValue;
+        memcpy( &theValue, theData, sizeof( theValue ) );
+        theHash = rotateLeft64( theHash ^ ( theValue * HASH_PRIME_1 ), 23 ) * HASH_PRIME_2 + HASH_PRIME_3;
+        theData += 4;
+    }
+    for( ; theData < theEnd; theData++ )
+    {
+        theHash = rotateLeft64( theHash ^ ( *theData * HASH_PRIME_5 ), 11 ) * HASH_PRIME_1;
+    }
+
+    theHash ^= theHash >> 33;
+    theHash *= HASH_PRIME_2;
+    theHash ^= theHash >> 29;
+    theHash *= HASH_PRIME_3;
+    theHash ^= theHash >> 32;
+    return theHash;
+}
+
+// hashes rows [aBegin, aEnd) of aImage, padding excluded, into aRowHashes; the read passes call it
+// on the rows they have just read, while those are still in cache. NULL hashes nothing
+static void hashImageRows( const BitmapImage* aImage, int aBegin, int aEnd, uint64_t* aRowHashes )
+{
+    if( aRowHashes )
+    {
+        size_t theRowBytes = ( ( size_t )aImage->bitsPerPixel * aImage->width + 7 ) / 8;
+        for( int y = aBegin; y < aEnd; y++ )
+        {
+            aRowHashes[ y ] = hashBytes( aImage->data + ( ptrdiff_t )y * aImage->stride, theRowBytes, 0 );
+        }
+    }
+}
+
+// ---------- NODE LOCAL BUFFERS ----------
+
+typedef struct
+{
+    BitmapImage* image;
+    int fd;
+    off_t offset;        // of the pixel array in the file
+    int firstRow;        // of the strip being read
+    size_t bytesRead;
+    uint64_t* rowHashes; // NULL unless the result cache needs the rows hashed
+} bandReadTaskArgs;
+
+// reads aSize bytes at aOffset, the part past the end of a truncated file comes out black;
+// returns the number of bytes actually read
+static size_t readFileRange( int aFd, uint8_t* aData, size_t aSize, off_t aOffset )
+{
+    size_t theDone = 0;
+    while( theDone < aSize )
+    {
+        ssize_t theRead = pread( aFd, aData + theDone, aSize - theDone, aOffset + theDone );
+        if( theRead < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( theRead <= 0 )
+        {
+            break;
+        }
+        theDone += theRead;
+    }
+    memset( aData + theDone, 0, aSize - theDone );
+    return theDone;
+}
+
+// worker pool task: reads rows of a strip straight into the image
+void readImageBands( void* aContext, int aBegin, int aEnd )
+{
+    bandReadTaskArgs* theTask = ( bandReadTaskArgs* )aContext;
+    size_t theRowOffset = ( size_t )theTask->image->stride * ( theTask->firstRow + aBegin );
+    size_t theDone = readFileRange( theTask->fd, theTask->image->data + theRowOffset, ( size_t )theTask->image->stride * ( aEnd - aBegin ), theTask->offset + theRowOffset );
+    hashImageRows( theTask->image, theTask->firstRow + aBegin, theTask->firstRow + aEnd, theTask->rowHashes );
+    __atomic_fetch_add( &theTask->bytesRead, theDone, __ATOMIC_RELAXED );
+}
+
+// worker pool task: zeroes rows of a fresh buffer so its pages land on the node of the worker given those rows
+void touchImageBands( void* aContext, int aBegin, int aEnd )
+{
+    BitmapImage* theImage = ( BitmapImage* )aContext;
+    memset( theImage->data + ( size_t )theImage->stride * aBegin, 0, ( size_t )theImage->stride * ( aEnd - aBegin ) );
+}
+
+// pinned pools: places the pages of a fresh strip buffer on the nodes of the workers that fill it
+void touchImageLocal( WorkerPool* aPool, BitmapImage* aImage )
+{
+    if( aPool && aPool->pinned )
+    {
+        runParallelBands( aPool, aImage->height, aImage->height, touchImageBands, aImage );
+    }
+}
+
+// readImageData for pinned pools and the result cache: the rows are read with pread by the workers.
+// Pinned pools read each strip of the fused pass with the workers that filter its rows, so those
+// pages are first touched, and allocated, on the filtering node. aRowHashes, if not NULL, gets the
+// hash of every row as it comes in
+BitmapImage readImageDataLocal( WorkerPool* aPool, BufferPool* aBuffers, int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel, FILE* aFile, uint64_t* aRowHashes )
+{
+    int thePinned = aPool && aPool->pinned;
+    off_t theOffset = thePinned || aRowHashes ? ftello( aFile ) : -1;
+    if( theOffset < 0 )
+    {
+        BitmapImage theImage = readImageData( aBuffers, aImageWidth, aImageHeight, aBitsPerPixel, aFile );
+        hashImageRows( &theImage, 0, theImage.data ? theImage.height : 0, aRowHashes );
+        return theImage;
+    }
+
+    BitmapImage theImage = allocateImageMemory( aBuffers, aImageWidth, aImageHeight, aBitsPerPixel );
+    if( !theImage.data )
+    {
+        return theImage;
+    }
+
+    StageTimer theTimer = beginStage( stageRead );
+    bandReadTaskArgs theTask = { &theImage, fileno( aFile ), theOffset, 0, 0, aRowHashes };
+    int theStripRows = calculateStripRows( &theImage, FUSED_STRIP_BYTES );
+    for( ; theTask.firstRow < theImage.height; theTask.firstRow += theStripRows )
+    {
+        // a band per pinned worker, else chunks small enough to spread the strip over the pool
+        int theRows = theImage.height - theTask.firstRow < theStripRows ? theImage.height - theTask.firstRow : theStripRows;
+        int theChunkRows = thePinned || !aPool ? theRows : theRows / ( aPool->numThreads * 4 );
+        runParallelBands( aPool, theRows, theChunkRows > 0 ? theChunkRows : 1, readImageBands, &theTask );
+    }
+    addRunCounter( &gRunStats.bytesRead, theTask.bytesRead );
+    fseeko( aFile, theOffset + theTask.bytesRead, SEEK_SET );
+
+    clearImagePadding( &theImage );
+    endStage( &theTimer );
+    return theImage;
+}
+
+// ---------- REGION OF INTEREST ----------
+
+// parses "x,y,width,height", x and y counted from the top left corner
+int parseImageRegion( const char* aSpec, ImageRegion* aRegion )
+{
+    char theExtra;
+    return sscanf( aSpec, "%d,%d,%d,%d%c", &aRegion->x, &aRegion->y, &aRegion->width, &aRegion->height, &theExtra ) == 4 &&
+           aRegion->x >= 0 && aRegion->y >= 0 && aRegion->width > 0 && aRegion->height > 0;
+}
+
+// cuts aRegion down to what lies inside the image; returns 0 if nothing does
+int clipImageRegion( ImageRegion* aRegion, int32_t aWidth, int32_t aHeight )
+{
+    if( aRegion->x >= aWidth || aRegion->y >= aHeight )
+    {
+        return 0;
+    }
+    if( aRegion->width > aWidth - aRegion->x )
+    {
+        aRegion->width = aWidth - aRegion->x;
+    }
+    if( aRegion->height > aHeight - aRegion->y )
+    {
+        aRegion->height = aHeight - aRegion->y;
+    }
+    return 1;
+}
+
+typedef struct
+{
+    const BitmapHeaders* headers;
+    const ImageRegion* region;
+    BitmapImage* image;
+    BufferPool* buffers;
+    int fd;
+    size_t bytesRead;
+    uint64_t* rowHashes; // NULL unless the result cache needs the rows hashed
+} regionReadTaskArgs;
+
+// worker pool task: one pread per row for the bytes under the region's columns; 1 and 4 bpp
+// windows that do not start on a byte are read into a line and shifted into place
+void readRegionRows( void* aContext, int aBegin, int aEnd )
+{
+    regionReadTaskArgs* theTask = ( regionReadTaskArgs* )aContext;
+    const BitmapHeaders* theHeaders = theTask->headers;
+    const ImageRegion* theRegion = theTask->region;
+    BitmapImage* theImage = theTask->image;
+    uint32_t theFileStride = calculateRowStride( theHeaders->width, theHeaders->bitsPerPixel );
+    uint64_t theFirstBit = ( uint64_t )theRegion->x * theHeaders->bitsPerPixel;
+    uint64_t theRowBits = ( uint64_t )theRegion->width * theHeaders->bitsPerPixel;
+    size_t theRowBytes = ( theRowBits + 7 ) / 8;
+    size_t theSpan = ( theFirstBit + theRowBits + 7 ) / 8 - theFirstBit / 8;
+    int theShift = theFirstBit % 8;
+    uint8_t* theLine = theShift ? allocateImageBuffer( theTask->buffers, theSpan ) : NULL;
+    size_t theBytesRead = 0;
+
+    for( int i = aBegin; i < aEnd; i++ )
+    {
+        // the window keeps the file's row order, so a bottom-up file starts at the window's last row
+        int64_t theFileRow = theHeaders->topDown ? theRegion->y + i : ( int64_t )theHeaders->height - theRegion->y - theRegion->height + i;
+        off_t theOffset = theHeaders->fileHeader.image_offset + theFileRow * theFileStride + theFirstBit / 8;
+        uint8_t* theRow = theImage->data + ( size_t )theImage->stride * i;
+        if( !theShift )
+        {
+            theBytesRead += readFileRange( theTask->fd, theRow, theSpan, theOffset );
+        }
+        else if( theLine )
+        {
+            theBytesRead += readFileRange( theTask->fd, theLine, theSpan, theOffset );
+            for( size_t b = 0; b < theRowBytes; b++ )
+            {
+                theRow[ b ] = ( uint8_t )( ( theLine[ b ] << theShift ) | ( b + 1 < theSpan ? theLine[ b + 1 ] >> ( 8 - theShift ) : 0 ) );
+            }
+        }
+        else
+        {
+            memset( theRow, 0, theRowBytes );
+        }
+
+        // bits past the last pixel are padding
+        if( theRowBits % 8 )
+        {
+            theRow[ theRowBytes - 1 ] &= ( uint8_t )( 0xFF << ( 8 - theRowBits % 8 ) );
+        }
+    }
+
+    freeImageBuffer( theTask->buffers, theLine );
+    hashImageRows( theImage, aBegin, aEnd, theTask->rowHashes );
+    __atomic_fetch_add( &theTask->bytesRead, theBytesRead, __ATOMIC_RELAXED );
+}
+
+// reads only the rows and columns of aRegion, clipped to the image beforehand, from an uncompressed
+// file; the result is laid out like a file of the region's size. aRowHashes as for readImageDataLocal
+BitmapImage readImageRegion( WorkerPool* aPool, BufferPool* aBuffers, const BitmapHeaders* aHeaders, int aFd, const ImageRegion* aRegion, uint64_t* aRowHashes )
+{
+    BitmapImage theImage = allocateImageMemory( aBuffers, aRegion->width, aRegion->height, aHeaders->bitsPerPixel );
+    if( !theImage.data )
+    {
+        return theImage;
+    }
+
+    StageTimer theTimer = beginStage( stageRead );
+    regionReadTaskArgs theTask = { aHeaders, aRegion, &theImage, aBuffers, aFd, 0, aRowHashes };
+    int theChunkSize = 1;
+    if( aPool && aPool->numThreads > 1 && theImage.height / ( aPool->numThreads * 4 ) > 1 )
+    {
+        theChunkSize = theImage.height / ( aPool->numThreads * 4 );
+    }
+    runParallel( aPool, theImage.height, theChunkSize, readRegionRows, &theTask );
+    addRunCounter( &gRunStats.bytesRead, theTask.bytesRead );
+    clearImagePadding( &theImage );
+    endStage( &theTimer );
+
+    return theImage;
+}
+
+// ---------- ASYNCHRONOUS OUTPUT ----------
+
+// output buffers go to the kernel through io_uring when it is available, or to a few writer
+// threads otherwise, so compute never waits on a write unless every buffer of an output is in flight
+typedef struct AsyncWrite // one buffer handed to the writer, which owns it until it is no longer busy
+{
+    int fd;
+    const uint8_t* data;
+    size_t size;
+    uint64_t offset;
+    size_t written;           // so far, a short write is resubmitted for the rest
+    int busy;
+    int error;                // errno of a failed write, 0 if none
+    struct AsyncWrite* next;  // writer threads: queue link
+} AsyncWrite;
+
+typedef struct AsyncWriter
+{
+    pthread_mutex_t lock;
+    pthread_cond_t completed;     // some write finished
+    pthread_cond_t queued;        // writer threads: a write is waiting
+    int stop;
+    int numThreads;
+    pthread_t threads[ ASYNC_WRITER_THREADS ]; // io_uring: the completion thread, otherwise the writers
+    AsyncWrite* head;             // writer threads: queued writes, oldest first
+    AsyncWrite* tail;
+    int ring;                     // io_uring descriptor, -1 for writer threads
+#ifdef HAVE_IO_URING
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+    unsigned inFlight;            // submitted and not reaped, at most ASYNC_RING_ENTRIES
+#endif
+} AsyncWriter;
+
+static void queueAsyncWrite( AsyncWriter* aWriter, AsyncWrite* aWrite );
+
+// called with the lock held once a write returned aResult
+static void completeAsyncWrite( AsyncWriter* aWriter, AsyncWrite* aWrite, ssize_t aResult )
+{
+    if( aResult <= 0 )
+    {
+        aWrite->error = aResult < 0 ? ( int )-aResult : EIO;
+        aWrite->busy = 0;
+    }
+    else if( ( aWrite->written += aResult ) < aWrite->size )
+    {
+        queueAsyncWrite( aWriter, aWrite );
+    }
+    else
+    {
+        aWrite->busy = 0;
+    }
+    pthread_cond_broadcast( &aWriter->completed );
+}
+
+#ifdef HAVE_IO_URING
+static AsyncWrite gDroppedRingWrite; // completion of a write that failed because the kernel would not take it
+
+static int enterRing( AsyncWriter* aWriter, unsigned aSubmit, unsigned aWait )
+{
+    int theResult;
+    do
+    {
+        theResult = ( int )syscall( __NR_io_uring_enter, aWriter->ring, aSubmit, aWait, aWait ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+    }
+    while( theResult < 0 && errno == EINTR );
+    return theResult;
+}
+
+// called with the lock held; a NULL aWrite queues a no-op that wakes the completion thread
+static void submitRingEntry( AsyncWriter* aWriter, AsyncWrite* aWrite )
+{
+    while( aWriter->inFlight >= ASYNC_RING_ENTRIES )
+    {
+        pthread_cond_wait( &aWriter->completed, &aWriter->lock );
+    }
+
+    unsigned theTail = *aWriter->sqTail;
+    unsigned theIndex = theTail & *aWriter->sqMask;
+    struct io_uring_sqe* theEntry = &aWriter->sqes[ theIndex ];
+    memset( theEntry, 0, sizeof( struct io_uring_sqe ) );
+    theEntry->opcode = IORING_OP_NOP;
+    if( aWrite )
+    {
+        theEntry->opcode = IORING_OP_WRITE;
+        theEntry->fd = aWrite->fd;
+        theEntry->addr = ( uint64_t )( uintptr_t )( aWrite->data + aWrite->written );
+        theEntry->len = ( uint32_t )( aWrite->size - aWrite->written );
+        theEntry->off = aWrite->offset + aWrite->written;
+        theEntry->flags = IOSQE_ASYNC; // a buffered write would otherwise copy into the page cache right here
+    }
+    theEntry->user_data = ( uint64_t )( uintptr_t )aWrite;
+    aWriter->sqArray[ theIndex ] = theIndex;
+    __atomic_store_n( aWriter->sqTail, theTail + 1, __ATOMIC_RELEASE );
+    aWriter->inFlight++;
+
+    // the kernel has taken the entry once the head moved past it. A refused entry is retried after
+    // a pause that lets the completion thread reap, nothing else may ever submit it; a write still
+    // refused after that fails, the wake-up no-op is retried until it goes in
+    int theError = 0;
+    for( int theAttempt = 0; ( int )( __atomic_load_n( aWriter->sqHead, __ATOMIC_ACQUIRE ) - theTail ) <= 0; theAttempt++ )
+    {
+        if( theAttempt > 0 )
+        {
+            if( aWrite && theAttempt > ASYNC_RING_SUBMIT_RETRIES )
+            {
+                // stays in the ring as a no-op, entries queued behind it in the meantime need it
+                theEntry->opcode = IORING_OP_NOP;
+                theEntry->flags = 0;
+                theEntry->user_data = ( uint64_t )( uintptr_t )&gDroppedRingWrite;
+                logMessage( "io_uring submission failed: %s\n", strerror( theError ) );
+                completeAsyncWrite( aWriter, aWrite, -theError );
+                return;
+            }
+            struct timespec theDeadline;
+            clock_gettime( CLOCK_REALTIME, &theDeadline );
+            theDeadline.tv_nsec += 1000000;
+            if( theDeadline.tv_nsec >= 1000000000 )
+            {
+                theDeadline.tv_sec++;
+                theDeadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait( &aWriter->completed, &aWriter->lock, &theDeadline );
+        }
+        theError = enterRing( aWriter, 1, 0 ) < 0 ? errno : EAGAIN;
+    }
+}
+
+static void* ringCompletionThread( void* args )
+{
+    AsyncWriter* theWriter = ( AsyncWriter* )args;
+    int theStop = 0;
+    while( !theStop )
+    {
+        enterRing( theWriter, 0, 1 );
+
+        pthread_mutex_lock( &theWriter->lock );
+        unsigned theHead = *theWriter->cqHead;
+        while( theHead != __atomic_load_n( theWriter->cqTail, __ATOMIC_ACQUIRE ) )
+        {
+            struct io_uring_cqe* theCompletion = &theWriter->cqes[ theHead & *theWriter->cqMask ];
+            AsyncWrite* theWrite = ( AsyncWrite* )( uintptr_t )theCompletion->user_data;
+            int theResult = theCompletion->res;
+            __atomic_store_n( theWriter->cqHead, ++theHead, __ATOMIC_RELEASE );
+            theWriter->inFlight--;
+            if( theWrite == &gDroppedRingWrite )
+            {
+                // failed when it could not be submitted
+            }
+            else if( theWrite )
+            {
+                completeAsyncWrite( theWriter, theWrite, theResult );
+            }
+            else
+            {
+                theStop = 1;
+            }
+        }
+        pthread_cond_broadcast( &theWriter->completed );
+        pthread_mutex_unlock( &theWriter->lock );
+    }
+    return NULL;
+}
+
+static void unmapRing( AsyncWriter* aWriter )
+{
+    if( aWriter->sqes )
+    {
+        munmap( aWriter->sqes, aWriter->sqesSize );
+    }
+    if( aWriter->cqRing && aWriter->cqRing != aWriter->sqRing )
+    {
+        munmap( aWriter->cqRing, aWriter->cqRingSize );
+    }
+    if( aWriter->sqRing )
+    {
+        munmap( aWriter->sqRing, aWriter->sqRingSize );
+    }
+    close( aWriter->ring );
+    aWriter->ring = -1;
+}
+
+// sets up the submission and completion rings; returns 0 where io_uring is missing or not allowed
+static int setupRing( AsyncWriter* aWriter )
+{
+    struct io_uring_params theParameters;
+    memset( &theParameters, 0, sizeof( theParameters ) );
+    aWriter->ring = ( int )syscall( __NR_io_uring_setup, ASYNC_RING_ENTRIES, &theParameters );
+    if( aWriter->ring < 0 )
+    {
+        aWriter->ring = -1;
+        return 0;
+    }
+    if( !( theParameters.features & IORING_FEAT_RW_CUR_POS ) )
+    {
+        // older than the kernels with IORING_OP_WRITE
+        close( aWriter->ring );
+        aWriter->ring = -1;
+        return 0;
+    }
+
+    aWriter->sqRingSize = theParameters.sq_off.array + theParameters.sq_entries * sizeof( unsigned );
+    aWriter->cqRingSize = theParameters.cq_off.cqes + theParameters.cq_entries * sizeof( struct io_uring_cqe );
+    if( theParameters.features & IORING_FEAT_SINGLE_MMAP )
+    {
+        aWriter->sqRingSize = aWriter->sqRingSize > aWriter->cqRingSize ? aWriter->sqRingSize : aWriter->cqRingSize;
+    }
+    aWriter->sqRing = mmap( NULL, aWriter->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aWriter->ring, IORING_OFF_SQ_RING );
+    if( aWriter->sqRing == MAP_FAILED )
+    {
+        aWriter->sqRing = NULL;
+        unmapRing( aWriter );
+        return 0;
+    }
+    aWriter->cqRing = aWriter->sqRing;
+    if( !( theParameters.features & IORING_FEAT_SINGLE_MMAP ) )
+    {
+        aWriter->cqRing = mmap( NULL, aWriter->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aWriter->ring, IORING_OFF_CQ_RING );
+    }
+    aWriter->sqesSize = theParameters.sq_entries * sizeof( struct io_uring_sqe );
+    aWriter->sqes = mmap( NULL, aWriter->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, aWriter->ring, IORING_OFF_SQES );
+    if( aWriter->cqRing == MAP_FAILED || aWriter->sqes == MAP_FAILED )
+    {
+        aWriter->cqRing = aWriter->cqRing == MAP_FAILED ? NULL : aWriter->cqRing;
+        aWriter->sqes = aWriter->sqes == MAP_FAILED ? NULL : aWriter->sqes;
+        unmapRing( aWriter );
+        return 0;
+    }
+
+    uint8_t* theSq = ( uint8_t* )aWriter->sqRing;
+    uint8_t* theCq = ( uint8_t* )aWriter->cqRing;
+    aWriter->sqHead = ( unsigned* )( theSq + theParameters.sq_off.head );
+    aWriter->sqTail = ( unsigned* )( theSq + theParameters.sq_off.tail );
+    aWriter->sqMask = ( unsigned* )( theSq + theParameters.sq_off.ring_mask );
+    aWriter->sqArray = ( unsigned* )( theSq + theParameters.sq_off.array );
+    aWriter->cqHead = ( unsigned* )( theCq + theParameters.cq_off.head );
+    aWriter->cqTail = ( unsigned* )( theCq + theParameters.cq_off.tail );
+    aWriter->cqMask = ( unsigned* )( theCq + theParameters.cq_off.ring_mask );
+    aWriter->cqes = ( struct io_uring_cqe* )( theCq + theParameters.cq_off.cqes );
+    aWriter->inFlight = 0;
+    return 1;
+}
+#endif
+
+static void* asyncWriterThread( void* args )
+{
+    AsyncWriter* theWriter = ( AsyncWriter* )args;
+    pthread_mutex_lock( &theWriter->lock );
+    for( ;; )
+    {
+        while( !theWriter->head && !theWriter->stop )
+        {
+            pthread_cond_wait( &theWriter->queued, &theWriter->lock );
+        }
+        AsyncWrite* theWrite = theWriter->head;
+        if( !theWrite )
+        {
+            break;
+        }
+        theWriter->head = theWrite->next;
+        if( !theWriter->head )
+        {
+            theWriter->tail = NULL;
+        }
+        pthread_mutex_unlock( &theWriter->lock );
+
+        ssize_t theResult = pwrite( theWrite->fd, theWrite->data + theWrite->written, theWrite->size - theWrite->written, ( off_t )( theWrite->offset + theWrite->written ) );
+        int theError = errno;
+
+        pthread_mutex_lock( &theWriter->lock );
+        completeAsyncWrite( theWriter, theWrite, theResult < 0 ? -theError : theResult );
+    }
+    pthread_mutex_unlock( &theWriter->lock );
+    return NULL;
+}
+
+// called with the lock held
+static void queueAsyncWrite( AsyncWriter* aWriter, AsyncWrite* aWrite )
+{
+#ifdef HAVE_IO_URING
+    if( aWriter->ring >= 0 )
+    {
+        submitRingEntry( aWriter, aWrite );
+        return;
+    }
+#endif
+    aWrite->next = NULL;
+    if( aWriter->tail )
+    {
+        aWriter->tail->next = aWrite;
+    }
+    else
+    {
+        aWriter->head = aWrite;
+    }
+    aWriter->tail = aWrite;
+    pthread_cond_signal( &aWriter->queued );
+}
+
+// aUseRing 0 always uses writer threads
+AsyncWriter* createAsyncWriter( int aUseRing )
+{
+    AsyncWriter* theWriter = calloc( 1, sizeof( AsyncWriter ) );
+    if( !theWriter )
+    {
+        return NULL;
+    }
+    pthread_mutex_init( &theWriter->lock, NULL );
+    pthread_cond_init( &theWriter->completed, NULL );
+    pthread_cond_init( &theWriter->queued, NULL );
+    theWriter->ring = -1;
+
+#ifdef HAVE_IO_URING
+    if( aUseRing && setupRing( theWriter ) )
+    {
+        if( pthread_create( &theWriter->threads[ 0 ], NULL, ringCompletionThread, theWriter ) == 0 )
+        {
+            theWriter->numThreads = 1;
+            return theWriter;
+        }
+        unmapRing( theWriter );
+    }
+#else
+    ( void )aUseRing;
+#endif
+
+    while( theWriter->numThreads < ASYNC_WRITER_THREADS &&
+           pthread_create( &theWriter->threads[ theWriter->numThreads ], NULL, asyncWriterThread, theWriter ) == 0 )
+    {
+        theWriter->numThreads++;
+    }
+    if( theWriter->numThreads == 0 )
+    {
+        pthread_cond_destroy( &theWriter->queued );
+        pthread_cond_destroy( &theWriter->completed );
+        pthread_mutex_destroy( &theWriter->lock );
+        free( theWriter );
+        return NULL;
+    }
+    return theWriter;
+}
+
+// the backend writing the outputs, as --stats reports it
+static const char* getAsyncWriterName( const AsyncWriter* aWriter )
+{
+    return !aWriter ? "synchronous" : ( aWriter->ring >= 0 ? "io_uring" : "threads" );
+}
+
+// every write must have been waited for
+void destroyAsyncWriter( AsyncWriter* aWriter )
+{
+    if( !aWriter )
+    {
+        return;
+    }
+    pthread_mutex_lock( &aWriter->lock );
+    aWriter->stop = 1;
+#ifdef HAVE_IO_URING
+    if( aWriter->ring >= 0 )
+    {
+        submitRingEntry( aWriter, NULL );
+    }
+#endif
+    pthread_cond_broadcast( &aWriter->queued );
+    pthread_mutex_unlock( &aWriter->lock );
+
+    for( int i = 0; i < aWriter->numThreads; i++ )
+    {
+        pthread_join( aWriter->threads[ i ], NULL );
+    }
+#ifdef HAVE_IO_URING
+    if( aWriter->ring >= 0 )
+    {
+        unmapRing( aWriter );
+    }
+#endif
+    pthread_cond_destroy( &aWriter->queued );
+    pthread_cond_destroy( &aWriter->completed );
+    pthread_mutex_destroy( &aWriter->lock );
+    free( aWriter );
+}
+
+// starts writing aSize bytes of aData at aOffset of aFd; without a writer the write happens right away
+void submitAsyncWrite( AsyncWriter* aWriter, AsyncWrite* aWrite, int aFd, const uint8_t* aData, size_t aSize, uint64_t aOffset )
+{
+    aWrite->fd = aFd;
+    aWrite->data = aData;
+    aWrite->size = aSize;
+    aWrite->offset = aOffset;
+    aWrite->written = 0;
+    aWrite->error = 0;
+    aWrite->busy = 1;
+    if( !aWriter )
+    {
+        while( aWrite->busy )
+        {
+            ssize_t theResult = pwrite( aFd, aData + aWrite->written, aSize - aWrite->written, ( off_t )( aOffset + aWrite->written ) );
+            if( theResult <= 0 )
+            {
+                aWrite->error = theResult < 0 ? errno : EIO;
+                aWrite->busy = 0;
+            }
+            else
+            {
+                aWrite->written += theResult;
+                aWrite->busy = aWrite->written < aSize;
+            }
+        }
+        return;
+    }
+
+    pthread_mutex_lock( &aWriter->lock );
+    queueAsyncWrite( aWriter, aWrite );
+    pthread_mutex_unlock( &aWriter->lock );
+}
+
+// blocks until aWrite is done with its buffer; returns its errno, 0 if it succeeded
+int waitAsyncWrite( AsyncWriter* aWriter, AsyncWrite* aWrite )
+{
+    if( aWriter )
+    {
+        pthread_mutex_lock( &aWriter->lock );
+        while( aWrite->busy )
+        {
+            pthread_cond_wait( &aWriter->completed, &aWriter->lock );
+        }
+        pthread_mutex_unlock( &aWriter->lock );
+    }
+    return aWrite->error;
+}
+
+typedef struct // an output file written a chunk at a time, carrying on from where its headers end
+{
+    AsyncWriter* writer;
+    BufferPool* buffers;          // the chunks come from it and go back to it
+    int fd;
+    int direct;                   // O_DIRECT: writes start, end and sit in memory at DIRECT_IO_ALIGNMENT
+    AsyncWrite writes[ OUTPUT_STREAM_CHUNKS ];
+    uint8_t* chunks[ OUTPUT_STREAM_CHUNKS ];
+    int numChunks;                // 0 once closed
+    size_t chunkBytes;            // a chunk is written once it holds this much, it has room for a block more
+    int current;                  // chunk being filled
+    size_t used;                  // bytes in it
+    uint64_t offset;              // file offset of its first byte
+    int error;                    // errno of the first failed write
+} OutputStream;
+
+// aFile holds the headers; they are flushed, everything after goes through the stream.
+// aSizeHint is roughly what will be appended, small outputs get a small chunk
+int openOutputStream( OutputStream* aStream, AsyncWriter* aWriter, BufferPool* aBuffers, FILE* aFile, uint64_t aSizeHint, int aDirect )
+{
+    memset( aStream, 0, sizeof( OutputStream ) );
+    fflush( aFile );
+    long theStart = ftell( aFile );
+    aStream->writer = aWriter;
+    aStream->buffers = aBuffers;
+    aStream->fd = fileno( aFile );
+    if( theStart < 0 )
+    {
+        return 0;
+    }
+
+    uint64_t theBytes = ( aSizeHint + theStart + DIRECT_IO_ALIGNMENT - 1 ) & ~( uint64_t )( DIRECT_IO_ALIGNMENT - 1 );
+    aStream->chunkBytes = theBytes < OUTPUT_CHUNK_BYTES ? theBytes : OUTPUT_CHUNK_BYTES;
+    aStream->numChunks = theBytes <= aStream->chunkBytes ? 1 : OUTPUT_STREAM_CHUNKS;
+    for( int i = 0; i < aStream->numChunks; i++ )
+    {
+        aStream->chunks[ i ] = allocateImageBuffer( aBuffers, aStream->chunkBytes + DIRECT_IO_ALIGNMENT );
+        if( !aStream->chunks[ i ] )
+        {
+            aStream->numChunks = i;
+            return 0;
+        }
+    }
+
+    // direct writes start on a block boundary, so the first block takes the end of the headers back in
+    aStream->offset = ( uint64_t )theStart;
+    if( aDirect )
+    {
+        aStream->offset &= ~( uint64_t )( DIRECT_IO_ALIGNMENT - 1 );
+        aStream->used = ( size_t )( theStart - aStream->offset );
+        int theFlags = fcntl( aStream->fd, F_GETFL );
+        aStream->direct = pread( aStream->fd, aStream->chunks[ 0 ], aStream->used, ( off_t )aStream->offset ) == ( ssize_t )aStream->used &&
+                          theFlags != -1 && fcntl( aStream->fd, F_SETFL, theFlags | O_DIRECT ) == 0;
+        if( !aStream->direct )
+        {
+            aStream->offset = ( uint64_t )theStart;
+            aStream->used = 0;
+        }
+    }
+    return 1;
+}
+
+// hands the filled part of the current chunk to the writer and moves on to the next one, once
+// its previous write is done; a direct stream keeps the partial block at the end for later
+static void flushOutputChunk( OutputStream* aStream, int aPad )
+{
+    size_t theSize = aStream->used;
+    if( aStream->direct )
+    {
+        theSize = aPad ? ( theSize + DIRECT_IO_ALIGNMENT - 1 ) & ~( size_t )( DIRECT_IO_ALIGNMENT - 1 ) : theSize & ~( size_t )( DIRECT_IO_ALIGNMENT - 1 );
+        memset( aStream->chunks[ aStream->current ] + aStream->used, 0, theSize > aStream->used ? theSize - aStream->used : 0 );
+    }
+    if( theSize == 0 )
+    {
+        return;
+    }
+
+    const uint8_t* theChunk = aStream->chunks[ aStream->current ];
+    size_t theTail = theSize < aStream->used ? aStream->used - theSize : 0;
+    submitAsyncWrite( aStream->writer, &aStream->writes[ aStream->current ], aStream->fd, theChunk, theSize, aStream->offset );
+    aStream->offset += theSize;
+    aStream->current = ( aStream->current + 1 ) % aStream->numChunks;
+
+    int theError = waitAsyncWrite( aStream->writer, &aStream->writes[ aStream->current ] );
+    aStream->error = aStream->error ? aStream->error : theError;
+    memmove( aStream->chunks[ aStream->current ], theChunk + theSize, theTail );
+    aStream->used = theTail;
+}
+
+void appendOutputStream( OutputStream* aStream, const uint8_t* aData, size_t aSize )
+{
+    if( aStream->numChunks == 0 )
+    {
+        return;
+    }
+    addRunCounter( &gRunStats.bytesWritten, aSize );
+    while( aSize > 0 )
+    {
+        size_t theBytes = aStream->chunkBytes - aStream->used;
+        theBytes = theBytes < aSize ? theBytes : aSize;
+        memcpy( aStream->chunks[ aStream->current ] + aStream->used, aData, theBytes );
+        aStream->used += theBytes;
+        aData += theBytes;
+        aSize -= theBytes;
+        if( aStream->used >= aStream->chunkBytes )
+        {
+            flushOutputChunk( aStream, 0 );
+        }
+    }
+}
+
+// whether reserveOutputStream can hand out aSize bytes
+int canReserveOutputStream( const OutputStream* aStream, size_t aSize )
+{
+    return aStream->numChunks > 0 && aSize <= aStream->chunkBytes;
+}
+
+// room for aSize bytes to be filled in place, so they are never copied before being written;
+// they are part of the stream once committed
+uint8_t* reserveOutputStream( OutputStream* aStream, size_t aSize )
+{
+    if( aStream->used + aSize > aStream->chunkBytes + DIRECT_IO_ALIGNMENT - 1 )
+    {
+        flushOutputChunk( aStream, 0 );
+    }
+    return aStream->chunks[ aStream->current ] + aStream->used;
+}
+
+void commitOutputStream( OutputStream* aStream, size_t aSize )
+{
+    addRunCounter( &gRunStats.bytesWritten, aSize );
+    aStream->used += aSize;
+    if( aStream->used >= aStream->chunkBytes )
+    {
+        flushOutputChunk( aStream, 0 );
+    }
+}
+
+// waits for the writes already submitted; io_uring cancels those of a thread that exits, so a
+// thread that appended to a stream calls this before it ends
+void drainOutputStream( OutputStream* aStream )
+{
+    for( int i = 0; i < aStream->numChunks; i++ )
+    {
+        int theError = waitAsyncWrite( aStream->writer, &aStream->writes[ i ] );
+        aStream->error = aStream->error ? aStream->error : theError;
+    }
+}
+
+// writes what is left and waits for every write; returns the errno of the first failed write, 0 if
+// none. aEnd receives the file size. A direct stream pads its last block and truncates the file back
+int closeOutputStream( OutputStream* aStream, uint64_t* aEnd )
+{
+    if( aStream->numChunks == 0 )
+    {
+        return aStream->error;
+    }
+
+    uint64_t theEnd = aStream->offset + aStream->used;
+    flushOutputChunk( aStream, 1 );
+    drainOutputStream( aStream );
+    for( int i = 0; i < aStream->numChunks; i++ )
+    {
+        freeImageBuffer( aStream->buffers, aStream->chunks[ i ] );
+        aStream->chunks[ i ] = NULL;
+    }
+    aStream->numChunks = 0;
+
+    if( aStream->direct )
+    {
+        // later patches of the headers are ordinary small writes
+        fcntl( aStream->fd, F_SETFL, fcntl( aStream->fd, F_GETFL ) & ~O_DIRECT );
+        if( ftruncate( aStream->fd, ( off_t )theEnd ) != 0 && !aStream->error )
+        {
+            aStream->error = errno;
+        }
+    }
+    if( aEnd )
+    {
+        *aEnd = theEnd;
+    }
+    return aStream->error;
+}
+
+// ---------- RUN-LENGTH ENCODED PIXELS ----------
+
+// where the codes of one row start; rows skipped by a delta code have no codes at all
+typedef struct
+{
+    size_t offset;   // SIZE_MAX: the row is left at color 0
+    int32_t x;       // a delta code can move a row's first pixel to the right
+} RleRowStart;
+
+typedef struct
+{
+    const uint8_t* codes;
+    size_t size;
+    const RleRowStart* rows;
+    BitmapImage* image;
+    uint64_t* rowHashes; // NULL unless the result cache needs the rows hashed
+} rleDecodeArgs;
+
+// bytes of pixel data following an absolute mode code for aCount pixels, padded to 16 bits
+static size_t rleAbsoluteBytes( uint32_t aCount, uint16_t aBitsPerPixel )
+{
+    size_t theBytes = aBitsPerPixel == 4 ? ( aCount + 1 ) / 2 : aCount;
+    return ( theBytes + 1 ) & ~( size_t )1;
+}
+
+static inline void setRlePixel( uint8_t* aRow, int32_t aX, uint8_t aValue, uint16_t aBitsPerPixel )
+{
+    if( aBitsPerPixel == 8 )
+    {
+        aRow[ aX ] = aValue;
+    }
+    else
+    {
+        // first pixel in the high nibble
+        int theShift = ( aX & 1 ) ? 0 : 4;
+        aRow[ aX / 2 ] = ( uint8_t )( ( aRow[ aX / 2 ] & ~( 0x0F << theShift ) ) | ( ( aValue & 0x0F ) << theShift ) );
+    }
+}
+
+// serial pass over the codes that only records where every row starts, cheap enough to leave
+// the actual decoding to the worker pool
+void scanRleRows( const uint8_t* aCodes, size_t aSize, int32_t aHeight, uint16_t aBitsPerPixel, RleRowStart* aRows )
+{
+    for( int32_t y = 0; y < aHeight; y++ )
+    {
+        aRows[ y ].offset = SIZE_MAX;
+        aRows[ y ].x = 0;
+    }
+
+    int32_t y = 0;
+    int32_t x = 0;
+    size_t i = 0;
+    if( aHeight > 0 )
+    {
+        aRows[ 0 ].offset = 0;
+    }
+    while( i + 1 < aSize && y < aHeight )
+    {
+        uint8_t theCount = aCodes[ i ];
+        uint8_t theCode = aCodes[ i + 1 ];
+        i += 2;
+        if( theCount > 0 )
+        {
+            x += theCount;
+            continue;
+        }
+
+        switch( theCode )
+        {
+            case 0: // end of line
+            {
+                y++;
+                x = 0;
+                if( y < aHeight )
+                {
+                    aRows[ y ].offset = i;
+                }
+                break;
+            }
+            case 1: // end of bitmap
+            {
+                return;
+            }
+            case 2: // delta, moves right and up
+            {
+                if( i + 2 > aSize )
+                {
+                    return;
+                }
+                x += aCodes[ i ];
+                int32_t theRows = aCodes[ i + 1 ];
+                i += 2;
+                if( theRows > 0 )
+                {
+                    y += theRows;
+                    if( y < aHeight )
+                    {
+                        aRows[ y ].offset = i;
+                        aRows[ y ].x = x;
+                    }
+                }
+                break;
+            }
+            default: // absolute run of theCode pixels
+            {
+                x += theCode;
+                i += rleAbsoluteBytes( theCode, aBitsPerPixel );
+                break;
+            }
+        }
+    }
+}
+
+// worker pool task: decodes rows [aBegin, aEnd) from the offsets found by scanRleRows
+void rleDecodeRows( void* aContext, int aBegin, int aEnd )
+{
+    rleDecodeArgs* theTask = ( rleDecodeArgs* )aContext;
+    const uint8_t* theCodes = theTask->codes;
+    BitmapImage* theImage = theTask->image;
+    uint16_t theBits = theImage->bitsPerPixel;
+
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        uint8_t* theRow = theImage->data + ( size_t )y * theImage->stride;
+        memset( theRow, 0, theImage->stride );
+        size_t i = theTask->rows[ y ].offset;
+        int32_t x = theTask->rows[ y ].x;
+        if( i == SIZE_MAX )
+        {
+            continue;
+        }
+
+        int theRowDone = 0;
+        while( !theRowDone && i + 1 < theTask->size )
+        {
+            uint8_t theCount = theCodes[ i ];
+            uint8_t theCode = theCodes[ i + 1 ];
+            i += 2;
+            if( theCount > 0 )
+            {
+                // encoded run; RLE4 alternates the two nibbles of theCode
+                for( int k = 0; k < theCount && x < theImage->width; k++, x++ )
+                {
+                    uint8_t theValue = theBits == 8 ? theCode : ( ( k & 1 ) ? theCode & 0x0F : theCode >> 4 );
+                    setRlePixel( theRow, x, theValue, theBits );
+                }
+                continue;
+            }
+
+            switch( theCode )
+            {
+                case 0:
+                case 1:
+                {
+                    theRowDone = 1;
+                    break;
+                }
+                case 2:
+                {
+                    if( i + 2 > theTask->size || theCodes[ i + 1 ] > 0 )
+                    {
+                        // moving up ends this row, scanRleRows started the next one
+                        theRowDone = 1;
+                    }
+                    else
+                    {
+                        x += theCodes[ i ];
+                        i += 2;
+                    }
+                    break;
+                }
+                default:
+                {
+                    size_t theBytes = rleAbsoluteBytes( theCode, theBits );
+                    if( i + theBytes > theTask->size )
+                    {
+                        theRowDone = 1;
+                        break;
+                    }
+                    for( int k = 0; k < theCode && x < theImage->width; k++, x++ )
+                    {
+                        uint8_t theValue = theBits == 8 ? theCodes[ i + k ] : ( ( k & 1 ) ? theCodes[ i + k / 2 ] & 0x0F : theCodes[ i + k / 2 ] >> 4 );
+                        setRlePixel( theRow, x, theValue, theBits );
+                    }
+                    i += theBytes;
+                    break;
+                }
+            }
+        }
+    }
+    hashImageRows( theImage, aBegin, aEnd, theTask->rowHashes );
+}
+
+// expands RLE8 or RLE4 codes into an uncompressed image, rows decoded in parallel; aRowHashes, if
+// not NULL, gets the hash of every decoded row
+BitmapImage decodeRleImageData( WorkerPool* aPool, BufferPool* aBuffers, const BitmapHeaders* aHeaders, const uint8_t* aCodes, size_t aSize, uint64_t* aRowHashes )
+{
+    BitmapImage theImage = allocateImageMemory( aBuffers, aHeaders->width, aHeaders->height, aHeaders->bitsPerPixel );
+    RleRowStart* theRows = allocateImageBuffer( aBuffers, sizeof( RleRowStart ) * ( theImage.height > 0 ? theImage.height : 1 ) );
+    if( !theImage.data || !theRows )
+    {
+        freeImageData( aBuffers, &theImage );
+        freeImageBuffer( aBuffers, theRows );
+        return theImage;
+    }
+
+    StageTimer theTimer = beginStage( stageRead );
+    scanRleRows( aCodes, aSize, theImage.height, theImage.bitsPerPixel, theRows );
+    rleDecodeArgs theTask = { aCodes, aSize, theRows, &theImage, aRowHashes };
+    int theChunkSize = 1;
+    if( aPool && aPool->numThreads > 1 && theImage.height / ( aPool->numThreads * 8 ) > 1 )
+    {
+        theChunkSize = theImage.height / ( aPool->numThreads * 8 );
+    }
+    runParallel( aPool, theImage.height, theChunkSize, rleDecodeRows, &theTask );
+    endStage( &theTimer );
+
+    freeImageBuffer( aBuffers, theRows );
+    return theImage;
+}
+
+// reads the codes following the headers and decodes them, aFile must be at the first code
+BitmapImage readRleImageData( WorkerPool* aPool, BufferPool* aBuffers, const BitmapHeaders* aHeaders, FILE* aFile, uint64_t* aRowHashes )
+{
+    BitmapImage theImage = { 0, 0, 0, 0, NULL };
+    struct stat theStat;
+    if( fstat( fileno( aFile ), &theStat ) != 0 || theStat.st_size <= ( off_t )aHeaders->fileHeader.image_offset )
+    {
+        return theImage;
+    }
+
+    size_t theSize = theStat.st_size - aHeaders->fileHeader.image_offset;
+    uint8_t* theCodes = allocateImageBuffer( aBuffers, theSize );
+    if( theCodes )
+    {
+        StageTimer theTimer = beginStage( stageRead );
+        theSize = fread( theCodes, 1, theSize, aFile );
+        addRunCounter( &gRunStats.bytesRead, theSize );
+        endStage( &theTimer );
+        theImage = decodeRleImageData( aPool, aBuffers, aHeaders, theCodes, theSize, aRowHashes );
+        freeImageBuffer( aBuffers, theCodes );
+    }
+    return theImage;
+}
+
+// run-length encodes one 8 bpp row, ending it with an end of line code; aResult needs
+// room for 2 * aWidth + 2 bytes
+size_t encodeRle8Row( const uint8_t* aRow, int32_t aWidth, uint8_t* aResult )
+{
+    size_t n = 0;
+    int32_t x = 0;
+    while( x < aWidth )
+    {
+        int32_t theRun = 1;
+        while( x + theRun < aWidth && theRun < 255 && aRow[ x + theRun ] == aRow[ x ] )
+        {
+            theRun++;
+        }
+        if( theRun >= 3 )
+        {
+            aResult[ n++ ] = ( uint8_t )theRun;
+            aResult[ n++ ] = aRow[ x ];
+            x += theRun;
+            continue;
+        }
+
+        // literal pixels up to the next run of 3 or more
+        int32_t theLength = 0;
+        while( x + theLength < aWidth && theLength < 255 )
+        {
+            int32_t p = x + theLength;
+            if( p + 2 < aWidth && aRow[ p ] == aRow[ p + 1 ] && aRow[ p ] == aRow[ p + 2 ] )
+            {
+                break;
+            }
+            theLength++;
+        }
+
+        if( theLength < 3 )
+        {
+            // absolute mode needs at least 3 pixels, shorter stretches go out as runs of one
+            for( int32_t k = 0; k < theLength; k++ )
+            {
+                aResult[ n++ ] = 1;
+                aResult[ n++ ] = aRow[ x + k ];
+            }
+        }
+        else
+        {
+            aResult[ n++ ] = 0;
+            aResult[ n++ ] = ( uint8_t )theLength;
+            memcpy( aResult + n, aRow + x, theLength );
+            n += theLength;
+            if( theLength & 1 )
+            {
+                aResult[ n++ ] = 0;
+            }
+        }
+        x += theLength;
+    }
+
+    aResult[ n++ ] = 0;
+    aResult[ n++ ] = 0;
+    return n;
+}
+
+// ---------- ROW KERNELS ----------
+
+// every kernel works on the packed BGR bytes of one row, padding excluded;
+// aSource and aDest may be the same row
+typedef void ( *InvertRowKernel )( const uint8_t* aSource, uint8_t* aDest, size_t aBytes );
+typedef void ( *ChannelRowKernel )( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, int aChannel );
+typedef void ( *LumaRowKernel )( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, const uint16_t* aWeights );
+
+// separable convolution passes, aTaps weights adding up to 1 << CONVOLUTION_WEIGHT_BITS plus a zero one
+// past the end; the horizontal pass reads aLine[ i + 3 * k ] for tap k, so the line carries the left
+// edge pixels and at least 32 readable bytes past the right edge
+typedef void ( *HorizontalPassKernel )( const uint8_t* aLine, uint16_t* aOut, size_t aBytes, const int16_t* aWeights, int aTaps );
+typedef void ( *VerticalPassKernel )( const uint16_t* const* aRows, uint8_t* aOut, size_t aCount, const int16_t* aWeights, int aTaps );
+
+typedef struct
+{
+    InvertRowKernel invertRow;
+    ChannelRowKernel broadcastChannelRow; // copies one channel (0 blue, 1 green, 2 red) into all three
+    LumaRowKernel lumaRow;                // weighted sum of the channels into all three
+    HorizontalPassKernel horizontalPass;  // bytes in, fixed point out
+    VerticalPassKernel verticalPass;      // fixed point in, bytes out
+    const char* name;
+} RowKernels;
+
+// luma weights in BitmapColor order, scaled so they add up to 1 << LUMA_WEIGHT_BITS
+#define LUMA_WEIGHT_BITS 15
+static const uint16_t gLumaWeightsBt601[ 3 ] = { 3735, 19235, 9798 };
+static const uint16_t gLumaWeightsBt709[ 3 ] = { 2365, 23436, 6967 };
+
+void invertRowScalar( const uint8_t* aSource, uint8_t* aDest, size_t aBytes )
+{
+    for( size_t i = 0; i < aBytes; i++ )
+    {
+        aDest[ i ] = UINT8_MAX - aSource[ i ];
+    }
+}
+
+void broadcastChannelRowScalar( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, int aChannel )
+{
+    for( size_t i = 0; i + 2 < aBytes; i += 3 )
+    {
+        uint8_t theValue = aSource[ i + aChannel ];
+        aDest[ i ] = theValue;
+        aDest[ i + 1 ] = theValue;
+        aDest[ i + 2 ] = theValue;
+    }
+}
+
+void lumaRowScalar( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, const uint16_t* aWeights )
+{
+    for( size_t i = 0; i + 2 < aBytes; i += 3 )
+    {
+        uint32_t theSum = aSource[ i ] * aWeights[ 0 ] + aSource[ i + 1 ] * aWeights[ 1 ] + aSource[ i + 2 ] * aWeights[ 2 ];
+        uint8_t theValue = ( uint8_t )( ( theSum + ( 1u << ( LUMA_WEIGHT_BITS - 1 ) ) ) >> LUMA_WEIGHT_BITS );
+        aDest[ i ] = theValue;
+        aDest[ i + 1 ] = theValue;
+        aDest[ i + 2 ] = theValue;
+    }
+}
+
+void horizontalPassScalar( const uint8_t* aLine, uint16_t* aOut, size_t aBytes, const int16_t* aWeights, int aTaps )
+{
+    for( size_t i = 0; i < aBytes; i++ )
+    {
+        int32_t theSum = 1 << ( CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS - 1 );
+        for( int k = 0; k < aTaps; k++ )
+        {
+            theSum += aWeights[ k ] * aLine[ i + 3 * k ];
+        }
+        aOut[ i ] = ( uint16_t )( theSum >> ( CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS ) );
+    }
+}
+
+// the rows are indexed from aBegin so that SIMD kernels can hand their tail over
+void verticalPassRange( const uint16_t* const* aRows, uint8_t* aOut, size_t aBegin, size_t aCount, const int16_t* aWeights, int aTaps )
+{
+    for( size_t i = aBegin; i < aCount; i++ )
+    {
+        int32_t theSum = 1 << ( CONVOLUTION_WEIGHT_BITS + CONVOLUTION_FRACTION_BITS - 1 );
+        for( int k = 0; k < aTaps; k++ )
+        {
+            theSum += aWeights[ k ] * aRows[ k ][ i ];
+        }
+        theSum >>= CONVOLUTION_WEIGHT_BITS + CONVOLUTION_FRACTION_BITS;
+        aOut[ i ] = ( uint8_t )( theSum < 0 ? 0 : ( theSum > UINT8_MAX ? UINT8_MAX : theSum ) );
+    }
+}
+
+void verticalPassScalar( const uint16_t* const* aRows, uint8_t* aOut, size_t aCount, const int16_t* aWeights, int aTaps )
+{
+    verticalPassRange( aRows, aOut, 0, aCount, aWeights, aTaps );
+}
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+
+__attribute__(( target( "sse2" ) ))
+void invertRowSse2( const uint8_t* aSource, uint8_t* aDest, size_t aBytes )
+{
+    const __m128i theOnes = _mm_set1_epi8( ( char )0xFF );
+    size_t i = 0;
+    for( ; i + 16 <= aBytes; i += 16 )
+    {
+        __m128i thePixels = _mm_loadu_si128( ( const __m128i* )( aSource + i ) );
+        _mm_storeu_si128( ( __m128i* )( aDest + i ), _mm_xor_si128( thePixels, theOnes ) );
+    }
+    invertRowScalar( aSource + i, aDest + i, aBytes - i );
+}
+
+__attribute__(( target( "avx2" ) ))
+void invertRowAvx2( const uint8_t* aSource, uint8_t* aDest, size_t aBytes )
+{
+    const __m256i theOnes = _mm256_set1_epi8( ( char )0xFF );
+    size_t i = 0;
+    for( ; i + 64 <= aBytes; i += 64 )
+    {
+        __m256i theLow = _mm256_loadu_si256( ( const __m256i* )( aSource + i ) );
+        __m256i theHigh = _mm256_loadu_si256( ( const __m256i* )( aSource + i + 32 ) );
+        _mm256_storeu_si256( ( __m256i* )( aDest + i ), _mm256_xor_si256( theLow, theOnes ) );
+        _mm256_storeu_si256( ( __m256i* )( aDest + i + 32 ), _mm256_xor_si256( theHigh, theOnes ) );
+    }
+    for( ; i + 32 <= aBytes; i += 32 )
+    {
+        __m256i thePixels = _mm256_loadu_si256( ( const __m256i* )( aSource + i ) );
+        _mm256_storeu_si256( ( __m256i* )( aDest + i ), _mm256_xor_si256( thePixels, theOnes ) );
+    }
+    invertRowScalar( aSource + i, aDest + i, aBytes - i );
+}
+
+// shuffle mask taking channel aChannel of aPixels triplets and repeating it three times;
+// the bytes past the last triplet map onto themselves so an overlapping store stays harmless in place
+static inline __m128i broadcastChannelMask( int aChannel, int aPixels )
+{
+    int8_t theMask[ 16 ];
+    for( int i = 0; i < 16; i++ )
+    {
+        theMask[ i ] = ( int8_t )( i < aPixels * 3 ? ( i / 3 ) * 3 + aChannel : i );
+    }
+    return _mm_loadu_si128( ( const __m128i* )theMask );
+}
+
+__attribute__(( target( "ssse3" ) ))
+void broadcastChannelRowSsse3( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, int aChannel )
+{
+    const __m128i theMask = broadcastChannelMask( aChannel, 5 );
+    size_t thePixelBytes = aBytes - aBytes % 3; // a partial pixel at the end is left alone, as the scalar kernel does
+    size_t i = 0;
+
+    // 5 pixels (15 bytes) per step, the 16th byte is rewritten by the next step
+    for( ; i + 16 <= thePixelBytes; i += 15 )
+    {
+        __m128i thePixels = _mm_loadu_si128( ( const __m128i* )( aSource + i ) );
+        _mm_storeu_si128( ( __m128i* )( aDest + i ), _mm_shuffle_epi8( thePixels, theMask ) );
+    }
+    broadcastChannelRowScalar( aSource + i, aDest + i, aBytes - i, aChannel );
+}
+
+__attribute__(( target( "avx2" ) ))
+void broadcastChannelRowAvx2( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, int aChannel )
+{
+    // vpshufb stays inside 128-bit lanes, so each lane carries 4 pixels (12 bytes)
+    const __m128i theLaneMask = broadcastChannelMask( aChannel, 4 );
+    const __m256i theMask = _mm256_broadcastsi128_si256( theLaneMask );
+    size_t thePixelBytes = aBytes - aBytes % 3;
+    size_t i = 0;
+
+    for( ; i + 28 <= thePixelBytes; i += 24 )
+    {
+        __m256i thePixels = _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( ( const __m128i* )( aSource + i ) ) ),
+                                                     _mm_loadu_si128( ( const __m128i* )( aSource + i + 12 ) ), 1 );
+        __m256i theResult = _mm256_shuffle_epi8( thePixels, theMask );
+
+        // low lane first, the high lane then overwrites its 4 spare bytes
+        _mm_storeu_si128( ( __m128i* )( aDest + i ), _mm256_castsi256_si128( theResult ) );
+        _mm_storeu_si128( ( __m128i* )( aDest + i + 12 ), _mm256_extracti128_si256( theResult, 1 ) );
+    }
+    broadcastChannelRowSsse3( aSource + i, aDest + i, aBytes - i, aChannel );
+}
+
+__attribute__(( target( "ssse3" ) ))
+void lumaRowSsse3( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, const uint16_t* aWeights )
+{
+    // blue and green widened into 16-bit pairs for one pmaddwd, red on its own with a zero weight
+    const __m128i theBlueGreenMask = _mm_setr_epi8( 0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1 );
+    const __m128i theRedMask = _mm_setr_epi8( 2, -1, -1, -1, 5, -1, -1, -1, 8, -1, -1, -1, 11, -1, -1, -1 );
+    const __m128i theBroadcastMask = _mm_setr_epi8( 0, 0, 0, 4, 4, 4, 8, 8, 8, 12, 12, 12, -1, -1, -1, -1 );
+    const __m128i theBlueGreenWeights = _mm_set1_epi32( ( int )( aWeights[ 0 ] | ( ( uint32_t )aWeights[ 1 ] << 16 ) ) );
+    const __m128i theRedWeights = _mm_set1_epi32( aWeights[ 2 ] );
+    const __m128i theRounding = _mm_set1_epi32( 1 << ( LUMA_WEIGHT_BITS - 1 ) );
+    size_t i = 0;
+
+    // 4 pixels (12 bytes) per step, stored as exactly 12 bytes so in place works
+    for( ; i + 16 <= aBytes; i += 12 )
+    {
+        __m128i thePixels = _mm_loadu_si128( ( const __m128i* )( aSource + i ) );
+        __m128i theSum = _mm_add_epi32( _mm_madd_epi16( _mm_shuffle_epi8( thePixels, theBlueGreenMask ), theBlueGreenWeights ),
+                                        _mm_madd_epi16( _mm_shuffle_epi8( thePixels, theRedMask ), theRedWeights ) );
+        __m128i theLuma = _mm_srli_epi32( _mm_add_epi32( theSum, theRounding ), LUMA_WEIGHT_BITS );
+        __m128i theResult = _mm_shuffle_epi8( theLuma, theBroadcastMask );
+        uint32_t theLast = ( uint32_t )_mm_cvtsi128_si32( _mm_srli_si128( theResult, 8 ) );
+        _mm_storel_epi64( ( __m128i* )( aDest + i ), theResult );
+        memcpy( aDest + i + 8, &theLast, sizeof( theLast ) );
+    }
+    lumaRowScalar( aSource + i, aDest + i, aBytes - i, aWeights );
+}
+
+// both passes take the taps in pairs: interleaving two 16-bit inputs lets one vpmaddwd apply two
+// weights, and packing the 32-bit sums undoes the in-lane interleave
+__attribute__(( target( "avx2" ) ))
+void horizontalPassAvx2( const uint8_t* aLine, uint16_t* aOut, size_t aBytes, const int16_t* aWeights, int aTaps )
+{
+    const __m256i theRounding = _mm256_set1_epi32( 1 << ( CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS - 1 ) );
+    size_t i = 0;
+    for( ; i + 16 <= aBytes; i += 16 )
+    {
+        __m256i theLow = theRounding;
+        __m256i theHigh = theRounding;
+        for( int k = 0; k < aTaps; k += 2 )
+        {
+            __m256i theFirst = _mm256_cvtepu8_epi16( _mm_loadu_si128( ( const __m128i* )( aLine + i + 3 * k ) ) );
+            __m256i theSecond = _mm256_cvtepu8_epi16( _mm_loadu_si128( ( const __m128i* )( aLine + i + 3 * ( k + 1 ) ) ) );
+            __m256i theWeights = _mm256_set1_epi32( ( int32_t )( ( uint16_t )aWeights[ k ] | ( ( uint32_t )( uint16_t )aWeights[ k + 1 ] << 16 ) ) );
+            theLow = _mm256_add_epi32( theLow, _mm256_madd_epi16( _mm256_unpacklo_epi16( theFirst, theSecond ), theWeights ) );
+            theHigh = _mm256_add_epi32( theHigh, _mm256_madd_epi16( _mm256_unpackhi_epi16( theFirst, theSecond ), theWeights ) );
+        }
+        theLow = _mm256_srai_epi32( theLow, CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS );
+        theHigh = _mm256_srai_epi32( theHigh, CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS );
+        _mm256_storeu_si256( ( __m256i* )( aOut + i ), _mm256_packus_epi32( theLow, theHigh ) );
+    }
+    horizontalPassScalar( aLine + i, aOut + i, aBytes - i, aWeights, aTaps );
+}
+
+__attribute__(( target( "avx2" ) ))
+void verticalPassAvx2( const uint16_t* const* aRows, uint8_t* aOut, size_t aCount, const int16_t* aWeights, int aTaps )
+{
+    const __m256i theRounding = _mm256_set1_epi32( 1 << ( CONVOLUTION_WEIGHT_BITS + CONVOLUTION_FRACTION_BITS - 1 ) );
+    size_t i = 0;
+    for( ; i + 16 <= aCount; i += 16 )
+    {
+        __m256i theLow = theRounding;
+        __m256i theHigh = theRounding;
+        for( int k = 0; k < aTaps; k += 2 )
+        {
+            __m256i theFirst = _mm256_loadu_si256( ( const __m256i* )( aRows[ k ] + i ) );
+            __m256i theSecond = k + 1 < aTaps ? _mm256_loadu_si256( ( const __m256i* )( aRows[ k + 1 ] + i ) ) : _mm256_setzero_si256();
+            __m256i theWeights = _mm256_set1_epi32( ( int32_t )( ( uint16_t )aWeights[ k ] | ( ( uint32_t )( uint16_t )aWeights[ k + 1 ] << 16 ) ) );
+            theLow = _mm256_add_epi32( theLow, _mm256_madd_epi16( _mm256_unpacklo_epi16( theFirst, theSecond ), theWeights ) );
+            theHigh = _mm256_add_epi32( theHigh, _mm256_madd_epi16( _mm256_unpackhi_epi16( theFirst, theSecond ), theWeights ) );
+        }
+        theLow = _mm256_srai_epi32( theLow, CONVOLUTION_WEIGHT_BITS + CONVOLUTION_FRACTION_BITS );
+        theHigh = _mm256_srai_epi32( theHigh, CONVOLUTION_WEIGHT_BITS + CONVOLUTION_FRACTION_BITS );
+        __m256i theWords = _mm256_packus_epi32( theLow, theHigh );
+        __m128i theBytes = _mm_packus_epi16( _mm256_castsi256_si128( theWords ), _mm256_extracti128_si256( theWords, 1 ) );
+        _mm_storeu_si128( ( __m128i* )( aOut + i ), theBytes );
+    }
+    verticalPassRange( aRows, aOut, i, aCount, aWeights, aTaps );
+}
+
+#endif
+
+static RowKernels gRowKernels = { invertRowScalar, broadcastChannelRowScalar, lumaRowScalar, horizontalPassScalar, verticalPassScalar, "scalar" };
+static pthread_once_t gRowKernelsOnce = PTHREAD_ONCE_INIT;
+static int gRowKernelsScalarOnly = 0;
+
+static void selectRowKernels( void )
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    if( gRowKernelsScalarOnly )
+    {
+        return;
+    }
+
+    // cpuid based, picked once for the whole run
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        gRowKernels.invertRow = invertRowAvx2;
+        gRowKernels.broadcastChannelRow = broadcastChannelRowAvx2;
+        gRowKernels.lumaRow = lumaRowSsse3;
+        gRowKernels.horizontalPass = horizontalPassAvx2;
+        gRowKernels.verticalPass = verticalPassAvx2;
+        gRowKernels.name = "avx2";
+    }
+    else if( __builtin_cpu_supports( "ssse3" ) )
+    {
+        gRowKernels.invertRow = invertRowSse2;
+        gRowKernels.broadcastChannelRow = broadcastChannelRowSsse3;
+        gRowKernels.lumaRow = lumaRowSsse3;
+        gRowKernels.name = "ssse3";
+    }
+    else if( __builtin_cpu_supports( "sse2" ) )
+    {
+        gRowKernels.invertRow = invertRowSse2;
+        gRowKernels.name = "sse2";
+    }
+#endif
+}
+
+// must be called before the first filter runs
+void useScalarRowKernels( void )
+{
+    gRowKernelsScalarOnly = 1;
+}
+
+const RowKernels* getRowKernels( void )
+{
+    pthread_once( &gRowKernelsOnce, selectRowKernels );
+    return &gRowKernels;
+}
+
+// aTables holds one 256-entry table per channel, in BitmapColor order
+void lookupTableRow( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, const uint8_t ( *aTables )[ 256 ] )
+{
+    const uint8_t* theBlue = aTables[ 0 ];
+    const uint8_t* theGreen = aTables[ 1 ];
+    const uint8_t* theRed = aTables[ 2 ];
+    for( size_t i = 0; i + 2 < aBytes; i += 3 )
+    {
+        uint8_t b = theBlue[ aSource[ i ] ];
+        uint8_t g = theGreen[ aSource[ i + 1 ] ];
+        uint8_t r = theRed[ aSource[ i + 2 ] ];
+        aDest[ i ] = b;
+        aDest[ i + 1 ] = g;
+        aDest[ i + 2 ] = r;
+    }
+}
+
+// same table for every channel: one flat byte loop, which the compiler unrolls freely
+void lookupTableRowUniform( const uint8_t* aSource, uint8_t* aDest, size_t aBytes, const uint8_t* aTable )
+{
+    size_t i = 0;
+    for( ; i + 4 <= aBytes; i += 4 )
+    {
+        uint8_t a = aTable[ aSource[ i ] ];
+        uint8_t b = aTable[ aSource[ i + 1 ] ];
+        uint8_t c = aTable[ aSource[ i + 2 ] ];
+        uint8_t d = aTable[ aSource[ i + 3 ] ];
+        aDest[ i ] = a;
+        aDest[ i + 1 ] = b;
+        aDest[ i + 2 ] = c;
+        aDest[ i + 3 ] = d;
+    }
+    for( ; i < aBytes; i++ )
+    {
+        aDest[ i ] = aTable[ aSource[ i ] ];
+    }
+}
+
+// keeps the first byte of every pixel of a gray row, giving one byte per pixel
+void packGrayRow( const uint8_t* aSource, uint8_t* aDest, size_t aPixels )
+{
+    for( size_t i = 0; i < aPixels; i++ )
+    {
+        aDest[ i ] = aSource[ i * 3 ];
+    }
+}
+
+// ---------- PIXEL FORMATS ----------
+
+// the filters only ever see packed BGR; other bit depths are decoded into a BGR tile and encoded
+// back by kernels picked once per image, paletted images get their palette filtered instead
+typedef struct PixelFormat PixelFormat;
+typedef void ( *DecodeRowKernel )( const PixelFormat* aFormat, const uint8_t* aSource, BitmapColor* aDest, uint32_t aPixels );
+typedef void ( *EncodeRowKernel )( const PixelFormat* aFormat, const BitmapColor* aSource, const uint8_t* aOriginal, uint8_t* aDest, uint32_t aPixels );
+
+struct PixelFormat
+{
+    uint16_t bitsPerPixel;
+    int paletted;              // pixels are palette indices and are copied untouched
+    DecodeRowKernel decodeRow; // NULL when the rows already hold packed BGR
+    EncodeRowKernel encodeRow; // bits outside the color masks (alpha, unused) come from aOriginal
+    uint32_t masks[ 3 ];       // blue, green, red
+    int shifts[ 3 ];
+    int bits[ 3 ];
+    uint32_t keepMask;         // bits of a pixel that belong to no channel
+};
+
+void decodeRowBgrx32( const PixelFormat* aFormat, const uint8_t* aSource, BitmapColor* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        aDest[ i ].blue = aSource[ i * 4 ];
+        aDest[ i ].green = aSource[ i * 4 + 1 ];
+        aDest[ i ].red = aSource[ i * 4 + 2 ];
+    }
+}
+
+void encodeRowBgrx32( const PixelFormat* aFormat, const BitmapColor* aSource, const uint8_t* aOriginal, uint8_t* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint8_t theAlpha = aOriginal[ i * 4 + 3 ];
+        aDest[ i * 4 ] = aSource[ i ].blue;
+        aDest[ i * 4 + 1 ] = aSource[ i ].green;
+        aDest[ i * 4 + 2 ] = aSource[ i ].red;
+        aDest[ i * 4 + 3 ] = theAlpha;
+    }
+}
+
+// 5 and 6 bit channels widen by repeating their top bits, so encoding just drops the low bits again
+void decodeRowRgb555( const PixelFormat* aFormat, const uint8_t* aSource, BitmapColor* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = aSource[ i * 2 ] | ( aSource[ i * 2 + 1 ] << 8 );
+        uint32_t theBlue = thePixel & 0x1F;
+        uint32_t theGreen = ( thePixel >> 5 ) & 0x1F;
+        uint32_t theRed = ( thePixel >> 10 ) & 0x1F;
+        aDest[ i ].blue = ( uint8_t )( ( theBlue << 3 ) | ( theBlue >> 2 ) );
+        aDest[ i ].green = ( uint8_t )( ( theGreen << 3 ) | ( theGreen >> 2 ) );
+        aDest[ i ].red = ( uint8_t )( ( theRed << 3 ) | ( theRed >> 2 ) );
+    }
+}
+
+void encodeRowRgb555( const PixelFormat* aFormat, const BitmapColor* aSource, const uint8_t* aOriginal, uint8_t* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = ( aOriginal[ i * 2 + 1 ] & 0x80 ) << 8;
+        thePixel |= ( uint32_t )( aSource[ i ].red >> 3 ) << 10 | ( uint32_t )( aSource[ i ].green >> 3 ) << 5 | ( uint32_t )( aSource[ i ].blue >> 3 );
+        aDest[ i * 2 ] = ( uint8_t )thePixel;
+        aDest[ i * 2 + 1 ] = ( uint8_t )( thePixel >> 8 );
+    }
+}
+
+void decodeRowRgb565( const PixelFormat* aFormat, const uint8_t* aSource, BitmapColor* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = aSource[ i * 2 ] | ( aSource[ i * 2 + 1 ] << 8 );
+        uint32_t theBlue = thePixel & 0x1F;
+        uint32_t theGreen = ( thePixel >> 5 ) & 0x3F;
+        uint32_t theRed = ( thePixel >> 11 ) & 0x1F;
+        aDest[ i ].blue = ( uint8_t )( ( theBlue << 3 ) | ( theBlue >> 2 ) );
+        aDest[ i ].green = ( uint8_t )( ( theGreen << 2 ) | ( theGreen >> 4 ) );
+        aDest[ i ].red = ( uint8_t )( ( theRed << 3 ) | ( theRed >> 2 ) );
+    }
+}
+
+void encodeRowRgb565( const PixelFormat* aFormat, const BitmapColor* aSource, const uint8_t* aOriginal, uint8_t* aDest, uint32_t aPixels )
+{
+    ( void )aFormat;
+    ( void )aOriginal;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = ( uint32_t )( aSource[ i ].red >> 3 ) << 11 | ( uint32_t )( aSource[ i ].green >> 2 ) << 5 | ( uint32_t )( aSource[ i ].blue >> 3 );
+        aDest[ i * 2 ] = ( uint8_t )thePixel;
+        aDest[ i * 2 + 1 ] = ( uint8_t )( thePixel >> 8 );
+    }
+}
+
+// any other 16 or 32 bpp masks, channels scaled to and from 8 bits with rounding
+void decodeRowBitfields( const PixelFormat* aFormat, const uint8_t* aSource, BitmapColor* aDest, uint32_t aPixels )
+{
+    uint32_t theBytes = aFormat->bitsPerPixel / 8;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = 0;
+        memcpy( &thePixel, aSource + i * theBytes, theBytes );
+        uint8_t* theChannels = ( uint8_t* )&aDest[ i ];
+        for( int c = 0; c < 3; c++ )
+        {
+            uint64_t theMax = ( 1ull << aFormat->bits[ c ] ) - 1;
+            uint64_t theValue = ( thePixel & aFormat->masks[ c ] ) >> aFormat->shifts[ c ];
+            theChannels[ c ] = ( uint8_t )( ( theValue * 255 + theMax / 2 ) / theMax );
+        }
+    }
+}
+
+void encodeRowBitfields( const PixelFormat* aFormat, const BitmapColor* aSource, const uint8_t* aOriginal, uint8_t* aDest, uint32_t aPixels )
+{
+    uint32_t theBytes = aFormat->bitsPerPixel / 8;
+    for( uint32_t i = 0; i < aPixels; i++ )
+    {
+        uint32_t thePixel = 0;
+        memcpy( &thePixel, aOriginal + i * theBytes, theBytes );
+        thePixel &= aFormat->keepMask;
+        const uint8_t* theChannels = ( const uint8_t* )&aSource[ i ];
+        for( int c = 0; c < 3; c++ )
+        {
+            uint64_t theMax = ( 1ull << aFormat->bits[ c ] ) - 1;
+            thePixel |= ( uint32_t )( ( theChannels[ c ] * theMax + 127 ) / 255 ) << aFormat->shifts[ c ];
+        }
+        memcpy( aDest + i * theBytes, &thePixel, theBytes );
+    }
+}
+
+// picks the kernels for the pixels described by aHeaders, returns 0 if there are none
+int selectPixelFormat( const BitmapHeaders* aHeaders, PixelFormat* aFormat )
+{
+    memset( aFormat, 0, sizeof( PixelFormat ) );
+    aFormat->bitsPerPixel = aHeaders->bitsPerPixel;
+    switch( aHeaders->bitsPerPixel )
+    {
+        case 1:
+        case 4:
+        case 8:
+        {
+            aFormat->paletted = 1;
+            return aHeaders->numColors > 0;
+        }
+        case 24:
+        {
+            return 1;
+        }
+        case 16:
+        case 32:
+        {
+            break;
+        }
+        default:
+        {
+            return 0;
+        }
+    }
+
+    uint32_t thePixelBits = aHeaders->bitsPerPixel == 16 ? 0xFFFF : 0xFFFFFFFF;
+    aFormat->keepMask = thePixelBits;
+    for( int c = 0; c < 3; c++ )
+    {
+        uint32_t theMask = aHeaders->colorMasks[ c ] & thePixelBits;
+        if( theMask == 0 )
+        {
+            return 0;
+        }
+        aFormat->masks[ c ] = theMask;
+        aFormat->shifts[ c ] = __builtin_ctz( theMask );
+        aFormat->bits[ c ] = __builtin_popcount( theMask );
+        if( ( theMask >> aFormat->shifts[ c ] ) != ( uint32_t )( ( 1ull << aFormat->bits[ c ] ) - 1 ) )
+        {
+            return 0; // not a contiguous run of bits
+        }
+        aFormat->keepMask &= ~theMask;
+    }
+
+    aFormat->decodeRow = decodeRowBitfields;
+    aFormat->encodeRow = encodeRowBitfields;
+    if( aHeaders->bitsPerPixel == 32 && aFormat->masks[ 0 ] == 0x000000FF && aFormat->masks[ 1 ] == 0x0000FF00 && aFormat->masks[ 2 ] == 0x00FF0000 )
+    {
+        aFormat->decodeRow = decodeRowBgrx32;
+        aFormat->encodeRow = encodeRowBgrx32;
+    }
+    else if( aHeaders->bitsPerPixel == 16 && aFormat->masks[ 0 ] == 0x001F && aFormat->masks[ 1 ] == 0x03E0 && aFormat->masks[ 2 ] == 0x7C00 )
+    {
+        aFormat->decodeRow = decodeRowRgb555;
+        aFormat->encodeRow = encodeRowRgb555;
+    }
+    else if( aHeaders->bitsPerPixel == 16 && aFormat->masks[ 0 ] == 0x001F && aFormat->masks[ 1 ] == 0x07E0 && aFormat->masks[ 2 ] == 0xF800 )
+    {
+        aFormat->decodeRow = decodeRowRgb565;
+        aFormat->encodeRow = encodeRowRgb565;
+    }
+    return 1;
+}
+
+// ---------- IMAGE MANIPULATION FUNCTIONS ----------
+
+typedef struct
+{
+    IMAGE_PROCESSING_TYPE processingType;
+    uint32_t imageWidth;
+    const BitmapColor* source; // may be the same row as the destination
+    BitmapColor* row;
+    const uint8_t ( *tables )[ 256 ]; // lookupTable only: blue, green and red tables
+    int uniformTable;                 // lookupTable only: all three tables are the same
+} threadArgs;
+
+void* imageProcessingThread( void* args ) 
+{ 
+    threadArgs* theThreadArgs = (threadArgs*)args;
+    const RowKernels* theKernels = getRowKernels();
+    const uint8_t* theSource = ( const uint8_t* )theThreadArgs->source;
+    uint8_t* theRow = ( uint8_t* )theThreadArgs->row;
+    size_t theRowBytes = ( size_t )theThreadArgs->imageWidth * sizeof( BitmapColor );
+    switch( theThreadArgs->processingType )
+    {
+        case invert:
+        {
+            theKernels->invertRow( theSource, theRow, theRowBytes );
+            break;
+        }
+        case grayscaleBlue:
+        {
+            theKernels->broadcastChannelRow( theSource, theRow, theRowBytes, offsetof( BitmapColor, blue ) );
+            break;
+        }
+        case grayscaleGreen:
+        {
+            theKernels->broadcastChannelRow( theSource, theRow, theRowBytes, offsetof( BitmapColor, green ) );
+            break;
+        }
+        case grayscaleRed:
+        {
+            theKernels->broadcastChannelRow( theSource, theRow, theRowBytes, offsetof( BitmapColor, red ) );
+            break;
+        }
+        case lumaBt601:
+        {
+            theKernels->lumaRow( theSource, theRow, theRowBytes, gLumaWeightsBt601 );
+            break;
+        }
+        case lumaBt709:
+        {
+            theKernels->lumaRow( theSource, theRow, theRowBytes, gLumaWeightsBt709 );
+            break;
+        }
+        case lookupTable:
+        {
+            if( theThreadArgs->uniformTable )
+            {
+                lookupTableRowUniform( theSource, theRow, theRowBytes, theThreadArgs->tables[ 0 ] );
+            }
+            else
+            {
+                lookupTableRow( theSource, theRow, theRowBytes, theThreadArgs->tables );
+            }
+            break;
+        }
+        default:
+        {
+            // point ops only reach the kernels compiled into a lookupTable
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// ---------- FILTER CHAINS ----------
+
+typedef struct
+{
+    IMAGE_PROCESSING_TYPE type;     // invert, grayscale* or lookupTable
+    int uniformTable;
+    uint8_t tables[ 3 ][ 256 ];     // lookupTable only, in BitmapColor channel order
+} FilterStage;
+
+typedef struct // what actually runs over the pixels: consecutive point ops merged into one table
+{
+    FilterStage stages[ MAX_FILTER_OPS ];
+    int numStages;
+    const PixelFormat* format;   // of the source rows, NULL for packed BGR
+    uint16_t outputBitsPerPixel; // the source's, or 8 to pack a gray result into one byte per pixel
+} CompiledFilterChain;
+
+typedef struct
+{
+    const char* spelling;
+    IMAGE_PROCESSING_TYPE op;
+    int numParameters;
+    float minimum;                  // bounds for every parameter
+    float maximum;
+} FilterOpName;
+
+// first spelling of every op is the canonical one, used to name outputs
+static const FilterOpName gFilterOpNames[] =
+{
+    { "invert", invert, 0, 0, 0 },
+    { "grayscaleRed", grayscaleRed, 0, 0, 0 },
+    { "grayscaleGreen", grayscaleGreen, 0, 0, 0 },
+    { "grayscaleBlue", grayscaleBlue, 0, 0, 0 },
+    { "grayscale:red", grayscaleRed, 0, 0, 0 },
+    { "grayscale:green", grayscaleGreen, 0, 0, 0 },
+    { "grayscale:blue", grayscaleBlue, 0, 0, 0 },
+    { "luma601", lumaBt601, 0, 0, 0 },
+    { "luma709", lumaBt709, 0, 0, 0 },
+    { "luma", lumaBt601, 0, 0, 0 },
+    { "luma:601", lumaBt601, 0, 0, 0 },
+    { "luma:709", lumaBt709, 0, 0, 0 },
+    { "grayscale:luma", lumaBt601, 0, 0, 0 },
+    { "gamma", gammaCorrection, 1, 0.01f, 100 }, // gamma:G, output = input ^ (1 / G)
+    { "levels", levels, 2, 0, 255 },            // levels:BLACK:WHITE, stretches [BLACK, WHITE] to [0, 255]
+    { "brightness", brightness, 1, -255, 255 }, // brightness:OFFSET
+    { "contrast", contrast, 1, 0, 100 },        // contrast:FACTOR, around mid gray
+    { "posterize", posterize, 1, 2, 256 },      // posterize:LEVELS per channel
+    { "threshold", threshold, 1, 0, 256 },      // threshold:T, 255 at or above T, 0 below
+    { "autolevels", autoLevels, 0, 0, 0 },      // stretches each channel's darkest to brightest level to [0, 255]
+    { "equalize", equalize, 0, 0, 0 },          // flattens each channel's histogram
+    { "blur", boxBlur, 1, 1, CONVOLUTION_MAX_RADIUS },  // blur:RADIUS, mean of a square
+    { "gaussian", gaussianBlur, 1, 0.1f, 20 },          // gaussian:SIGMA
+    { "unsharp", unsharpMask, 2, 0.1f, 20 },            // unsharp:AMOUNT:SIGMA, adds AMOUNT times the detail a blur removes
+    { "sobel", sobelEdges, 0, 0, 0 },                   // gradient magnitude per channel
+    { "resizeLanczos", resizeLanczos, 2, 0, MAX_RESIZE_SIZE },  // resize:WIDTH:HEIGHT, a 0 keeps the aspect ratio
+    { "resizeBilinear", resizeBilinear, 2, 0, MAX_RESIZE_SIZE },
+    { "resizeBox", resizeBox, 2, 0, MAX_RESIZE_SIZE },
+    { "resize:lanczos", resizeLanczos, 2, 0, MAX_RESIZE_SIZE },
+    { "resize:bilinear", resizeBilinear, 2, 0, MAX_RESIZE_SIZE },
+    { "resize:box", resizeBox, 2, 0, MAX_RESIZE_SIZE },
+    { "resize", resizeLanczos, 2, 0, MAX_RESIZE_SIZE },
+    { "rotate90", rotate90, 0, 0, 0 },                  // clockwise
+    { "rotate180", rotate180, 0, 0, 0 },
+    { "rotate270", rotate270, 0, 0, 0 },
+    { "flipHorizontal", flipHorizontal, 0, 0, 0 },
+    { "flipVertical", flipVertical, 0, 0, 0 },
+    { "transpose", transpose, 0, 0, 0 },                // mirrors along the top left to bottom right diagonal
+    { "rotate:90", rotate90, 0, 0, 0 },
+    { "rotate:180", rotate180, 0, 0, 0 },
+    { "rotate:270", rotate270, 0, 0, 0 },
+    { "rotate:-90", rotate270, 0, 0, 0 },
+    { "flip:horizontal", flipHorizontal, 0, 0, 0 },
+    { "flip:vertical", flipVertical, 0, 0, 0 },
+    { "hflip", flipHorizontal, 0, 0, 0 },
+    { "vflip", flipVertical, 0, 0, 0 }
+};
+
+static const char* gChannelNames[ 3 ] = { "blue", "green", "red" };
+
+int isPointFilterOp( IMAGE_PROCESSING_TYPE aOp )
+{
+    return aOp == invert || ( aOp >= gammaCorrection && aOp < lookupTable );
+}
+
+// ops whose output pixel depends on its neighbors; they cannot run row by row in a strip
+int isNeighborhoodFilterOp( IMAGE_PROCESSING_TYPE aOp )
+{
+    return aOp >= boxBlur && aOp <= transpose;
+}
+
+int isResizeFilterOp( IMAGE_PROCESSING_TYPE aOp )
+{
+    return aOp >= resizeBox && aOp <= resizeLanczos;
+}
+
+// updates aWidth and aHeight to the size of the image aOp produces from an image of that size
+void getFilterOpOutputSize( const FilterOp* aOp, int32_t* aWidth, int32_t* aHeight )
+{
+    if( aOp->type == rotate90 || aOp->type == rotate270 || aOp->type == transpose )
+    {
+        int32_t theWidth = *aWidth;
+        *aWidth = *aHeight;
+        *aHeight = theWidth;
+        return;
+    }
+    if( !isResizeFilterOp( aOp->type ) || *aWidth <= 0 || *aHeight <= 0 )
+    {
+        return;
+    }
+    int32_t theWidth = ( int32_t )aOp->parameters[ 0 ];
+    int32_t theHeight = ( int32_t )aOp->parameters[ 1 ];
+    if( theWidth == 0 )
+    {
+        theWidth = ( int32_t )lround( ( double )*aWidth * theHeight / *aHeight );
+    }
+    else if( theHeight == 0 )
+    {
+        theHeight = ( int32_t )lround( ( double )*aHeight * theWidth / *aWidth );
+    }
+    *aWidth = theWidth > 0 ? theWidth : 1;
+    *aHeight = theHeight > 0 ? theHeight : 1;
+}
+
+void getFilterChainOutputSize( const FilterChain* aChain, int32_t* aWidth, int32_t* aHeight )
+{
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        getFilterOpOutputSize( &aChain->ops[ i ], aWidth, aHeight );
+    }
+}
+
+const FilterOpName* findFilterOpName( IMAGE_PROCESSING_TYPE aOp )
+{
+    for( size_t i = 0; i < sizeof( gFilterOpNames ) / sizeof( gFilterOpNames[ 0 ] ); i++ )
+    {
+        if( gFilterOpNames[ i ].op == aOp )
+        {
+            return &gFilterOpNames[ i ];
+        }
+    }
+    return NULL;
+}
+
+// parses one op such as "levels:16:235" or "gamma:2.2@red"
+static int parseFilterOp( const char* aSpec, size_t aLength, FilterOp* aOp )
+{
+    char theSpec[ 128 ];
+    if( aLength >= sizeof( theSpec ) )
+    {
+        return 0;
+    }
+    memcpy( theSpec, aSpec, aLength );
+    theSpec[ aLength ] = '\0';
+    memset( aOp, 0, sizeof( FilterOp ) );
+
+    // optional channel restriction
+    char* theChannel = strchr( theSpec, '@' );
+    if( theChannel )
+    {
+        *theChannel++ = '\0';
+        for( int c = 0; c < 3; c++ )
+        {
+            if( strcmp( theChannel, gChannelNames[ c ] ) == 0 )
+            {
+                aOp->channelMask = 1 << c;
+            }
+        }
+        if( !aOp->channelMask )
+        {
+            return 0;
+        }
+    }
+
+    for( size_t i = 0; i < sizeof( gFilterOpNames ) / sizeof( gFilterOpNames[ 0 ] ); i++ )
+    {
+        const FilterOpName* theName = &gFilterOpNames[ i ];
+        size_t theNameLength = strlen( theName->spelling );
+        if( strncmp( theSpec, theName->spelling, theNameLength ) != 0 || ( theSpec[ theNameLength ] != '\0' && theSpec[ theNameLength ] != ':' ) )
+        {
+            continue;
+        }
+        if( theName->numParameters == 0 && theSpec[ theNameLength ] != '\0' )
+        {
+            continue;
+        }
+        if( aOp->channelMask && !isPointFilterOp( theName->op ) )
+        {
+            return 0;
+        }
+
+        aOp->type = theName->op;
+        const char* theParameter = theSpec + theNameLength;
+        for( int p = 0; p < theName->numParameters; p++ )
+        {
+            char* theEnd;
+            if( *theParameter != ':' )
+            {
+                return 0;
+            }
+            aOp->parameters[ p ] = strtof( theParameter + 1, &theEnd );
+            if( theEnd == theParameter + 1 || aOp->parameters[ p ] < theName->minimum || aOp->parameters[ p ] > theName->maximum )
+            {
+                return 0;
+            }
+            theParameter = theEnd;
+        }
+        return *theParameter == '\0' && ( aOp->type != levels || aOp->parameters[ 0 ] < aOp->parameters[ 1 ] ) &&
+               ( !isResizeFilterOp( aOp->type ) || aOp->parameters[ 0 ] >= 1 || aOp->parameters[ 1 ] >= 1 );
+    }
+    return 0;
+}
+
+// parses a comma separated list of ops such as "grayscale:green,invert"; returns 0 on bad input
+int parseFilterChain( const char* aSpec, FilterChain* aChain )
+{
+    aChain->numOps = 0;
+    const char* theOp = aSpec;
+    while( *theOp )
+    {
+        size_t theLength = strcspn( theOp, "," );
+        if( aChain->numOps == MAX_FILTER_OPS || !parseFilterOp( theOp, theLength, &aChain->ops[ aChain->numOps ] ) )
+        {
+            return 0;
+        }
+        aChain->numOps++;
+        theOp += theLength;
+        if( *theOp == ',' )
+        {
+            theOp++;
+        }
+    }
+    return aChain->numOps > 0;
+}
+
+// canonical op names joined by '-', parameters and channel joined by '_', e.g. "grayscaleGreen-gamma_2.2"
+void formatFilterChainName( const FilterChain* aChain, char* aResult, size_t aResultSize )
+{
+    size_t theLength = 0;
+    aResult[ 0 ] = '\0';
+    for( int i = 0; i < aChain->numOps && theLength < aResultSize; i++ )
+    {
+        const FilterOp* theOp = &aChain->ops[ i ];
+        const FilterOpName* theName = findFilterOpName( theOp->type );
+        theLength += snprintf( aResult + theLength, aResultSize - theLength, "%s%s", i ? "-" : "", theName ? theName->spelling : "unknown" );
+        for( int p = 0; theName && p < theName->numParameters && theLength < aResultSize; p++ )
+        {
+            theLength += snprintf( aResult + theLength, aResultSize - theLength, "_%g", theOp->parameters[ p ] );
+        }
+        for( int c = 0; c < 3 && theLength < aResultSize; c++ )
+        {
+            if( theOp->channelMask & ( 1 << c ) )
+            {
+                theLength += snprintf( aResult + theLength, aResultSize - theLength, "_%s", gChannelNames[ c ] );
+            }
+        }
+    }
+}
+
+// whether every pixel the chain produces has three equal channels
+int isGrayFilterChain( const FilterChain* aChain )
+{
+    int theGray = 0;
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        IMAGE_PROCESSING_TYPE theType = aChain->ops[ i ].type;
+        if( theType == grayscaleRed || theType == grayscaleGreen || theType == grayscaleBlue || theType == lumaBt601 || theType == lumaBt709 )
+        {
+            theGray = 1;
+        }
+        else if( aChain->ops[ i ].channelMask )
+        {
+            theGray = 0;
+        }
+    }
+    return theGray;
+}
+
+// value of a point op for one input level of channel aChannel
+static uint8_t evaluatePointOp( const FilterOp* aOp, int aChannel, int aValue )
+{
+    float theResult = aValue;
+    switch( aOp->type )
+    {
+        case autoLevels:
+        case equalize:
+        {
+            theResult = aOp->tables ? aOp->tables[ aChannel ][ aValue ] : aValue;
+            break;
+        }
+        case invert:
+        {
+            theResult = UINT8_MAX - aValue;
+            break;
+        }
+        case gammaCorrection:
+        {
+            theResult = 255.0f * powf( aValue / 255.0f, 1.0f / aOp->parameters[ 0 ] );
+            break;
+        }
+        case levels:
+        {
+            theResult = ( aValue - aOp->parameters[ 0 ] ) * 255.0f / ( aOp->parameters[ 1 ] - aOp->parameters[ 0 ] );
+            break;
+        }
+        case brightness:
+        {
+            theResult = aValue + aOp->parameters[ 0 ];
+            break;
+        }
+        case contrast:
+        {
+            theResult = ( aValue - 127.5f ) * aOp->parameters[ 0 ] + 127.5f;
+            break;
+        }
+        case posterize:
+        {
+            float theSteps = aOp->parameters[ 0 ] - 1.0f;
+            theResult = roundf( roundf( aValue * theSteps / 255.0f ) * 255.0f / theSteps );
+            break;
+        }
+        case threshold:
+        {
+            theResult = aValue >= aOp->parameters[ 0 ] ? 255 : 0;
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+
+    theResult = roundf( theResult );
+    return ( uint8_t )( theResult < 0 ? 0 : ( theResult > 255 ? 255 : theResult ) );
+}
+
+// merges every run of consecutive point ops into a single per-channel table, so a run of any
+// length costs one lookup per byte; a lone full-image invert keeps its XOR kernel
+void compileFilterChain( const FilterChain* aChain, CompiledFilterChain* aCompiled, const PixelFormat* aFormat, uint16_t aOutputBitsPerPixel )
+{
+    aCompiled->numStages = 0;
+    aCompiled->format = aFormat;
+    aCompiled->outputBitsPerPixel = aOutputBitsPerPixel;
+    for( int i = 0; i < aChain->numOps; )
+    {
+        FilterStage* theStage = &aCompiled->stages[ aCompiled->numStages++ ];
+        const FilterOp* theOp = &aChain->ops[ i ];
+        int theRunEnd = i;
+        while( theRunEnd < aChain->numOps && isPointFilterOp( aChain->ops[ theRunEnd ].type ) )
+        {
+            theRunEnd++;
+        }
+
+        if( theRunEnd == i || ( theRunEnd == i + 1 && theOp->type == invert && theOp->channelMask == 0 ) )
+        {
+            theStage->type = theOp->type;
+            i++;
+            continue;
+        }
+
+        theStage->type = lookupTable;
+        for( int c = 0; c < 3; c++ )
+        {
+            for( int v = 0; v < 256; v++ )
+            {
+                theStage->tables[ c ][ v ] = ( uint8_t )v;
+            }
+        }
+        for( ; i < theRunEnd; i++ )
+        {
+            for( int c = 0; c < 3; c++ )
+            {
+                if( aChain->ops[ i ].channelMask == 0 || ( aChain->ops[ i ].channelMask & ( 1 << c ) ) )
+                {
+                    for( int v = 0; v < 256; v++ )
+                    {
+                        theStage->tables[ c ][ v ] = evaluatePointOp( &aChain->ops[ i ], c, theStage->tables[ c ][ v ] );
+                    }
+                }
+            }
+        }
+        theStage->uniformTable = memcmp( theStage->tables[ 0 ], theStage->tables[ 1 ], 256 ) == 0 && memcmp( theStage->tables[ 0 ], theStage->tables[ 2 ], 256 ) == 0;
+    }
+}
+
+// runs every stage of the chain over one row; the row is handled in tiles small enough to stay
+// in L1 across all stages, so a chain costs one pass over memory however long it is
+void applyFilterChain( const CompiledFilterChain* aChain, const uint8_t* aSource, uint8_t* aRow, uint32_t aImageWidth )
+{
+    threadArgs theArgs;
+    BitmapColor theTile[ FILTER_CHAIN_TILE_PIXELS ]; // decoded or not yet packed pixels
+    const PixelFormat* theFormat = aChain->format;
+    if( theFormat && theFormat->paletted )
+    {
+        // the chain already ran over the palette, the indices stay as they are
+        memmove( aRow, aSource, ( ( size_t )aImageWidth * theFormat->bitsPerPixel + 7 ) / 8 );
+        return;
+    }
+
+    int theDecode = theFormat && theFormat->decodeRow;
+    int thePackGray = aChain->outputBitsPerPixel == 8;
+    size_t thePixelBytes = theFormat ? theFormat->bitsPerPixel / 8 : sizeof( BitmapColor );
+    if( aChain->numStages == 0 && !theDecode && !thePackGray )
+    {
+        memmove( aRow, aSource, ( size_t )aImageWidth * sizeof( BitmapColor ) );
+        return;
+    }
+
+    for( uint32_t x = 0; x < aImageWidth; x += FILTER_CHAIN_TILE_PIXELS )
+    {
+        theArgs.imageWidth = aImageWidth - x < FILTER_CHAIN_TILE_PIXELS ? aImageWidth - x : FILTER_CHAIN_TILE_PIXELS;
+        theArgs.source = ( const BitmapColor* )( aSource + x * thePixelBytes );
+        theArgs.row = theDecode || thePackGray ? theTile : ( BitmapColor* )( aRow + x * thePixelBytes );
+        if( theDecode )
+        {
+            theFormat->decodeRow( theFormat, aSource + x * thePixelBytes, theTile, theArgs.imageWidth );
+            theArgs.source = theTile;
+        }
+        else if( aChain->numStages == 0 )
+        {
+            memcpy( theTile, theArgs.source, theArgs.imageWidth * sizeof( BitmapColor ) );
+        }
+
+        for( int i = 0; i < aChain->numStages; i++ )
+        {
+            theArgs.processingType = aChain->stages[ i ].type;
+            theArgs.tables = ( const uint8_t ( * )[ 256 ] )aChain->stages[ i ].tables;
+            theArgs.uniformTable = aChain->stages[ i ].uniformTable;
+            imageProcessingThread( &theArgs );
+
+            // later stages work in place on the tile the first one produced
+            theArgs.source = theArgs.row;
+        }
+
+        if( thePackGray )
+        {
+            packGrayRow( ( const uint8_t* )theTile, aRow + x, theArgs.imageWidth );
+        }
+        else if( theDecode )
+        {
+            theFormat->encodeRow( theFormat, theTile, aSource + x * thePixelBytes, aRow + x * thePixelBytes, theArgs.imageWidth );
+        }
+    }
+}
+
+typedef struct
+{
+    const CompiledFilterChain* chain;
+    const BitmapImage* source;
+    BitmapImage* destination;
+} imageTaskArgs;
+
+// worker pool task: runs the filter chain over a contiguous band of rows
+void imageProcessingRows( void* aContext, int aBegin, int aEnd )
+{
+    imageTaskArgs* theTask = ( imageTaskArgs* )aContext;
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        applyFilterChain( theTask->chain, ( const uint8_t* )imageRow( theTask->source, y ), ( uint8_t* )imageRow( theTask->destination, y ), theTask->source->width );
+    }
+}
+
+// filters aSource into aDestination, which must have the same dimensions; both may be the same image
+void processImageChain( WorkerPool* aPool, const FilterChain* aChain, const BitmapImage* aSource, BitmapImage* aDestination )
+{
+    CompiledFilterChain theCompiledChain;
+    compileFilterChain( aChain, &theCompiledChain, NULL, aDestination->bitsPerPixel );
+
+    imageTaskArgs theTask;
+    theTask.chain = &theCompiledChain;
+    theTask.source = aSource;
+    theTask.destination = aDestination;
+
+    // hand out small bands of rows so every worker stays busy until the end
+    int theChunkSize = 1;
+    if( aPool && aPool->numThreads > 1 )
+    {
+        theChunkSize = aSource->height / ( aPool->numThreads * 8 );
+    }
+    if( theChunkSize < 1 )
+    {
+        theChunkSize = 1;
+    }
+
+    StageTimer theTimer = beginStage( stageFilter );
+    runParallel( aPool, aSource->height, theChunkSize, imageProcessingRows, &theTask );
+    endStage( &theTimer );
+}
+
+// ---------- IMAGE STATISTICS ----------
+
+typedef enum
+{
+    histogramBlue,
+    histogramGreen,
+    histogramRed,
+    histogramLuma601,
+    histogramLuma709,
+    NUM_HISTOGRAMS
+} HISTOGRAM;
+
+static const char* gHistogramNames[ NUM_HISTOGRAMS ] = { "blue", "green", "red", "luma601", "luma709" };
+
+typedef struct
+{
+    uint64_t histograms[ NUM_HISTOGRAMS ][ 256 ]; // the first three in BitmapColor channel order
+    uint64_t pixels;
+} ImageStatistics;
+
+typedef struct // one worker's counts, a whole number of cache lines so no two workers ever write the same line
+{
+    uint64_t counts[ NUM_HISTOGRAMS ][ 256 ]; // paletted images count their indices in the first one
+} __attribute__(( aligned( 64 ) )) WorkerHistograms;
+
+typedef struct // counts spread over several calls, e.g. one per strip of a streamed image
+{
+    WorkerHistograms* workers;
+    int numWorkers;
+    BufferPool* buffers;
+} StatisticsAccumulator;
+
+typedef struct
+{
+    const BitmapImage* image;
+    const PixelFormat* format;
+    WorkerHistograms* workers;
+    int numWorkers;
+} statisticsTaskArgs;
+
+static void countPixels( const BitmapColor* aPixels, uint32_t aCount, WorkerHistograms* aCounts )
+{
+    for( uint32_t i = 0; i < aCount; i++ )
+    {
+        const BitmapColor* thePixel = &aPixels[ i ];
+        uint32_t theSum601 = thePixel->blue * gLumaWeightsBt601[ 0 ] + thePixel->green * gLumaWeightsBt601[ 1 ] + thePixel->red * gLumaWeightsBt601[ 2 ];
+        uint32_t theSum709 = thePixel->blue * gLumaWeightsBt709[ 0 ] + thePixel->green * gLumaWeightsBt709[ 1 ] + thePixel->red * gLumaWeightsBt709[ 2 ];
+        aCounts->counts[ histogramBlue ][ thePixel->blue ]++;
+        aCounts->counts[ histogramGreen ][ thePixel->green ]++;
+        aCounts->counts[ histogramRed ][ thePixel->red ]++;
+        aCounts->counts[ histogramLuma601 ][ ( theSum601 + ( 1u << ( LUMA_WEIGHT_BITS - 1 ) ) ) >> LUMA_WEIGHT_BITS ]++;
+        aCounts->counts[ histogramLuma709 ][ ( theSum709 + ( 1u << ( LUMA_WEIGHT_BITS - 1 ) ) ) >> LUMA_WEIGHT_BITS ]++;
+    }
+}
+
+// worker pool task: worker w counts a fixed band of rows into its own histograms, so the
+// result does not depend on which thread ran which band
+void statisticsBands( void* aContext, int aBegin, int aEnd )
+{
+    statisticsTaskArgs* theTask = ( statisticsTaskArgs* )aContext;
+    const BitmapImage* theImage = theTask->image;
+    const PixelFormat* theFormat = theTask->format;
+    BitmapColor theTile[ FILTER_CHAIN_TILE_PIXELS ];
+    for( int w = aBegin; w < aEnd; w++ )
+    {
+        WorkerHistograms* theCounts = &theTask->workers[ w ];
+        int32_t theFirst = ( int32_t )( ( int64_t )theImage->height * w / theTask->numWorkers );
+        int32_t theLast = ( int32_t )( ( int64_t )theImage->height * ( w + 1 ) / theTask->numWorkers );
+        for( int32_t y = theFirst; y < theLast; y++ )
+        {
+            const uint8_t* theRow = ( const uint8_t* )imageRow( theImage, y );
+            if( theFormat && theFormat->paletted )
+            {
+                int theBits = theFormat->bitsPerPixel;
+                for( int32_t x = 0; x < theImage->width; x++ )
+                {
+                    int theShift = 8 - theBits - ( int )( ( x * theBits ) & 7 );
+                    theCounts->counts[ 0 ][ ( theRow[ ( x * theBits ) >> 3 ] >> theShift ) & ( ( 1 << theBits ) - 1 ) ]++;
+                }
+            }
+            else if( theFormat && theFormat->decodeRow )
+            {
+                size_t thePixelBytes = theFormat->bitsPerPixel / 8;
+                for( int32_t x = 0; x < theImage->width; x += FILTER_CHAIN_TILE_PIXELS )
+                {
+                    uint32_t theCount = theImage->width - x < FILTER_CHAIN_TILE_PIXELS ? theImage->width - x : FILTER_CHAIN_TILE_PIXELS;
+                    theFormat->decodeRow( theFormat, theRow + x * thePixelBytes, theTile, theCount );
+                    countPixels( theTile, theCount, theCounts );
+                }
+            }
+            else
+            {
+                countPixels( ( const BitmapColor* )theRow, theImage->width, theCounts );
+            }
+        }
+    }
+}
+
+int beginImageStatistics( WorkerPool* aPool, BufferPool* aBuffers, StatisticsAccumulator* aAccumulator )
+{
+    aAccumulator->numWorkers = aPool ? aPool->numThreads : 1;
+    aAccumulator->buffers = aBuffers;
+    aAccumulator->workers = allocateImageBuffer( aBuffers, sizeof( WorkerHistograms ) * aAccumulator->numWorkers );
+    if( !aAccumulator->workers )
+    {
+        return 0;
+    }
+    memset( aAccumulator->workers, 0, sizeof( WorkerHistograms ) * aAccumulator->numWorkers );
+    return 1;
+}
+
+// counts the rows of aImage; aFormat is NULL for packed BGR
+void accumulateImageStatistics( WorkerPool* aPool, StatisticsAccumulator* aAccumulator, const BitmapImage* aImage, const PixelFormat* aFormat )
+{
+    statisticsTaskArgs theTask;
+    theTask.image = aImage;
+    theTask.format = aFormat;
+    theTask.workers = aAccumulator->workers;
+    theTask.numWorkers = aAccumulator->numWorkers;
+    runParallel( aPool, aAccumulator->numWorkers, 1, statisticsBands, &theTask );
+}
+
+// adds up the workers' histograms; the index counts of a paletted image go through aPalette
+void finishImageStatistics( StatisticsAccumulator* aAccumulator, const BitmapColor* aPalette, ImageStatistics* aStatistics )
+{
+    memset( aStatistics, 0, sizeof( ImageStatistics ) );
+    for( int w = 0; w < aAccumulator->numWorkers; w++ )
+    {
+        for( int h = 0; h < NUM_HISTOGRAMS; h++ )
+        {
+            for( int v = 0; v < 256; v++ )
+            {
+                aStatistics->histograms[ h ][ v ] += aAccumulator->workers[ w ].counts[ h ][ v ];
+            }
+        }
+    }
+
+    if( aPalette )
+    {
+        uint64_t theIndices[ 256 ];
+        memcpy( theIndices, aStatistics->histograms[ 0 ], sizeof( theIndices ) );
+        memset( aStatistics, 0, sizeof( ImageStatistics ) );
+        for( int i = 0; i < 256; i++ )
+        {
+            WorkerHistograms theEntry;
+            memset( &theEntry, 0, sizeof( theEntry ) );
+            countPixels( &aPalette[ i ], 1, &theEntry );
+            for( int h = 0; h < NUM_HISTOGRAMS; h++ )
+            {
+                for( int v = 0; v < 256; v++ )
+                {
+                    aStatistics->histograms[ h ][ v ] += theEntry.counts[ h ][ v ] * theIndices[ i ];
+                }
+            }
+        }
+    }
+
+    for( int v = 0; v < 256; v++ )
+    {
+        aStatistics->pixels += aStatistics->histograms[ histogramBlue ][ v ];
+    }
+    freeImageBuffer( aAccumulator->buffers, aAccumulator->workers );
+    aAccumulator->workers = NULL;
+}
+
+int computeImageStatistics( WorkerPool* aPool, BufferPool* aBuffers, const BitmapImage* aImage, const PixelFormat* aFormat, const BitmapColor* aPalette, ImageStatistics* aStatistics )
+{
+    StatisticsAccumulator theAccumulator;
+    if( !beginImageStatistics( aPool, aBuffers, &theAccumulator ) )
+    {
+        return 0;
+    }
+    StageTimer theTimer = beginStage( stageFilter );
+    accumulateImageStatistics( aPool, &theAccumulator, aImage, aFormat );
+    finishImageStatistics( &theAccumulator, aPalette, aStatistics );
+    endStage( &theTimer );
+    return 1;
+}
+
+int isAdaptiveFilterOp( IMAGE_PROCESSING_TYPE aOp )
+{
+    return aOp == autoLevels || aOp == equalize;
+}
+
+int hasAdaptiveFilterOps( const FilterChain* aChain, int aFirst, int aEnd )
+{
+    for( int i = aFirst; i < aEnd && i < aChain->numOps; i++ )
+    {
+        if( isAdaptiveFilterOp( aChain->ops[ i ].type ) )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct
+{
+    uint8_t tables[ MAX_FILTER_OPS ][ 3 ][ 256 ];
+} AdaptiveTables;
+
+static void buildAdaptiveTable( IMAGE_PROCESSING_TYPE aOp, const uint64_t* aHistogram, uint8_t* aTable )
+{
+    int theLow = 0;
+    int theHigh = 255;
+    uint64_t theTotal = 0;
+    while( theLow < 255 && aHistogram[ theLow ] == 0 )
+    {
+        theLow++;
+    }
+    while( theHigh > 0 && aHistogram[ theHigh ] == 0 )
+    {
+        theHigh--;
+    }
+    for( int v = 0; v < 256; v++ )
+    {
+        theTotal += aHistogram[ v ];
+        aTable[ v ] = ( uint8_t )v;
+    }
+    if( theLow >= theHigh )
+    {
+        // a single level has nothing to stretch
+        return;
+    }
+
+    if( aOp == autoLevels )
+    {
+        FilterOp theLevels;
+        memset( &theLevels, 0, sizeof( theLevels ) );
+        theLevels.type = levels;
+        theLevels.parameters[ 0 ] = theLow;
+        theLevels.parameters[ 1 ] = theHigh;
+        for( int v = 0; v < 256; v++ )
+        {
+            aTable[ v ] = evaluatePointOp( &theLevels, 0, v );
+        }
+        return;
+    }
+
+    // equalize: the cumulative count, rescaled so the darkest level present maps to 0
+    uint64_t theCumulative = 0;
+    uint64_t theMinimum = aHistogram[ theLow ];
+    for( int v = 0; v < 256; v++ )
+    {
+        theCumulative += aHistogram[ v ];
+        aTable[ v ] = v < theLow ? 0 : ( uint8_t )lround( ( double )( theCumulative - theMinimum ) * 255.0 / ( double )( theTotal - theMinimum ) );
+    }
+}
+
+// fills in the tables of the autolevels and equalize ops in aChain from the statistics of the
+// image the chain starts from; the channel histograms are carried through the ops before each
+// one, so it sees the levels those ops produce. a luma op takes the luma histogram of the
+// source, which is exact when it comes before any op that changes the channels
+void resolveAdaptiveOps( FilterChain* aChain, const ImageStatistics* aStatistics, AdaptiveTables* aTables )
+{
+    uint64_t theHistograms[ 3 ][ 256 ];
+    uint64_t theMapped[ 256 ];
+    memcpy( theHistograms, aStatistics->histograms, sizeof( theHistograms ) );
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        FilterOp* theOp = &aChain->ops[ i ];
+        switch( theOp->type )
+        {
+            case grayscaleBlue:
+            case grayscaleGreen:
+            case grayscaleRed:
+            {
+                int theChannel = theOp->type == grayscaleBlue ? 0 : ( theOp->type == grayscaleGreen ? 1 : 2 );
+                for( int c = 0; c < 3; c++ )
+                {
+                    memcpy( theHistograms[ c ], theHistograms[ theChannel ], sizeof( theMapped ) );
+                }
+                continue;
+            }
+            case lumaBt601:
+            case lumaBt709:
+            {
+                for( int c = 0; c < 3; c++ )
+                {
+                    memcpy( theHistograms[ c ], aStatistics->histograms[ theOp->type == lumaBt601 ? histogramLuma601 : histogramLuma709 ], sizeof( theMapped ) );
+                }
+                continue;
+            }
+            case autoLevels:
+            case equalize:
+            {
+                for( int c = 0; c < 3; c++ )
+                {
+                    buildAdaptiveTable( theOp->type, theHistograms[ c ], aTables->tables[ i ][ c ] );
+                }
+                theOp->tables = ( const uint8_t ( * )[ 256 ] )aTables->tables[ i ];
+                break;
+            }
+            default:
+            {
+                break;
+            }
+        }
+        if( !isPointFilterOp( theOp->type ) )
+        {
+            continue;
+        }
+
+        for( int c = 0; c < 3; c++ )
+        {
+            if( theOp->channelMask == 0 || ( theOp->channelMask & ( 1 << c ) ) )
+            {
+                memset( theMapped, 0, sizeof( theMapped ) );
+                for( int v = 0; v < 256; v++ )
+                {
+                    theMapped[ evaluatePointOp( theOp, c, v ) ] += theHistograms[ c ][ v ];
+                }
+                memcpy( theHistograms[ c ], theMapped, sizeof( theMapped ) );
+            }
+        }
+    }
+}
+
+static pthread_mutex_t gStatisticsLock = PTHREAD_MUTEX_INITIALIZER;
+
+void writeJsonString( FILE* aFile, const char* aString )
+{
+    fputc( '"', aFile );
+    for( const unsigned char* theChar = ( const unsigned char* )aString; *theChar; theChar++ )
+    {
+        if( *theChar == '"' || *theChar == '\\' )
+        {
+            fprintf( aFile, "\\%c", *theChar );
+        }
+        else if( *theChar < 0x20 )
+        {
+            fprintf( aFile, "\\u%04x", *theChar );
+        }
+        else
+        {
+            fputc( *theChar, aFile );
+        }
+    }
+    fputc( '"', aFile );
+}
+
+// one line per image, so a batch run writes JSON Lines; lines of concurrent files never interleave
+void writeImageStatisticsJson( FILE* aFile, const char* aFilename, const BitmapHeaders* aHeaders, const ImageStatistics* aStatistics )
+{
+    pthread_mutex_lock( &gStatisticsLock );
+    fprintf( aFile, "{\"file\": " );
+    writeJsonString( aFile, aFilename );
+    fprintf( aFile, ", \"width\": %d, \"height\": %d, \"pixels\": %" PRIu64, aHeaders->width, aHeaders->height, aStatistics->pixels );
+    for( int h = 0; h < NUM_HISTOGRAMS; h++ )
+    {
+        const uint64_t* theHistogram = aStatistics->histograms[ h ];
+        int theMinimum = -1;
+        int theMaximum = -1;
+        double theSum = 0;
+        for( int v = 0; v < 256; v++ )
+        {
+            if( theHistogram[ v ] )
+            {
+                theMinimum = theMinimum < 0 ? v : theMinimum;
+                theMaximum = v;
+                theSum += ( double )v * theHistogram[ v ];
+            }
+        }
+        fprintf( aFile, ", \"%s\": {\"min\": %d, \"max\": %d, \"mean\": %.4f, \"histogram\": [", gHistogramNames[ h ],
+                 theMinimum, theMaximum, aStatistics->pixels ? theSum / aStatistics->pixels : 0.0 );
+        for( int v = 0; v < 256; v++ )
+        {
+            fprintf( aFile, "%s%" PRIu64, v ? "," : "", theHistogram[ v ] );
+        }
+        fprintf( aFile, "]}" );
+    }
+    fprintf( aFile, "}\n" );
+    fflush( aFile );
+    pthread_mutex_unlock( &gStatisticsLock );
+}
+
+// ---------- CONVOLUTION ----------
+
+typedef struct
+{
+    int radius;
+    int16_t weights[ 2 * CONVOLUTION_MAX_RADIUS + 2 ]; // 2 * radius + 1 taps, then zeros so kernels can take them in pairs
+} SeparableKernel;
+
+// rounds the weights to integers adding up to exactly 1 << CONVOLUTION_WEIGHT_BITS, the center
+// tap takes the rounding error so a flat area stays flat
+static void quantizeKernel( const float* aWeights, int aRadius, SeparableKernel* aKernel )
+{
+    float theTotal = 0;
+    int theSum = 0;
+    memset( aKernel, 0, sizeof( SeparableKernel ) );
+    aKernel->radius = aRadius;
+    for( int k = 0; k <= 2 * aRadius; k++ )
+    {
+        theTotal += aWeights[ k ];
+    }
+    for( int k = 0; k <= 2 * aRadius; k++ )
+    {
+        aKernel->weights[ k ] = ( int16_t )lroundf( aWeights[ k ] * ( 1 << CONVOLUTION_WEIGHT_BITS ) / theTotal );
+        theSum += aKernel->weights[ k ];
+    }
+    aKernel->weights[ aRadius ] += ( 1 << CONVOLUTION_WEIGHT_BITS ) - theSum;
+}
+
+void createBoxKernel( int aRadius, SeparableKernel* aKernel )
+{
+    float theWeights[ 2 * CONVOLUTION_MAX_RADIUS + 1 ];
+    for( int k = 0; k <= 2 * aRadius; k++ )
+    {
+        theWeights[ k ] = 1;
+    }
+    quantizeKernel( theWeights, aRadius, aKernel );
+}
+
+// radius of three sigma, beyond that the weights round to almost nothing
+void createGaussianKernel( float aSigma, SeparableKernel* aKernel )
+{
+    float theWeights[ 2 * CONVOLUTION_MAX_RADIUS + 1 ];
+    int theRadius = ( int )ceilf( 3 * aSigma );
+    if( theRadius > CONVOLUTION_MAX_RADIUS )
+    {
+        theRadius = CONVOLUTION_MAX_RADIUS;
+    }
+    for( int k = -theRadius; k <= theRadius; k++ )
+    {
+        theWeights[ k + theRadius ] = expf( -( float )( k * k ) / ( 2 * aSigma * aSigma ) );
+    }
+    quantizeKernel( theWeights, theRadius, aKernel );
+}
+
+typedef struct
+{
+    const BitmapImage* source;
+    BitmapImage* destination;
+    const SeparableKernel* kernel;
+    BufferPool* buffers;        // the scratch of every task call
+    int tilesPerRow;
+    int failed;
+} convolutionTaskArgs;
+
+// copies aCount pixels starting at column aFirst, repeating the edge pixels for columns outside the row
+static void loadClampedPixels( const uint8_t* aRow, int32_t aWidth, int32_t aFirst, int32_t aCount, uint8_t* aLine )
+{
+    int32_t x = 0;
+    for( ; x < aCount && aFirst + x < 0; x++ )
+    {
+        memcpy( aLine + 3 * x, aRow, 3 );
+    }
+    int32_t theInside = aWidth - ( aFirst + x );
+    if( theInside > aCount - x )
+    {
+        theInside = aCount - x;
+    }
+    memcpy( aLine + 3 * x, aRow + 3 * ( aFirst + x ), 3 * ( size_t )theInside );
+    for( x += theInside; x < aCount; x++ )
+    {
+        memcpy( aLine + 3 * x, aRow + 3 * ( aWidth - 1 ), 3 );
+    }
+}
+
+// worker pool task: separable convolution of a range of tiles; each tile runs the horizontal pass
+// over its rows plus the halo rows the vertical pass needs, so tiles never wait on each other
+void convolutionTiles( void* aContext, int aBegin, int aEnd )
+{
+    convolutionTaskArgs* theTask = ( convolutionTaskArgs* )aContext;
+    const BitmapImage* theSource = theTask->source;
+    const RowKernels* theKernels = getRowKernels();
+    int theRadius = theTask->kernel->radius;
+    int theTaps = 2 * theRadius + 1;
+    size_t theLineBytes = 3 * ( size_t )( CONVOLUTION_TILE_PIXELS + 2 * theRadius ) + 32;
+    size_t theTileBytes = 3 * CONVOLUTION_TILE_PIXELS;
+    uint8_t* theLine = ( uint8_t* )allocateImageBuffer( theTask->buffers, theLineBytes );
+    uint16_t* theRows = ( uint16_t* )allocateImageBuffer( theTask->buffers, sizeof( uint16_t ) * theTileBytes * ( CONVOLUTION_TILE_ROWS + 2 * theRadius ) );
+    const uint16_t* theTapRows[ 2 * CONVOLUTION_MAX_RADIUS + 1 ];
+    if( !theLine || !theRows )
+    {
+        __atomic_store_n( &theTask->failed, 1, __ATOMIC_RELAXED );
+        freeImageBuffer( theTask->buffers, theLine );
+        freeImageBuffer( theTask->buffers, theRows );
+        return;
+    }
+    memset( theLine, 0, theLineBytes );
+
+    for( int t = aBegin; t < aEnd; t++ )
+    {
+        int32_t theX = ( t % theTask->tilesPerRow ) * CONVOLUTION_TILE_PIXELS;
+        int32_t theY = ( t / theTask->tilesPerRow ) * CONVOLUTION_TILE_ROWS;
+        int32_t theWidth = theSource->width - theX < CONVOLUTION_TILE_PIXELS ? theSource->width - theX : CONVOLUTION_TILE_PIXELS;
+        int32_t theHeight = theSource->height - theY < CONVOLUTION_TILE_ROWS ? theSource->height - theY : CONVOLUTION_TILE_ROWS;
+
+        for( int32_t j = 0; j < theHeight + 2 * theRadius; j++ )
+        {
+            int32_t theSourceRow = theY - theRadius + j;
+            theSourceRow = theSourceRow < 0 ? 0 : ( theSourceRow >= theSource->height ? theSource->height - 1 : theSourceRow );
+            loadClampedPixels( ( const uint8_t* )imageRow( theSource, theSourceRow ), theSource->width, theX - theRadius, theWidth + 2 * theRadius, theLine );
+            theKernels->horizontalPass( theLine, theRows + j * theTileBytes, 3 * ( size_t )theWidth, theTask->kernel->weights, theTaps );
+        }
+
+        for( int32_t j = 0; j < theHeight; j++ )
+        {
+            for( int k = 0; k < theTaps; k++ )
+            {
+                theTapRows[ k ] = theRows + ( j + k ) * theTileBytes;
+            }
+            uint8_t* theDestination = ( uint8_t* )imageRow( theTask->destination, theY + j ) + 3 * ( size_t )theX;
+            theKernels->verticalPass( theTapRows, theDestination, 3 * ( size_t )theWidth, theTask->kernel->weights, theTaps );
+        }
+    }
+
+    freeImageBuffer( theTask->buffers, theLine );
+    freeImageBuffer( theTask->buffers, theRows );
+}
+
+// filters the 24 bpp aSource into aDestination, which must be a different image of the same size
+int convolveImage( WorkerPool* aPool, BufferPool* aBuffers, const SeparableKernel* aKernel, const BitmapImage* aSource, BitmapImage* aDestination )
+{
+    convolutionTaskArgs theTask;
+    theTask.source = aSource;
+    theTask.destination = aDestination;
+    theTask.kernel = aKernel;
+    theTask.buffers = aBuffers;
+    theTask.tilesPerRow = ( aSource->width + CONVOLUTION_TILE_PIXELS - 1 ) / CONVOLUTION_TILE_PIXELS;
+    theTask.failed = 0;
+    int theTileRows = ( aSource->height + CONVOLUTION_TILE_ROWS - 1 ) / CONVOLUTION_TILE_ROWS;
+
+    // every task call sets up its own scratch, so hand out a few tiles at a time
+    int theChunkSize = 1;
+    if( aPool && aPool->numThreads > 1 )
+    {
+        theChunkSize = theTask.tilesPerRow * theTileRows / ( aPool->numThreads * 4 );
+    }
+    if( theChunkSize < 1 )
+    {
+        theChunkSize = 1;
+    }
+    runParallel( aPool, theTask.tilesPerRow * theTileRows, theChunkSize, convolutionTiles, &theTask );
+    return !theTask.failed;
+}
+
+typedef struct
+{
+    const BitmapImage* source;
+    BitmapImage* destination;
+    int amount;                 // unsharp mask only, 8.8 fixed point
+} neighborhoodTaskArgs;
+
+// worker pool task: |gx| + |gy| of the 3x3 Sobel operator on each channel, edges repeated
+void sobelRows( void* aContext, int aBegin, int aEnd )
+{
+    neighborhoodTaskArgs* theTask = ( neighborhoodTaskArgs* )aContext;
+    const BitmapImage* theSource = theTask->source;
+    int32_t theLast = theSource->width - 1;
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        const uint8_t* theAbove = ( const uint8_t* )imageRow( theSource, y > 0 ? y - 1 : 0 );
+        const uint8_t* theMiddle = ( const uint8_t* )imageRow( theSource, y );
+        const uint8_t* theBelow = ( const uint8_t* )imageRow( theSource, y < theSource->height - 1 ? y + 1 : y );
+        uint8_t* theRow = ( uint8_t* )imageRow( theTask->destination, y );
+        for( int32_t x = 0; x <= theLast; x++ )
+        {
+            size_t theLeft = 3 * ( size_t )( x > 0 ? x - 1 : 0 );
+            size_t theCenter = 3 * ( size_t )x;
+            size_t theRight = 3 * ( size_t )( x < theLast ? x + 1 : theLast );
+            for( int c = 0; c < 3; c++ )
+            {
+                int theGradientX = theAbove[ theRight + c ] - theAbove[ theLeft + c ] + 2 * ( theMiddle[ theRight + c ] - theMiddle[ theLeft + c ] ) + theBelow[ theRight + c ] - theBelow[ theLeft + c ];
+                int theGradientY = theBelow[ theLeft + c ] + 2 * theBelow[ theCenter + c ] + theBelow[ theRight + c ] - theAbove[ theLeft + c ] - 2 * theAbove[ theCenter + c ] - theAbove[ theRight + c ];
+                int theMagnitude = abs( theGradientX ) + abs( theGradientY );
+                theRow[ theCenter + c ] = ( uint8_t )( theMagnitude > UINT8_MAX ? UINT8_MAX : theMagnitude );
+            }
+        }
+    }
+}
+
+// worker pool task: source + amount * ( source - blurred ), the blurred image is the destination
+void unsharpRows( void* aContext, int aBegin, int aEnd )
+{
+    neighborhoodTaskArgs* theTask = ( neighborhoodTaskArgs* )aContext;
+    size_t theRowBytes = 3 * ( size_t )theTask->source->width;
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        const uint8_t* theSource = ( const uint8_t* )imageRow( theTask->source, y );
+        uint8_t* theRow = ( uint8_t* )imageRow( theTask->destination, y );
+        for( size_t i = 0; i < theRowBytes; i++ )
+        {
+            int theValue = theSource[ i ] + ( ( theSource[ i ] - theRow[ i ] ) * theTask->amount + 128 ) / 256;
+            theRow[ i ] = ( uint8_t )( theValue < 0 ? 0 : ( theValue > UINT8_MAX ? UINT8_MAX : theValue ) );
+        }
+    }
+}
+
+// ---------- RESIZE ----------
+
+typedef struct // precomputed weights of one axis: output i blends taps[ i ] source pixels from start[ i ] on
+{
+    int32_t* start;
+    int* taps;
+    int16_t* weights;  // stride entries per output, adding up to 1 << CONVOLUTION_WEIGHT_BITS, zero past its taps
+    int stride;        // even, so kernels can take the weights in pairs
+    BufferPool* buffers;
+} ResizeWeights;
+
+static float getResizeSupport( IMAGE_PROCESSING_TYPE aFilter )
+{
+    return aFilter == resizeBox ? 0.5f : ( aFilter == resizeBilinear ? 1.0f : 3.0f );
+}
+
+static float evaluateResizeFilter( IMAGE_PROCESSING_TYPE aFilter, float x )
+{
+    switch( aFilter )
+    {
+        case resizeBox:
+        {
+            // half open, so every source pixel lands in exactly one output pixel
+            return x >= -0.5f && x < 0.5f ? 1.0f : 0.0f;
+        }
+        case resizeBilinear:
+        {
+            return fabsf( x ) < 1.0f ? 1.0f - fabsf( x ) : 0.0f;
+        }
+        default:
+        {
+            // Lanczos with three lobes
+            if( x == 0.0f )
+            {
+                return 1.0f;
+            }
+            if( fabsf( x ) >= 3.0f )
+            {
+                return 0.0f;
+            }
+            float thePiX = ( float )M_PI * x;
+            return 3.0f * sinf( thePiX ) * sinf( thePiX / 3.0f ) / ( thePiX * thePiX );
+        }
+    }
+}
+
+void freeResizeWeights( ResizeWeights* aWeights )
+{
+    freeImageBuffer( aWeights->buffers, aWeights->start );
+    freeImageBuffer( aWeights->buffers, aWeights->taps );
+    freeImageBuffer( aWeights->buffers, aWeights->weights );
+    aWeights->start = NULL;
+    aWeights->taps = NULL;
+    aWeights->weights = NULL;
+}
+
+// weights mapping aSize source pixels to aResultSize ones; a shrinking filter is stretched over
+// the source pixels every output pixel covers, so downscaling averages instead of skipping pixels
+int computeResizeWeights( BufferPool* aBuffers, IMAGE_PROCESSING_TYPE aFilter, int32_t aSize, int32_t aResultSize, ResizeWeights* aWeights )
+{
+    double theScale = ( double )aSize / aResultSize;
+    double theFilterScale = theScale > 1 ? theScale : 1;
+    double theSupport = getResizeSupport( aFilter ) * theFilterScale;
+    aWeights->stride = ( ( int )ceil( 2 * theSupport ) + 3 ) & ~1;
+    size_t theWeightsSize = sizeof( int16_t ) * aResultSize * ( size_t )aWeights->stride;
+    aWeights->buffers = aBuffers;
+    aWeights->start = ( int32_t* )allocateImageBuffer( aBuffers, sizeof( int32_t ) * aResultSize );
+    aWeights->taps = ( int* )allocateImageBuffer( aBuffers, sizeof( int ) * aResultSize );
+    aWeights->weights = ( int16_t* )allocateImageBuffer( aBuffers, theWeightsSize );
+    float* theWeights = ( float* )allocateImageBuffer( aBuffers, sizeof( float ) * aWeights->stride );
+    if( !aWeights->start || !aWeights->taps || !aWeights->weights || !theWeights )
+    {
+        freeResizeWeights( aWeights );
+        freeImageBuffer( aBuffers, theWeights );
+        return 0;
+    }
+    memset( aWeights->weights, 0, theWeightsSize );
+
+    for( int32_t i = 0; i < aResultSize; i++ )
+    {
+        double theCenter = ( i + 0.5 ) * theScale - 0.5;
+        int32_t theFirst = ( int32_t )ceil( theCenter - theSupport );
+        int32_t theLast = ( int32_t )floor( theCenter + theSupport );
+        theFirst = theFirst < 0 ? 0 : theFirst;
+        theLast = theLast >= aSize ? aSize - 1 : theLast;
+
+        // weights falling outside the image are dropped and the rest scaled back up to one
+        float theTotal = 0;
+        int theTaps = theLast - theFirst + 1;
+        for( int k = 0; k < theTaps; k++ )
+        {
+            theWeights[ k ] = evaluateResizeFilter( aFilter, ( float )( ( theFirst + k - theCenter ) / theFilterScale ) );
+            theTotal += theWeights[ k ];
+        }
+        if( theTaps <= 0 || theTotal == 0 )
+        {
+            theFirst = ( int32_t )lround( theCenter );
+            theFirst = theFirst < 0 ? 0 : ( theFirst >= aSize ? aSize - 1 : theFirst );
+            theTaps = 1;
+            theWeights[ 0 ] = theTotal = 1;
+        }
+
+        // rounded to integers adding up to exactly one, the largest weight takes the rounding error
+        int16_t* theResult = aWeights->weights + ( size_t )i * aWeights->stride;
+        int theSum = 0;
+        int theLargest = 0;
+        for( int k = 0; k < theTaps; k++ )
+        {
+            theResult[ k ] = ( int16_t )lroundf( theWeights[ k ] * ( 1 << CONVOLUTION_WEIGHT_BITS ) / theTotal );
+            theSum += theResult[ k ];
+            theLargest = theResult[ k ] > theResult[ theLargest ] ? k : theLargest;
+        }
+        theResult[ theLargest ] += ( 1 << CONVOLUTION_WEIGHT_BITS ) - theSum;
+        aWeights->start[ i ] = theFirst;
+        aWeights->taps[ i ] = theTaps;
+    }
+
+    freeImageBuffer( aBuffers, theWeights );
+    return 1;
+}
+
+// horizontal pass of a resize: one source row to fixed point output columns, clamped to the
+// byte range so the vertical pass can use the 16-bit convolution kernels
+static void resizeRowHorizontal( const uint8_t* aSource, uint16_t* aOut, const ResizeWeights* aColumns, int32_t aWidth )
+{
+    const int32_t theMaximum = UINT8_MAX << CONVOLUTION_FRACTION_BITS;
+    for( int32_t x = 0; x < aWidth; x++ )
+    {
+        const int16_t* theWeights = aColumns->weights + ( size_t )x * aColumns->stride;
+        const uint8_t* thePixel = aSource + 3 * ( size_t )aColumns->start[ x ];
+        int32_t theSums[ 3 ] = { 0, 0, 0 };
+        for( int k = 0; k < aColumns->taps[ x ]; k++ )
+        {
+            theSums[ 0 ] += theWeights[ k ] * thePixel[ 3 * k ];
+            theSums[ 1 ] += theWeights[ k ] * thePixel[ 3 * k + 1 ];
+            theSums[ 2 ] += theWeights[ k ] * thePixel[ 3 * k + 2 ];
+        }
+        for( int c = 0; c < 3; c++ )
+        {
+            int32_t theValue = ( theSums[ c ] + ( 1 << ( CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS - 1 ) ) ) >> ( CONVOLUTION_WEIGHT_BITS - CONVOLUTION_FRACTION_BITS );
+            aOut[ 3 * x + c ] = ( uint16_t )( theValue < 0 ? 0 : ( theValue > theMaximum ? theMaximum : theValue ) );
+        }
+    }
+}
+
+typedef struct
+{
+    const BitmapImage* source;
+    BitmapImage* destination;
+    ResizeWeights columns;
+    ResizeWeights rows;
+    int failed;
+} resizeTaskArgs;
+
+// worker pool task: resamples a range of output rows, a band at a time; the source rows of a
+// band go through the horizontal pass once, then every output row blends them vertically
+void resizeRows( void* aContext, int aBegin, int aEnd )
+{
+    resizeTaskArgs* theTask = ( resizeTaskArgs* )aContext;
+    const ResizeWeights* theRows = &theTask->rows;
+    const RowKernels* theKernels = getRowKernels();
+    size_t theRowBytes = 3 * ( size_t )theTask->destination->width;
+    size_t theCapacity = 0;
+    uint16_t* theScratch = NULL;
+    BufferPool* theBuffers = theTask->rows.buffers;
+    const uint16_t** theTapRows = ( const uint16_t** )allocateImageBuffer( theBuffers, sizeof( uint16_t* ) * theRows->stride );
+
+    for( int theBand = aBegin; theBand < aEnd && theTapRows; theBand += RESIZE_BAND_ROWS )
+    {
+        int theBandEnd = theBand + RESIZE_BAND_ROWS < aEnd ? theBand + RESIZE_BAND_ROWS : aEnd;
+        int32_t theFirst = theRows->start[ theBand ];
+        int32_t theLast = theRows->start[ theBandEnd - 1 ] + theRows->taps[ theBandEnd - 1 ];
+        if( ( size_t )( theLast - theFirst ) > theCapacity )
+        {
+            freeImageBuffer( theBuffers, theScratch );
+            theCapacity = theLast - theFirst;
+            theScratch = ( uint16_t* )allocateImageBuffer( theBuffers, sizeof( uint16_t ) * theRowBytes * theCapacity );
+            if( !theScratch )
+            {
+                break;
+            }
+        }
+
+        for( int32_t y = theFirst; y < theLast; y++ )
+        {
+            resizeRowHorizontal( ( const uint8_t* )imageRow( theTask->source, y ), theScratch + ( y - theFirst ) * theRowBytes, &theTask->columns, theTask->destination->width );
+        }
+        for( int y = theBand; y < theBandEnd; y++ )
+        {
+            for( int k = 0; k < theRows->taps[ y ]; k++ )
+            {
+                theTapRows[ k ] = theScratch + ( theRows->start[ y ] + k - theFirst ) * theRowBytes;
+            }
+            theKernels->verticalPass( theTapRows, ( uint8_t* )imageRow( theTask->destination, y ), theRowBytes, theRows->weights + ( size_t )y * theRows->stride, theRows->taps[ y ] );
+        }
+    }
+    if( !theTapRows || ( aBegin < aEnd && !theScratch ) )
+    {
+        __atomic_store_n( &theTask->failed, 1, __ATOMIC_RELAXED );
+    }
+
+    freeImageBuffer( theBuffers, theScratch );
+    freeImageBuffer( theBuffers, theTapRows );
+}
+
+// resamples the 24 bpp aSource to the size of aDestination with aFilter; returns 0 on failure
+int resizeImage( WorkerPool* aPool, BufferPool* aBuffers, IMAGE_PROCESSING_TYPE aFilter, const BitmapImage* aSource, BitmapImage* aDestination )
+{
+    resizeTaskArgs theTask;
+    theTask.source = aSource;
+    theTask.destination = aDestination;
+    theTask.failed = 0;
+    memset( &theTask.columns, 0, sizeof( ResizeWeights ) );
+    memset( &theTask.rows, 0, sizeof( ResizeWeights ) );
+    if( !computeResizeWeights( aBuffers, aFilter, aSource->width, aDestination->width, &theTask.columns ) || !computeResizeWeights( aBuffers, aFilter, aSource->height, aDestination->height, &theTask.rows ) )
+    {
+        freeResizeWeights( &theTask.columns );
+        return 0;
+    }
+
+    int theChunkSize = RESIZE_BAND_ROWS;
+    if( aPool && aPool->numThreads > 1 && aDestination->height / ( aPool->numThreads * 4 ) > theChunkSize )
+    {
+        theChunkSize = aDestination->height / ( aPool->numThreads * 4 );
+    }
+    runParallel( aPool, aDestination->height, theChunkSize, resizeRows, &theTask );
+
+    freeResizeWeights( &theTask.columns );
+    freeResizeWeights( &theTask.rows );
+    return !theTask.failed;
+}
+
+// ---------- ROTATE AND FLIP ----------
+
+typedef struct
+{
+    const uint8_t* origin;   // source pixel that lands in destination row 0, column 0
+    ptrdiff_t columnStep;    // source bytes between neighboring destination columns, a source row
+    ptrdiff_t rowStep;       // source bytes between neighboring destination rows, a source pixel
+    BitmapImage* destination;
+} transposeTaskArgs;
+
+// cache-oblivious transpose: halves the longer side of the block until it is small, so the source
+// rows a block reads and the destination rows it writes stay cached at every level without tuning
+static void transposeBlock( const transposeTaskArgs* aTask, int32_t aLeft, int32_t aRight, int32_t aBottom, int32_t aTop )
+{
+    if( aRight - aLeft > TRANSPOSE_BLOCK_PIXELS && aRight - aLeft >= aTop - aBottom )
+    {
+        int32_t theMiddle = aLeft + ( aRight - aLeft ) / 2;
+        transposeBlock( aTask, aLeft, theMiddle, aBottom, aTop );
+        transposeBlock( aTask, theMiddle, aRight, aBottom, aTop );
+        return;
+    }
+    if( aTop - aBottom > TRANSPOSE_BLOCK_PIXELS )
+    {
+        int32_t theMiddle = aBottom + ( aTop - aBottom ) / 2;
+        transposeBlock( aTask, aLeft, aRight, aBottom, theMiddle );
+        transposeBlock( aTask, aLeft, aRight, theMiddle, aTop );
+        return;
+    }
+
+    for( int32_t y = aBottom; y < aTop; y++ )
+    {
+        uint8_t* theDestination = ( uint8_t* )imageRow( aTask->destination, y ) + 3 * ( size_t )aLeft;
+        const uint8_t* theSource = aTask->origin + y * aTask->rowStep + aLeft * aTask->columnStep;
+        for( int32_t x = aLeft; x < aRight; x++ )
+        {
+            theDestination[ 0 ] = theSource[ 0 ];
+            theDestination[ 1 ] = theSource[ 1 ];
+            theDestination[ 2 ] = theSource[ 2 ];
+            theDestination += 3;
+            theSource += aTask->columnStep;
+        }
+    }
+}
+
+// worker pool task: transposes bands of destination rows
+void transposeRows( void* aContext, int aBegin, int aEnd )
+{
+    transposeTaskArgs* theTask = ( transposeTaskArgs* )aContext;
+    int32_t theHeight = theTask->destination->height;
+    for( int theBand = aBegin; theBand < aEnd; theBand++ )
+    {
+        int32_t theBottom = theBand * TRANSPOSE_BAND_ROWS;
+        int32_t theTop = theBottom + TRANSPOSE_BAND_ROWS < theHeight ? theBottom + TRANSPOSE_BAND_ROWS : theHeight;
+        transposeBlock( theTask, 0, theTask->destination->width, theBottom, theTop );
+    }
+}
+
+typedef struct
+{
+    const BitmapImage* source;
+    BitmapImage* destination;
+} mirrorTaskArgs;
+
+// worker pool task: reverses the pixels of each row
+void mirrorRows( void* aContext, int aBegin, int aEnd )
+{
+    mirrorTaskArgs* theTask = ( mirrorTaskArgs* )aContext;
+    int32_t theWidth = theTask->source->width;
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        const BitmapColor* theSource = imageRow( theTask->source, y );
+        BitmapColor* theDestination = imageRow( theTask->destination, y );
+        for( int32_t x = 0; x < theWidth; x++ )
+        {
+            theDestination[ x ] = theSource[ theWidth - 1 - x ];
+        }
+    }
+}
+
+// rotates or mirrors the 24 bpp aSource into aDestination, which has the size getFilterOpOutputSize
+// gives; rows are bottom-up, so a clockwise turn takes destination row y from source column W - 1 - y.
+// A vertical flip never gets here, it only reverses the row order of a view
+void rotateImage( WorkerPool* aPool, IMAGE_PROCESSING_TYPE aOp, const BitmapImage* aSource, BitmapImage* aDestination )
+{
+    if( aOp == flipHorizontal || aOp == rotate180 )
+    {
+        // a half turn is a mirror of the rows taken top to bottom
+        mirrorTaskArgs theTask;
+        BitmapImage theSource = *aSource;
+        if( aOp == rotate180 )
+        {
+            flipImageRows( &theSource );
+        }
+        theTask.source = &theSource;
+        theTask.destination = aDestination;
+        runParallel( aPool, aDestination->height, TRANSPOSE_BAND_ROWS, mirrorRows, &theTask );
+        return;
+    }
+
+    transposeTaskArgs theTask;
+    theTask.destination = aDestination;
+    const uint8_t* theBottomRow = ( const uint8_t* )imageRow( aSource, 0 );
+    const uint8_t* theTopRow = ( const uint8_t* )imageRow( aSource, aSource->height - 1 );
+    size_t theLastPixel = 3 * ( size_t )( aSource->width - 1 );
+    if( aOp == rotate90 )
+    {
+        theTask.origin = theBottomRow + theLastPixel;
+        theTask.columnStep = aSource->stride;
+        theTask.rowStep = -3;
+    }
+    else if( aOp == rotate270 )
+    {
+        theTask.origin = theTopRow;
+        theTask.columnStep = -( ptrdiff_t )aSource->stride;
+        theTask.rowStep = 3;
+    }
+    else
+    {
+        theTask.origin = theTopRow + theLastPixel;
+        theTask.columnStep = -( ptrdiff_t )aSource->stride;
+        theTask.rowStep = -3;
+    }
+    runParallel( aPool, ( aDestination->height + TRANSPOSE_BAND_ROWS - 1 ) / TRANSPOSE_BAND_ROWS, 1, transposeRows, &theTask );
+}
+
+// ---------- WHOLE-IMAGE OPS ----------
+
+// runs one neighborhood op over the whole 24 bpp aSource into aDestination, which has the size
+// getFilterOpOutputSize gives; returns 0 on failure
+int applyNeighborhoodOp( WorkerPool* aPool, BufferPool* aBuffers, const FilterOp* aOp, const BitmapImage* aSource, BitmapImage* aDestination )
+{
+    SeparableKernel theKernel;
+    neighborhoodTaskArgs theTask;
+    int theResult = 1;
+    theTask.source = aSource;
+    theTask.destination = aDestination;
+    theTask.amount = ( int )lroundf( aOp->parameters[ 0 ] * 256 );
+
+    int theChunkSize = 1;
+    if( aPool && aPool->numThreads > 1 )
+    {
+        theChunkSize = aSource->height / ( aPool->numThreads * 8 );
+    }
+    if( theChunkSize < 1 )
+    {
+        theChunkSize = 1;
+    }
+
+    StageTimer theTimer = beginStage( stageFilter );
+    switch( aOp->type )
+    {
+        case boxBlur:
+        {
+            createBoxKernel( ( int )aOp->parameters[ 0 ], &theKernel );
+            theResult = convolveImage( aPool, aBuffers, &theKernel, aSource, aDestination );
+            break;
+        }
+        case gaussianBlur:
+        {
+            createGaussianKernel( aOp->parameters[ 0 ], &theKernel );
+            theResult = convolveImage( aPool, aBuffers, &theKernel, aSource, aDestination );
+            break;
+        }
+        case unsharpMask:
+        {
+            createGaussianKernel( aOp->parameters[ 1 ], &theKernel );
+            theResult = convolveImage( aPool, aBuffers, &theKernel, aSource, aDestination );
+            if( theResult )
+            {
+                runParallel( aPool, aSource->height, theChunkSize, unsharpRows, &theTask );
+            }
+            break;
+        }
+        case sobelEdges:
+        {
+            runParallel( aPool, aSource->height, theChunkSize, sobelRows, &theTask );
+            break;
+        }
+        case resizeBox:
+        case resizeBilinear:
+        case resizeLanczos:
+        {
+            theResult = resizeImage( aPool, aBuffers, aOp->type, aSource, aDestination );
+            break;
+        }
+        case rotate90:
+        case rotate180:
+        case rotate270:
+        case flipHorizontal:
+        case transpose:
+        {
+            rotateImage( aPool, aOp->type, aSource, aDestination );
+            break;
+        }
+        default:
+        {
+            break;
+        }
+    }
+    endStage( &theTimer );
+    return theResult;
+}
+
+// number of leading ops of the chain that have to run as whole-image passes: everything up to
+// and including its last neighborhood op; the point ops after it can still run per strip
+// number of leading ops that have to run over the whole image; once there is any, autolevels and
+// equalize ops after it join them, as they need the statistics of the image it produces
+int countNeighborhoodPrefix( const FilterChain* aChain )
+{
+    int theCount = 0;
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        if( isNeighborhoodFilterOp( aChain->ops[ i ].type ) || ( theCount > 0 && isAdaptiveFilterOp( aChain->ops[ i ].type ) ) )
+        {
+            theCount = i + 1;
+        }
+    }
+    return theCount;
+}
+
+// runs the first aNumOps ops of the chain over the 24 bpp aSource, each into a new image of the
+// size it produces; runs of point ops between neighborhood ops still go through one merged pass,
+// with autolevels and equalize resolved from the image the run starts from, and vertical flips
+// just reverse the rows of what is there. Returns the image holding the result,
+// with no data on failure; it may be a view of aSource, which the caller must not free then
+BitmapImage applyNeighborhoodPrefix( WorkerPool* aPool, BufferPool* aBuffers, const FilterChain* aChain, int aNumOps, const BitmapImage* aSource, int* aOwned )
+{
+    BitmapImage theResult = *aSource;
+    int theOwned = 0;
+    for( int i = 0; i < aNumOps; )
+    {
+        if( aChain->ops[ i ].type == flipVertical )
+        {
+            flipImageRows( &theResult );
+            i++;
+            continue;
+        }
+
+        int32_t theWidth = theResult.width;
+        int32_t theHeight = theResult.height;
+        getFilterOpOutputSize( &aChain->ops[ i ], &theWidth, &theHeight );
+        BitmapImage theOutput = allocateImageMemory( aBuffers, theWidth, theHeight, theResult.bitsPerPixel );
+        int theFailed = !theOutput.data;
+        if( theFailed )
+        {
+            // nothing to run on
+        }
+        else if( isNeighborhoodFilterOp( aChain->ops[ i ].type ) )
+        {
+            theFailed = !applyNeighborhoodOp( aPool, aBuffers, &aChain->ops[ i ], &theResult, &theOutput );
+            i++;
+        }
+        else
+        {
+            FilterChain theSegment;
+            theSegment.numOps = 0;
+            for( ; i < aNumOps && !isNeighborhoodFilterOp( aChain->ops[ i ].type ); i++ )
+            {
+                theSegment.ops[ theSegment.numOps++ ] = aChain->ops[ i ];
+            }
+
+            ImageStatistics theStatistics;
+            AdaptiveTables theTables;
+            if( hasAdaptiveFilterOps( &theSegment, 0, theSegment.numOps ) )
+            {
+                theFailed = !computeImageStatistics( aPool, aBuffers, &theResult, NULL, NULL, &theStatistics );
+                if( !theFailed )
+                {
+                    resolveAdaptiveOps( &theSegment, &theStatistics, &theTables );
+                }
+            }
+            if( !theFailed )
+            {
+                processImageChain( aPool, &theSegment, &theResult, &theOutput );
+            }
+        }
+
+        // only the latest image is needed from here on
+        if( theOwned )
+        {
+            freeImageData( aBuffers, &theResult );
+        }
+        theResult = theOutput;
+        theOwned = 1;
+        if( theFailed )
+        {
+            freeImageData( aBuffers, &theResult );
+            break;
+        }
+    }
+    *aOwned = theOwned;
+    return theResult;
+}
+
+// ---------- FUSED MULTI-OUTPUT PROCESSING ----------
+
+typedef struct // one halving of an output, built from the rows of the level above as they are written
+{
+    char filename[ PATH_MAX ];
+    FILE* file;
+    OutputStream stream;     // the pixels, after the headers written to file
+    int32_t sourceWidth;     // of the level above
+    int32_t width;
+    int32_t height;
+    uint32_t stride;
+    int pixelBytes;          // 3, or 1 for 8 bpp gray outputs
+    int rowsIn;              // rows of the level above seen so far
+    int rowsOut;
+    uint8_t* pending;        // even row of the level above, waiting for the odd one
+    uint8_t* row;            // padded output row
+} PyramidLevel;
+
+typedef struct
+{
+    const CompiledFilterChain* chain;
+    const char* filterName;  // substituted for {filter} in output names, e.g. "invert"
+    const char* description; // used in the progress message, e.g. "inverted"
+    char filename[ PATH_MAX ];
+    FILE* file;              // headers must already have been written
+    OutputStream* stream;    // the pixels, NULL if the file could not be created
+    uint8_t* strip;          // filtered rows waiting to be written
+    int reserved;            // strip lies in the stream's buffer and is written in place
+    uint32_t stride;         // bytes per output row, less than the source's for 8 bpp gray outputs
+    uint8_t* rleRow;         // RLE8 outputs only: room for one encoded row
+    uint32_t imageOffset;    // RLE8 outputs only: where the codes start, the sizes are patched at the end
+    const FilterChain* sourceChain;
+    int neighborhoodOps;     // leading ops of sourceChain run over the whole image before chain
+    PyramidLevel* levels;    // --pyramid: ½, ¼, ... of the output, fed from the rows being written
+    int numLevels;
+    BufferPool* buffers;     // what the output owns (stream, levels, RLE row) comes from it
+} FusedOutput;
+
+typedef struct
+{
+    const BitmapImage* source;
+    FusedOutput* outputs;
+    int numOutputs;
+    int firstRow;            // source row that lands in row 0 of every strip
+} fusedTaskArgs;
+
+// worker pool task: each source row is loaded once and run through every requested filter chain
+void fusedProcessingRows( void* aContext, int aBegin, int aEnd )
+{
+    fusedTaskArgs* theTask = ( fusedTaskArgs* )aContext;
+    const BitmapImage* theSource = theTask->source;
+
+    for( int y = aBegin; y < aEnd; y++ )
+    {
+        const uint8_t* theSourceRow = ( const uint8_t* )imageRow( theSource, theTask->firstRow + y );
+        for( int i = 0; i < theTask->numOutputs; i++ )
+        {
+            uint8_t* theRow = theTask->outputs[ i ].strip + ( size_t )y * theTask->outputs[ i ].stride;
+            applyFilterChain( theTask->outputs[ i ].chain, theSourceRow, theRow, theSource->width );
+        }
+    }
+}
+
+void closePyramidLevels( FusedOutput* aOutput )
+{
+    for( int i = 0; i < aOutput->numLevels; i++ )
+    {
+        if( aOutput->levels[ i ].file )
+        {
+            closeOutputStream( &aOutput->levels[ i ].stream, NULL );
+            fclose( aOutput->levels[ i ].file );
+        }
+        freeImageBuffer( aOutput->buffers, aOutput->levels[ i ].pending );
+        freeImageBuffer( aOutput->buffers, aOutput->levels[ i ].row );
+    }
+    freeImageBuffer( aOutput->buffers, aOutput->levels );
+    aOutput->levels = NULL;
+    aOutput->numLevels = 0;
+}
+
+static void feedPyramidRow( FusedOutput* aOutput, int aLevel, const uint8_t* aRow );
+
+// averages 2x2 pixels of the level above into the level's row, writes it and passes it on
+static void emitPyramidRow( FusedOutput* aOutput, int aLevel, const uint8_t* aTop, const uint8_t* aBottom )
+{
+    PyramidLevel* theLevel = &aOutput->levels[ aLevel ];
+    int32_t theLastColumn = theLevel->sourceWidth - 1;
+    int theBytes = theLevel->pixelBytes;
+    for( int32_t x = 0; x < theLevel->width; x++ )
+    {
+        size_t theLeft = 2 * ( size_t )x * theBytes;
+        size_t theRight = ( 2 * x + 1 <= theLastColumn ? 2 * ( size_t )x + 1 : 2 * ( size_t )x ) * theBytes;
+        for( int c = 0; c < theBytes; c++ )
+        {
+            theLevel->row[ x * theBytes + c ] = ( uint8_t )( ( aTop[ theLeft + c ] + aTop[ theRight + c ] + aBottom[ theLeft + c ] + aBottom[ theRight + c ] + 2 ) >> 2 );
+        }
+    }
+    appendOutputStream( &theLevel->stream, theLevel->row, theLevel->stride );
+    theLevel->rowsOut++;
+    feedPyramidRow( aOutput, aLevel + 1, theLevel->row );
+}
+
+// hands one row of the level above to aLevel; rows pair up, an odd last row is dropped
+static void feedPyramidRow( FusedOutput* aOutput, int aLevel, const uint8_t* aRow )
+{
+    if( aLevel >= aOutput->numLevels )
+    {
+        return;
+    }
+    PyramidLevel* theLevel = &aOutput->levels[ aLevel ];
+    if( theLevel->rowsIn++ % 2 == 0 )
+    {
+        memcpy( theLevel->pending, aRow, ( size_t )theLevel->sourceWidth * theLevel->pixelBytes );
+    }
+    else if( theLevel->rowsOut < theLevel->height )
+    {
+        emitPyramidRow( aOutput, aLevel, theLevel->pending, aRow );
+    }
+}
+
+// a level whose level above has a single row repeats it, so every level ends up complete
+void finishPyramidLevels( FusedOutput* aOutput )
+{
+    for( int i = 0; i < aOutput->numLevels; i++ )
+    {
+        PyramidLevel* theLevel = &aOutput->levels[ i ];
+        if( theLevel->rowsOut < theLevel->height && theLevel->rowsIn > 0 )
+        {
+            emitPyramidRow( aOutput, i, theLevel->pending, theLevel->pending );
+        }
+    }
+}
+
+// writes aRows filtered rows of aOutput, run-length encoding them if it is an RLE8 output
+void writeOutputRows( FusedOutput* aOutput, const uint8_t* aStrip, int aRows, int32_t aWidth )
+{
+    if( !aOutput->stream )
+    {
+        return;
+    }
+    for( int y = 0; y < aRows && aOutput->numLevels > 0; y++ )
+    {
+        feedPyramidRow( aOutput, 0, aStrip + ( size_t )y * aOutput->stride );
+    }
+    if( aOutput->reserved )
+    {
+        commitOutputStream( aOutput->stream, ( size_t )aOutput->stride * aRows );
+        return;
+    }
+    if( !aOutput->rleRow )
+    {
+        appendOutputStream( aOutput->stream, aStrip, ( size_t )aOutput->stride * aRows );
+        return;
+    }
+    for( int y = 0; y < aRows; y++ )
+    {
+        size_t theSize = encodeRle8Row( aStrip + ( size_t )y * aOutput->stride, aWidth, aOutput->rleRow );
+        appendOutputStream( aOutput->stream, aOutput->rleRow, theSize );
+    }
+}
+
+// writes out what is still buffered of an output and its pyramid levels and waits for it; RLE8
+// outputs get their end code and the sizes only known now. Returns the errno of the first failed
+// write, 0 if there was none
+int finishOutputFile( FusedOutput* aOutput )
+{
+    static const uint8_t theEndOfBitmap[ 2 ] = { 0, 1 };
+    if( !aOutput->stream )
+    {
+        return 0;
+    }
+
+    finishPyramidLevels( aOutput );
+    int theError = 0;
+    for( int i = 0; i < aOutput->numLevels; i++ )
+    {
+        int theLevelError = closeOutputStream( &aOutput->levels[ i ].stream, NULL );
+        theError = theError ? theError : theLevelError;
+    }
+
+    uint64_t theEnd = 0;
+    if( aOutput->rleRow )
+    {
+        appendOutputStream( aOutput->stream, theEndOfBitmap, sizeof( theEndOfBitmap ) );
+    }
+    int theOutputError = closeOutputStream( aOutput->stream, &theEnd );
+    theError = theError ? theError : theOutputError;
+    if( aOutput->rleRow && !theError )
+    {
+        // image_size_bytes sits at the same place in the info, V4 and V5 headers
+        uint32_t theFileSize = ( uint32_t )theEnd;
+        uint32_t theImageSize = theFileSize - aOutput->imageOffset;
+        int theFd = fileno( aOutput->file );
+        if( pwrite( theFd, &theFileSize, sizeof( uint32_t ), offsetof( BITMAPFILEHEADER, size ) ) != sizeof( uint32_t ) ||
+            pwrite( theFd, &theImageSize, sizeof( uint32_t ), sizeof( BITMAPFILEHEADER ) + offsetof( BITMAPINFOHEADER, image_size_bytes ) ) != sizeof( uint32_t ) )
+        {
+            theError = errno;
+        }
+    }
+    return theError;
+}
+
+// produces every output in one pass over aSource, writing each output a strip at a time
+int processImageFused( WorkerPool* aPool, BufferPool* aBuffers, const BitmapImage* aSource, FusedOutput* aOutputs, int aNumOutputs )
+{
+    int theStripRows = calculateStripRows( aSource, FUSED_STRIP_BYTES );
+    int theResult = 1;
+
+    // plain outputs are filtered straight into their stream's buffer, which is written while the
+    // next strip is filtered; RLE8 outputs encode from a strip of their own
+    for( int i = 0; i < aNumOutputs; i++ )
+    {
+        aOutputs[ i ].reserved = aOutputs[ i ].stream && !aOutputs[ i ].rleRow && canReserveOutputStream( aOutputs[ i ].stream, ( size_t )aOutputs[ i ].stride * theStripRows );
+        if( aOutputs[ i ].reserved )
+        {
+            continue;
+        }
+        aOutputs[ i ].strip = allocateImageBuffer( aBuffers, ( size_t )aOutputs[ i ].stride * theStripRows );
+        if( !aOutputs[ i ].strip )
+        {
+            theResult = 0;
+        }
+    }
+
+    if( theResult )
+    {
+        // the filters never touch the padding, so clearing it once covers every strip of its own
+        for( int i = 0; i < aNumOutputs; i++ )
+        {
+            if( !aOutputs[ i ].reserved )
+            {
+                BitmapImage theStripImage = { aSource->width, theStripRows, aOutputs[ i ].chain->outputBitsPerPixel, aOutputs[ i ].stride, aOutputs[ i ].strip };
+                touchImageLocal( aPool, &theStripImage );
+                clearImagePadding( &theStripImage );
+            }
+        }
+
+        fusedTaskArgs theTask;
+        theTask.source = aSource;
+        theTask.outputs = aOutputs;
+        theTask.numOutputs = aNumOutputs;
+
+        int theChunkSize = 1;
+        if( aPool && aPool->numThreads > 1 )
+        {
+            theChunkSize = theStripRows / ( aPool->numThreads * 4 );
+        }
+
+        for( int theFirstRow = 0; theFirstRow < aSource->height; theFirstRow += theStripRows )
+        {
+            int theRows = aSource->height - theFirstRow;
+            if( theRows > theStripRows )
+            {
+                theRows = theStripRows;
+            }
+
+            for( int i = 0; i < aNumOutputs; i++ )
+            {
+                if( aOutputs[ i ].reserved )
+                {
+                    BitmapImage theStripImage = { aSource->width, theRows, aOutputs[ i ].chain->outputBitsPerPixel, aOutputs[ i ].stride, NULL };
+                    theStripImage.data = reserveOutputStream( aOutputs[ i ].stream, ( size_t )aOutputs[ i ].stride * theRows );
+                    clearImagePadding( &theStripImage );
+                    aOutputs[ i ].strip = theStripImage.data;
+                }
+            }
+
+            theTask.firstRow = theFirstRow;
+            StageTimer theTimer = beginStage( stageFilter );
+            runParallelBands( aPool, theRows, theChunkSize, fusedProcessingRows, &theTask );
+            endStage( &theTimer );
+
+            theTimer = beginStage( stageWrite );
+            for( int i = 0; i < aNumOutputs; i++ )
+            {
+                writeOutputRows( &aOutputs[ i ], aOutputs[ i ].strip, theRows, aSource->width );
+            }
+            endStage( &theTimer );
+            addRunCounter( &gRunStats.rowsDone, theRows );
+        }
+    }
+
+    for( int i = 0; i < aNumOutputs; i++ )
+    {
+        if( !aOutputs[ i ].reserved )
+        {
+            freeImageBuffer( aBuffers, aOutputs[ i ].strip );
+        }
+        aOutputs[ i ].strip = NULL;
+        aOutputs[ i ].reserved = 0;
+    }
+
+    return theResult;
+}
+
+// outputs starting with neighborhood ops each get a filtered copy of the image to run the rest of
+// their chain over; all the others still share one pass over the source. Neighborhood ops see a
+// top-down source through a reversed view, their outputs are written bottom-up
+int processImageOutputs( WorkerPool* aPool, BufferPool* aBuffers, const BitmapImage* aSource, int aSourceTopDown, FusedOutput* aOutputs, int aNumOutputs )
+{
+    FusedOutput thePointOutputs[ MAX_FUSED_OUTPUTS ];
+    int theNumPointOutputs = 0;
+    int theResult = 1;
+    for( int i = 0; i < aNumOutputs; i++ )
+    {
+        if( aOutputs[ i ].neighborhoodOps == 0 )
+        {
+            thePointOutputs[ theNumPointOutputs++ ] = aOutputs[ i ];
+            continue;
+        }
+
+        int theOwned;
+        BitmapImage theSource = *aSource;
+        if( aSourceTopDown )
+        {
+            flipImageRows( &theSource );
+        }
+        BitmapImage theFiltered = applyNeighborhoodPrefix( aPool, aBuffers, aOutputs[ i ].sourceChain, aOutputs[ i ].neighborhoodOps, &theSource, &theOwned );
+        theResult &= theFiltered.data && processImageFused( aPool, aBuffers, &theFiltered, &aOutputs[ i ], 1 );
+        if( theOwned )
+        {
+            freeImageData( aBuffers, &theFiltered );
+        }
+    }
+    if( theNumPointOutputs > 0 )
+    {
+        theResult &= processImageFused( aPool, aBuffers, aSource, thePointOutputs, theNumPointOutputs );
+    }
+    return theResult;
+}
+
+// ---------- STREAMING STRIP PIPELINE ----------
+
+typedef enum
+{
+    stripEmpty,    // free for the reader
+    stripRead,     // source rows loaded, waiting for the filters
+    stripFiltered  // outputs ready, waiting for the writers
+} STRIP_STATE;
+
+typedef struct
+{
+    uint8_t* input;
+    uint8_t* outputs[ MAX_FUSED_OUTPUTS ];
+    int sequence;       // which strip of the image this slot currently holds
+    int numRows;
+    int pendingWrites;  // writers that still have to flush this strip
+    STRIP_STATE state;
+} PipelineStrip;
+
+typedef struct
+{
+    PipelineStrip strips[ PIPELINE_DEPTH ]; // bounded ring shared by all stages
+    int stripRows;
+    int numSequences;
+    BitmapImage layout;  // width, bit count and stride of the image, no data
+    FILE* input;
+    FusedOutput* outputs;
+    int numOutputs;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} StripPipeline;
+
+typedef struct
+{
+    StripPipeline* pipeline;
+    int outputIndex;
+} pipelineWriterArgs;
+
+static PipelineStrip* waitForStrip( StripPipeline* aPipeline, int aSequence, STRIP_STATE aState )
+{
+    PipelineStrip* theStrip = &aPipeline->strips[ aSequence % PIPELINE_DEPTH ];
+    pthread_mutex_lock( &aPipeline->lock );
+    while( theStrip->sequence != aSequence || theStrip->state != aState )
+    {
+        pthread_cond_wait( &aPipeline->changed, &aPipeline->lock );
+    }
+    pthread_mutex_unlock( &aPipeline->lock );
+    return theStrip;
+}
+
+static void* pipelineReaderThread( void* args )
+{
+    StripPipeline* thePipeline = ( StripPipeline* )args;
+    for( int theSequence = 0; theSequence < thePipeline->numSequences; theSequence++ )
+    {
+        PipelineStrip* theStrip = waitForStrip( thePipeline, theSequence, stripEmpty );
+
+        int theRows = thePipeline->layout.height - theSequence * thePipeline->stripRows;
+        if( theRows > thePipeline->stripRows )
+        {
+            theRows = thePipeline->stripRows;
+        }
+
+        StageTimer theTimer = beginStage( stageRead );
+        size_t theSize = ( size_t )thePipeline->layout.stride * theRows;
+        size_t theBytesRead = fread( theStrip->input, sizeof( uint8_t ), theSize, thePipeline->input );
+        addRunCounter( &gRunStats.bytesRead, theBytesRead );
+        if( theBytesRead < theSize )
+        {
+            // truncated file, missing rows come out black
+            memset( theStrip->input + theBytesRead, 0, theSize - theBytesRead );
+        }
+        endStage( &theTimer );
+
+        pthread_mutex_lock( &thePipeline->lock );
+        theStrip->numRows = theRows;
+        theStrip->state = stripRead;
+        pthread_cond_broadcast( &thePipeline->changed );
+        pthread_mutex_unlock( &thePipeline->lock );
+    }
+    return NULL;
+}
+
+static void* pipelineWriterThread( void* args )
+{
+    pipelineWriterArgs* theArgs = ( pipelineWriterArgs* )args;
+    StripPipeline* thePipeline = theArgs->pipeline;
+    FusedOutput* theOutput = &thePipeline->outputs[ theArgs->outputIndex ];
+
+    for( int theSequence = 0; theSequence < thePipeline->numSequences; theSequence++ )
+    {
+        PipelineStrip* theStrip = waitForStrip( thePipeline, theSequence, stripFiltered );
+
+        if( theOutput->stream )
+        {
+            StageTimer theTimer = beginStage( stageWrite );
+            writeOutputRows( theOutput, theStrip->outputs[ theArgs->outputIndex ], theStrip->numRows, thePipeline->layout.width );
+            endStage( &theTimer );
+        }
+
+        // the last writer hands the slot back to the reader
+        pthread_mutex_lock( &thePipeline->lock );
+        theStrip->pendingWrites--;
+        if( theStrip->pendingWrites == 0 )
+        {
+            theStrip->state = stripEmpty;
+            theStrip->sequence += PIPELINE_DEPTH;
+            pthread_cond_broadcast( &thePipeline->changed );
+        }
+        pthread_mutex_unlock( &thePipeline->lock );
+    }
+
+    // the writes this thread submitted must land before it exits
+    if( theOutput->stream )
+    {
+        drainOutputStream( theOutput->stream );
+        for( int i = 0; i < theOutput->numLevels; i++ )
+        {
+            drainOutputStream( &theOutput->levels[ i ].stream );
+        }
+    }
+    return NULL;
+}
+
+// reads, filters and writes the image strip by strip: a reader thread fills a small ring of strips,
+// the worker pool filters them and one writer thread per output flushes them, so peak memory
+// depends on aStripRows and not on the image size
+int processImageStreaming( WorkerPool* aPool, BufferPool* aBuffers, const BitmapHeaders* aHeaders, FILE* aFile, FusedOutput* aOutputs, int aNumOutputs, int aStripRows )
+{
+    StripPipeline thePipeline;
+    memset( &thePipeline, 0, sizeof( StripPipeline ) );
+    thePipeline.layout.width = aHeaders->width > 0 ? aHeaders->width : 0;
+    thePipeline.layout.height = aHeaders->height > 0 ? aHeaders->height : 0;
+    thePipeline.layout.bitsPerPixel = aHeaders->bitsPerPixel;
+    thePipeline.layout.stride = calculateRowStride( thePipeline.layout.width, aHeaders->bitsPerPixel );
+    thePipeline.input = aFile;
+    thePipeline.outputs = aOutputs;
+    thePipeline.numOutputs = aNumOutputs;
+    if( aNumOutputs > MAX_FUSED_OUTPUTS || thePipeline.layout.height == 0 )
+    {
+        return 0;
+    }
+
+    thePipeline.stripRows = aStripRows > 0 ? aStripRows : calculateStripRows( &thePipeline.layout, FUSED_STRIP_BYTES );
+    if( thePipeline.stripRows > thePipeline.layout.height )
+    {
+        thePipeline.stripRows = thePipeline.layout.height;
+    }
+    thePipeline.numSequences = ( thePipeline.layout.height + thePipeline.stripRows - 1 ) / thePipeline.stripRows;
+
+    size_t theStripSize = ( size_t )thePipeline.layout.stride * thePipeline.stripRows;
+    int theResult = 1;
+    for( int s = 0; s < PIPELINE_DEPTH; s++ )
+    {
+        PipelineStrip* theStrip = &thePipeline.strips[ s ];
+        theStrip->sequence = s;
+        theStrip->state = stripEmpty;
+        theStrip->input = allocateImageBuffer( aBuffers, theStripSize );
+        theResult &= theStrip->input != NULL;
+        if( theStrip->input )
+        {
+            BitmapImage theInputStrip = thePipeline.layout;
+            theInputStrip.height = thePipeline.stripRows;
+            theInputStrip.data = theStrip->input;
+            touchImageLocal( aPool, &theInputStrip );
+        }
+        for( int i = 0; i < aNumOutputs; i++ )
+        {
+            theStrip->outputs[ i ] = allocateImageBuffer( aBuffers, ( size_t )aOutputs[ i ].stride * thePipeline.stripRows );
+            theResult &= theStrip->outputs[ i ] != NULL;
+            if( theStrip->outputs[ i ] )
+            {
+                // the filters never touch the padding, so clearing it once covers every strip
+                BitmapImage theStripImage = thePipeline.layout;
+                theStripImage.height = thePipeline.stripRows;
+                theStripImage.bitsPerPixel = aOutputs[ i ].chain->outputBitsPerPixel;
+                theStripImage.stride = aOutputs[ i ].stride;
+                theStripImage.data = theStrip->outputs[ i ];
+                touchImageLocal( aPool, &theStripImage );
+                clearImagePadding( &theStripImage );
+            }
+        }
+    }
+
+    if( theResult )
+    {
+        pthread_mutex_init( &thePipeline.lock, NULL );
+        pthread_cond_init( &thePipeline.changed, NULL );
+
+        pthread_t theReader;
+        pthread_t theWriters[ MAX_FUSED_OUTPUTS ];
+        pipelineWriterArgs theWriterArgs[ MAX_FUSED_OUTPUTS ];
+        pthread_create( &theReader, NULL, pipelineReaderThread, &thePipeline );
+        for( int i = 0; i < aNumOutputs; i++ )
+        {
+            theWriterArgs[ i ].pipeline = &thePipeline;
+            theWriterArgs[ i ].outputIndex = i;
+            pthread_create( &theWriters[ i ], NULL, pipelineWriterThread, &theWriterArgs[ i ] );
+        }
+
+        // filter stage runs on the calling thread, fanning each strip out over the worker pool
+        fusedTaskArgs theTask;
+        theTask.outputs = aOutputs;
+        theTask.numOutputs = aNumOutputs;
+        theTask.firstRow = 0;
+
+        int theChunkSize = 1;
+        if( aPool && aPool->numThreads > 1 )
+        {
+            theChunkSize = thePipeline.stripRows / ( aPool->numThreads * 4 );
+        }
+
+        for( int theSequence = 0; theSequence < thePipeline.numSequences; theSequence++ )
+        {
+            PipelineStrip* theStrip = waitForStrip( &thePipeline, theSequence, stripRead );
+
+            BitmapImage theSource = thePipeline.layout;
+            theSource.height = theStrip->numRows;
+            theSource.data = theStrip->input;
+            theTask.source = &theSource;
+            for( int i = 0; i < aNumOutputs; i++ )
+            {
+                aOutputs[ i ].strip = theStrip->outputs[ i ];
+            }
+            StageTimer theTimer = beginStage( stageFilter );
+            runParallelBands( aPool, theStrip->numRows, theChunkSize, fusedProcessingRows, &theTask );
+            endStage( &theTimer );
+            addRunCounter( &gRunStats.rowsDone, theStrip->numRows );
+
+            pthread_mutex_lock( &thePipeline.lock );
+            theStrip->pendingWrites = aNumOutputs;
+            theStrip->state = stripFiltered;
+            pthread_cond_broadcast( &thePipeline.changed );
+            pthread_mutex_unlock( &thePipeline.lock );
+        }
+
+        pthread_join( theReader, NULL );
+        for( int i = 0; i < aNumOutputs; i++ )
+        {
+            pthread_join( theWriters[ i ], NULL );
+            aOutputs[ i ].strip = NULL;
+        }
+
+        pthread_cond_destroy( &thePipeline.changed );
+        pthread_mutex_destroy( &thePipeline.lock );
+    }
+
+    for( int s = 0; s < PIPELINE_DEPTH; s++ )
+    {
+        freeImageBuffer( aBuffers, thePipeline.strips[ s ].input );
+        for( int i = 0; i < aNumOutputs; i++ )
+        {
+            freeImageBuffer( aBuffers, thePipeline.strips[ s ].outputs[ i ] );
+        }
+    }
+
+    return theResult;
+}
+
+// reads the pixels of a streamed image once just for their statistics, one strip at a time, and
+// seeks back to them so the filter pass can read them again
+int readStreamingStatistics( WorkerPool* aPool, BufferPool* aBuffers, const BitmapHeaders* aHeaders, FILE* aFile, const PixelFormat* aFormat, int aStripRows, ImageStatistics* aStatistics )
+{
+    BitmapImage theStrip;
+    theStrip.width = aHeaders->width > 0 ? aHeaders->width : 0;
+    theStrip.height = aHeaders->height > 0 ? aHeaders->height : 0;
+    theStrip.bitsPerPixel = aHeaders->bitsPerPixel;
+    theStrip.stride = calculateRowStride( theStrip.width, aHeaders->bitsPerPixel );
+    int theStripRows = aStripRows > 0 ? aStripRows : calculateStripRows( &theStrip, FUSED_STRIP_BYTES );
+    int32_t theHeight = theStrip.height;
+
+    StatisticsAccumulator theAccumulator;
+    theStrip.data = allocateImageBuffer( aBuffers, ( size_t )theStrip.stride * theStripRows );
+    if( !theStrip.data || !beginImageStatistics( aPool, aBuffers, &theAccumulator ) )
+    {
+        freeImageBuffer( aBuffers, theStrip.data );
+        return 0;
+    }
+
+    for( int32_t y = 0; y < theHeight; y += theStripRows )
+    {
+        theStrip.height = theHeight - y < theStripRows ? theHeight - y : theStripRows;
+        StageTimer theTimer = beginStage( stageRead );
+        size_t theSize = ( size_t )theStrip.stride * theStrip.height;
+        size_t theBytesRead = fread( theStrip.data, sizeof( uint8_t ), theSize, aFile );
+        addRunCounter( &gRunStats.bytesRead, theBytesRead );
+        if( theBytesRead < theSize )
+        {
+            // counted as black, as the filter pass will write them
+            memset( theStrip.data + theBytesRead, 0, theSize - theBytesRead );
+        }
+        endStage( &theTimer );
+
+        theTimer = beginStage( stageFilter );
+        accumulateImageStatistics( aPool, &theAccumulator, &theStrip, aFormat );
+        endStage( &theTimer );
+    }
+
+    finishImageStatistics( &theAccumulator, aFormat->paletted ? aHeaders->palette : NULL, aStatistics );
+    freeImageBuffer( aBuffers, theStrip.data );
+    return fseek( aFile, aHeaders->fileHeader.image_offset, SEEK_SET ) == 0;
+}
+
+// ---------- RESULT CACHE ----------
+
+// a directory per input and option set, named after the hash of both, holding the outputs named
+// after their filters; the rows are hashed as they are read and a hit copies the outputs into place
+// instead of filtering
+struct ResultCache
+{
+    char directory[ PATH_MAX ];
+    uint64_t maxBytes;       // least recently used entries are dropped beyond this
+    pthread_mutex_t lock;    // one eviction scan at a time
+    uint64_t nextTemporary;  // entries are written under a temporary name and renamed when complete
+};
+
+typedef struct
+{
+    char name[ 40 ];
+    struct timespec used;    // the entry's mtime, refreshed on every hit
+    uint64_t bytes;
+} CacheEntryInfo;
+
+typedef struct
+{
+    const BitmapImage* image; // rows of the mapping with --mmap, else only the layout of the file's rows
+    BufferPool* buffers;
+    int fd;
+    off_t offset;             // of the pixel array in the file
+    uint64_t* rowHashes;
+    int failed;
+} rowHashTaskArgs;
+
+int buildOutputFilename( const char* aTemplate, const char* aDirectory, const char* aInputFilename, const char* aFilterName, char* aResult, size_t aResultSize );
+
+// everything that decides what the outputs look like, except the input itself
+static uint64_t hashProcessingOptions( const ProcessingOptions* aOptions )
+{
+    int64_t theFields[ 9 ] = { CACHE_FORMAT_VERSION, aOptions->grayOutput, aOptions->rleOutput, aOptions->pyramidLevels, aOptions->numOutputs,
+                               aOptions->region.x, aOptions->region.y, aOptions->region.width, aOptions->region.height };
+    uint64_t theHash = hashBytes( theFields, sizeof( theFields ), 0 );
+    for( int i = 0; i < aOptions->numOutputs; i++ )
+    {
+        const OutputSpec* theOutput = &aOptions->outputs[ i ];
+        theHash = hashBytes( theOutput->filterName, strlen( theOutput->filterName ), theHash );
+        theHash = hashBytes( &theOutput->chain.numOps, sizeof( theOutput->chain.numOps ), theHash );
+        for( int j = 0; j < theOutput->chain.numOps; j++ )
+        {
+            // field by field, the padding and the resolved tables say nothing about the op
+            const FilterOp* theOp = &theOutput->chain.ops[ j ];
+            theHash = hashBytes( &theOp->type, sizeof( theOp->type ), theHash );
+            theHash = hashBytes( theOp->parameters, sizeof( theOp->parameters ), theHash );
+            theHash = hashBytes( &theOp->channelMask, sizeof( theOp->channelMask ), theHash );
+        }
+    }
+    return theHash;
+}
+
+ResultCache* openResultCache( const char* aDirectory, uint64_t aMaxBytes )
+{
+    struct stat theStat;
+    if( mkdir( aDirectory, 0777 ) != 0 && ( errno != EEXIST || stat( aDirectory, &theStat ) != 0 || !S_ISDIR( theStat.st_mode ) ) )
+    {
+        return NULL;
+    }
+    ResultCache* theCache = calloc( 1, sizeof( ResultCache ) );
+    if( !theCache || snprintf( theCache->directory, sizeof( theCache->directory ), "%s", aDirectory ) >= ( int )sizeof( theCache->directory ) )
+    {
+        free( theCache );
+        return NULL;
+    }
+    theCache->maxBytes = aMaxBytes;
+    pthread_mutex_init( &theCache->lock, NULL );
+    return theCache;
+}
+
+void closeResultCache( ResultCache* aCache )
+{
+    if( aCache )
+    {
+        pthread_mutex_destroy( &aCache->lock );
+        free( aCache );
+    }
+}
+
+// worker pool task: hashes rows of an image the load did not hash, the mapping's rows with --mmap,
+// else chunks of the file's rows read with pread into scratch buffers
+void hashStoredRows( void* aContext, int aBegin, int aEnd )
+{
+    rowHashTaskArgs* theTask = ( rowHashTaskArgs* )aContext;
+    if( theTask->image->data )
+    {
+        hashImageRows( theTask->image, aBegin, aEnd, theTask->rowHashes );
+        return;
+    }
+
+    BitmapImage theChunk = *theTask->image;
+    size_t theBytes = ( size_t )theChunk.stride * ( aEnd - aBegin );
+    theChunk.data = allocateImageBuffer( theTask->buffers, theBytes );
+    if( !theChunk.data )
+    {
+        __atomic_store_n( &theTask->failed, 1, __ATOMIC_RELAXED );
+        return;
+    }
+    addRunCounter( &gRunStats.bytesRead, readFileRange( theTask->fd, theChunk.data, theBytes, theTask->offset + ( off_t )theChunk.stride * aBegin ) );
+    hashImageRows( &theChunk, 0, aEnd - aBegin, theTask->rowHashes + aBegin );
+    freeImageBuffer( theTask->buffers, theChunk.data );
+}
+
+// hashes every row of aImage, or of the file's pixel array laid out like aImage if it has no data
+static int hashImageFileRows( const BmpContext* aContext, const BitmapImage* aImage, int aFd, off_t aOffset, uint64_t* aRowHashes )
+{
+    rowHashTaskArgs theTask = { aImage, aContext->buffers, aFd, aOffset, aRowHashes, 0 };
+    int theChunkRows = aImage->stride > 0 && aImage->stride < CACHE_HASH_CHUNK_BYTES ? CACHE_HASH_CHUNK_BYTES / aImage->stride : 1;
+    if( aImage->data && aContext->workers )
+    {
+        // the mapping is already there, chunks that spread it over the pool
+        theChunkRows = aImage->height / ( aContext->workers->numThreads * 4 ) > 0 ? aImage->height / ( aContext->workers->numThreads * 4 ) : 1;
+    }
+    StageTimer theTimer = beginStage( stageRead );
+    runParallel( aContext->workers, aImage->height, theChunkRows, hashStoredRows, &theTask );
+    endStage( &theTimer );
+    return !theTask.failed;
+}
+
+// path of the entry for the input whose aNumRows rows hash to aRowHashes; everything in front of
+// the pixels, headers and palette, is read again, it is small. 0 if the name does not fit
+static int findCacheEntry( const BmpContext* aContext, int aFd, uint32_t aImageOffset, const uint64_t* aRowHashes, int aNumRows,
+                           const ProcessingOptions* aOptions, char* aEntry, size_t aEntrySize )
+{
+    uint64_t theContentHash = 0;
+    uint8_t theBuffer[ 4096 ];
+    for( uint32_t theOffset = 0; theOffset < aImageOffset; theOffset += sizeof( theBuffer ) )
+    {
+        size_t theBytes = aImageOffset - theOffset < sizeof( theBuffer ) ? aImageOffset - theOffset : sizeof( theBuffer );
+        theBytes = readFileRange( aFd, theBuffer, theBytes, theOffset );
+        theContentHash = hashBytes( theBuffer, theBytes, theContentHash );
+    }
+    theContentHash = hashBytes( aRowHashes, sizeof( uint64_t ) * aNumRows, theContentHash );
+    return snprintf( aEntry, aEntrySize, "%s/%016" PRIx64 "%016" PRIx64, aContext->cache->directory, theContentHash, hashProcessingOptions( aOptions ) ) < ( int )aEntrySize;
+}
+
+static int copyFileContents( int aSource, int aTarget )
+{
+    // in the kernel when it can, a plain read and write loop when the file systems do not support it
+    off_t theOffset = 0;
+    ssize_t theCopied;
+    while( ( theCopied = copy_file_range( aSource, &theOffset, aTarget, NULL, 1 << 30, 0 ) ) > 0 )
+    {
+    }
+    if( theCopied == 0 )
+    {
+        return 1;
+    }
+    if( theOffset != 0 || ( errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP ) )
+    {
+        return 0;
+    }
+
+    uint8_t theBuffer[ 64 * 1024 ];
+    ssize_t theRead;
+    while( ( theRead = read( aSource, theBuffer, sizeof( theBuffer ) ) ) > 0 )
+    {
+        if( write( aTarget, theBuffer, theRead ) != theRead )
+        {
+            return 0;
+        }
+    }
+    return theRead == 0;
+}
+
+// makes aTarget, created with aMode, a copy of aSource: a reflink where the file system shares
+// blocks, a plain copy otherwise. Never a hard link, writing to an output must not change the cache
+static int cloneCacheFile( const char* aSource, const char* aTarget, mode_t aMode )
+{
+    int theSource = open( aSource, O_RDONLY | O_CLOEXEC );
+    if( theSource < 0 )
+    {
+        return 0;
+    }
+    unlink( aTarget );
+    int theTarget = open( aTarget, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, aMode );
+    int theDone = 0;
+#ifdef FICLONE
+    theDone = theTarget >= 0 && ioctl( theTarget, FICLONE, theSource ) == 0;
+#endif
+    if( !theDone && theTarget >= 0 )
+    {
+        theDone = copyFileContents( theSource, theTarget );
+    }
+    if( theTarget >= 0 && close( theTarget ) != 0 )
+    {
+        theDone = 0;
+    }
+    close( theSource );
+    if( !theDone )
+    {
+        unlink( aTarget );
+    }
+    return theDone;
+}
+
+// removes an entry directory and its files; entries only ever hold files
+static void removeCacheEntry( const char* aEntry )
+{
+    DIR* theDirectory = opendir( aEntry );
+    if( theDirectory )
+    {
+        struct dirent* theFile;
+        char thePath[ PATH_MAX ];
+        while( ( theFile = readdir( theDirectory ) ) != NULL )
+        {
+            if( theFile->d_name[ 0 ] != '.' && snprintf( thePath, sizeof( thePath ), "%s/%s", aEntry, theFile->d_name ) < ( int )sizeof( thePath ) )
+            {
+                unlink( thePath );
+            }
+        }
+        closedir( theDirectory );
+    }
+    rmdir( aEntry );
+}
+
+// recreates the outputs of an earlier run from the entry's files, each named after its filter the
+// way the run named it; 0 on a miss or if any output could not be put in place
+static int restoreCachedOutputs( const char* aEntry, const ProcessingOptions* aOptions, const char* aInputFilename )
+{
+    DIR* theDirectory = opendir( aEntry );
+    if( !theDirectory )
+    {
+        return 0;
+    }
+
+    int theRestored = 0;
+    int theFailed = 0;
+    struct dirent* theFile;
+    while( !theFailed && ( theFile = readdir( theDirectory ) ) != NULL )
+    {
+        size_t theLength = strlen( theFile->d_name );
+        if( theFile->d_name[ 0 ] == '.' || theLength < 5 || strcmp( theFile->d_name + theLength - 4, ".bmp" ) != 0 )
+        {
+            continue;
+        }
+        char theFilterName[ 256 ];
+        char theSource[ PATH_MAX ];
+        char theTarget[ PATH_MAX ];
+        snprintf( theFilterName, sizeof( theFilterName ), "%.*s", ( int )( theLength - 4 ), theFile->d_name );
+        theFailed = snprintf( theSource, sizeof( theSource ), "%s/%s", aEntry, theFile->d_name ) >= ( int )sizeof( theSource ) ||
+                    !buildOutputFilename( aOptions->nameTemplate, aOptions->outputDirectory, aInputFilename, theFilterName, theTarget, sizeof( theTarget ) ) ||
+                    !cloneCacheFile( theSource, theTarget, 0666 );
+        if( !theFailed )
+        {
+            logMessage( "Wrote %s from the cache\n", theTarget );
+            theRestored++;
+        }
+    }
+    closedir( theDirectory );
+
+    if( theFailed || theRestored == 0 )
+    {
+        return 0;
+    }
+    // the entry's mtime orders the eviction
+    utimensat( AT_FDCWD, aEntry, NULL, 0 );
+    return 1;
+}
+
+static int compareCacheEntryUse( const void* aLeft, const void* aRight )
+{
+    const struct timespec* theLeft = &( ( const CacheEntryInfo* )aLeft )->used;
+    const struct timespec* theRight = &( ( const CacheEntryInfo* )aRight )->used;
+    if( theLeft->tv_sec != theRight->tv_sec )
+    {
+        return theLeft->tv_sec < theRight->tv_sec ? -1 : 1;
+    }
+    return theLeft->tv_nsec < theRight->tv_nsec ? -1 : theLeft->tv_nsec > theRight->tv_nsec;
+}
+
+// drops the least recently used entries until the cache fits its bound again
+static void evictResultCache( ResultCache* aCache )
+{
+    pthread_mutex_lock( &aCache->lock );
+    DIR* theDirectory = opendir( aCache->directory );
+    CacheEntryInfo* theEntries = NULL;
+    size_t theNumEntries = 0;
+    size_t theCapacity = 0;
+    uint64_t theTotalBytes = 0;
+    struct dirent* theEntry;
+    while( theDirectory && ( theEntry = readdir( theDirectory ) ) != NULL )
+    {
+        // temporary entries start with a dot and belong to the runs writing them
+        char thePath[ PATH_MAX ];
+        struct stat theStat;
+        if( theEntry->d_name[ 0 ] == '.' || strlen( theEntry->d_name ) >= sizeof( theEntries->name ) ||
+            snprintf( thePath, sizeof( thePath ), "%s/%s", aCache->directory, theEntry->d_name ) >= ( int )sizeof( thePath ) ||
+            stat( thePath, &theStat ) != 0 || !S_ISDIR( theStat.st_mode ) )
+        {
+            continue;
+        }
+        if( theNumEntries == theCapacity )
+        {
+            theCapacity = theCapacity ? theCapacity * 2 : 64;
+            CacheEntryInfo* theGrown = realloc( theEntries, sizeof( CacheEntryInfo ) * theCapacity );
+            if( !theGrown )
+            {
+                break;
+            }
+            theEntries = theGrown;
+        }
+
+        CacheEntryInfo* theInfo = &theEntries[ theNumEntries++ ];
+        snprintf( theInfo->name, sizeof( theInfo->name ), "%s", theEntry->d_name );
+        theInfo->used = theStat.st_mtim;
+        theInfo->bytes = 0;
+        DIR* theFiles = opendir( thePath );
+        struct dirent* theFile;
+        while( theFiles && ( theFile = readdir( theFiles ) ) != NULL )
+        {
+            struct stat theFileStat;
+            if( theFile->d_name[ 0 ] != '.' && fstatat( dirfd( theFiles ), theFile->d_name, &theFileStat, 0 ) == 0 )
+            {
+                theInfo->bytes += theFileStat.st_size;
+            }
+        }
+        if( theFiles )
+        {
+            closedir( theFiles );
+        }
+        theTotalBytes += theInfo->bytes;
+    }
+    if( theDirectory )
+    {
+        closedir( theDirectory );
+    }
+
+    if( theTotalBytes > aCache->maxBytes )
+    {
+        qsort( theEntries, theNumEntries, sizeof( CacheEntryInfo ), compareCacheEntryUse );
+        for( size_t i = 0; i < theNumEntries && theTotalBytes > aCache->maxBytes; i++ )
+        {
+            char thePath[ PATH_MAX ];
+            if( snprintf( thePath, sizeof( thePath ), "%s/%s", aCache->directory, theEntries[ i ].name ) < ( int )sizeof( thePath ) )
+            {
+                removeCacheEntry( thePath );
+                theTotalBytes -= theEntries[ i ].bytes;
+            }
+        }
+    }
+    free( theEntries );
+    pthread_mutex_unlock( &aCache->lock );
+}
+
+// copies the finished outputs into a new entry, read only so that nothing writes to them by accident
+static void storeCachedOutputs( ResultCache* aCache, const char* aEntry, const FusedOutput* aOutputs, int aNumOutputs )
+{
+    char theTemporary[ PATH_MAX ];
+    uint64_t theNumber = __atomic_fetch_add( &aCache->nextTemporary, 1, __ATOMIC_RELAXED );
+    if( snprintf( theTemporary, sizeof( theTemporary ), "%s/.%d.%" PRIu64, aCache->directory, ( int )getpid(), theNumber ) >= ( int )sizeof( theTemporary ) ||
+        mkdir( theTemporary, 0777 ) != 0 )
+    {
+        return;
+    }
+
+    int theStored = 1;
+    char thePath[ PATH_MAX ];
+    for( int i = 0; theStored && i < aNumOutputs; i++ )
+    {
+        theStored = snprintf( thePath, sizeof( thePath ), "%s/%s.bmp", theTemporary, aOutputs[ i ].filterName ) < ( int )sizeof( thePath ) &&
+                    cloneCacheFile( aOutputs[ i ].filename, thePath, 0444 );
+        for( int l = 0; theStored && l < aOutputs[ i ].numLevels; l++ )
+        {
+            theStored = snprintf( thePath, sizeof( thePath ), "%s/%s_%d.bmp", theTemporary, aOutputs[ i ].filterName, 2 << l ) < ( int )sizeof( thePath ) &&
+                        cloneCacheFile( aOutputs[ i ].levels[ l ].filename, thePath, 0444 );
+        }
+    }
+
+    // another run may have stored the same entry in the meantime, either copy will do
+    if( !theStored || rename( theTemporary, aEntry ) != 0 )
+    {
+        removeCacheEntry( theTemporary );
+        return;
+    }
+    evictResultCache( aCache );
+}
+
+// ---------- FILE PROCESSING ----------
+
+void destroyBmpContext( BmpContext* aContext )
+{
+    if( aContext )
+    {
+        // the writer first, nothing may still be writing from the pooled buffers
+        destroyAsyncWriter( aContext->writer );
+        destroyWorkerPool( aContext->workers );
+        destroyBufferPool( aContext->buffers );
+        closeResultCache( aContext->cache );
+        free( aContext );
+    }
+}
+
+// aPinThreads binds the workers to CPUs node by node and splits row passes into fixed bands;
+// aUseRing 0 always writes from writer threads; aMaxPooledBytes bounds the idle buffers kept
+// between images. Returns NULL if the threads or the buffer pool could not be set up
+BmpContext* createBmpContext( int aNumThreads, int aPinThreads, int aUseRing, uint64_t aMaxPooledBytes )
+{
+    BmpContext* theContext = calloc( 1, sizeof( BmpContext ) );
+    if( !theContext )
+    {
+        return NULL;
+    }
+    theContext->workers = createWorkerPool( aNumThreads, aPinThreads );
+    theContext->buffers = createBufferPool( aMaxPooledBytes );
+    theContext->writer = createAsyncWriter( aUseRing );
+    if( !theContext->workers || !theContext->buffers )
+    {
+        destroyBmpContext( theContext );
+        return NULL;
+    }
+    return theContext;
+}
+
+const OutputSpec gDefaultOutputs[ NUM_DEFAULT_OUTPUTS ] =
+{
+    { .chain = { .ops = { { .type = invert } }, .numOps = 1 }, .filterName = "invert", .description = "inverted" },
+    { .chain = { .ops = { { .type = grayscaleRed } }, .numOps = 1 }, .filterName = "grayscaleRed", .description = "grayscale (from red)" },
+    { .chain = { .ops = { { .type = grayscaleGreen } }, .numOps = 1 }, .filterName = "grayscaleGreen", .description = "grayscale (from green)" },
+    { .chain = { .ops = { { .type = grayscaleBlue } }, .numOps = 1 }, .filterName = "grayscaleBlue", .description = "grayscale (from blue)" }
+};
+
+// an output for a --pipeline spec, named after its ops
+int parseOutputSpec( const char* aSpec, OutputSpec* aOutput )
+{
+    if( !parseFilterChain( aSpec, &aOutput->chain ) )
+    {
+        return 0;
+    }
+    formatFilterChainName( &aOutput->chain, aOutput->filterName, sizeof( aOutput->filterName ) );
+    snprintf( aOutput->description, sizeof( aOutput->description ), "filtered (%s)", aSpec );
+    return 1;
+}
+
+
+// drops the vertical flips of a chain when they are its only whole-image ops and the header can
+// store the rows top-down instead; returns how many were dropped
+int removeHeaderFlips( FilterChain* aChain, const BitmapHeaders* aHeaders )
+{
+    if( getBitmapHeaderEnd( aHeaders ) == BITMAPCOREHEADER_IMAGE_OFFSET )
+    {
+        return 0;
+    }
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        if( isNeighborhoodFilterOp( aChain->ops[ i ].type ) && aChain->ops[ i ].type != flipVertical )
+        {
+            return 0;
+        }
+    }
+
+    int theFlips = 0;
+    int theNumOps = 0;
+    for( int i = 0; i < aChain->numOps; i++ )
+    {
+        if( aChain->ops[ i ].type == flipVertical )
+        {
+            theFlips++;
+        }
+        else
+        {
+            aChain->ops[ theNumOps++ ] = aChain->ops[ i ];
+        }
+    }
+    aChain->numOps = theNumOps;
+    return theFlips;
+}
+
+// expands aTemplate into aResult, returns 0 if the name does not fit
+int buildOutputFilename( const char* aTemplate, const char* aDirectory, const char* aInputFilename, const char* aFilterName, char* aResult, size_t aResultSize )
+{
+    // input name without directory and extension
+    const char* theBaseName = strrchr( aInputFilename, '/' );
+    theBaseName = theBaseName ? theBaseName + 1 : aInputFilename;
+    const char* theExtension = strrchr( theBaseName, '.' );
+    size_t theBaseLength = theExtension && theExtension != theBaseName ? ( size_t )( theExtension - theBaseName ) : strlen( theBaseName );
+
+    size_t theLength = 0;
+    if( aDirectory && *aDirectory )
+    {
+        theLength = snprintf( aResult, aResultSize, "%s/", aDirectory );
+    }
+
+    for( const char* c = aTemplate; *c && theLength < aResultSize; )
+    {
+        if( strncmp( c, "{name}", 6 ) == 0 )
+        {
+            theLength += snprintf( aResult + theLength, aResultSize - theLength, "%.*s", ( int )theBaseLength, theBaseName );
+            c += 6;
+        }
+        else if( strncmp( c, "{filter}", 8 ) == 0 )
+        {
+            theLength += snprintf( aResult + theLength, aResultSize - theLength, "%s", aFilterName );
+            c += 8;
+        }
+        else
+        {
+            aResult[ theLength++ ] = *c++;
+        }
+    }
+
+    if( theLength >= aResultSize )
+    {
+        return 0;
+    }
+    aResult[ theLength ] = '\0';
+    return 1;
+}
+
+// opens aNumLevels halvings of an output with the headers aHeaders, each level named after the
+// output's filter and its divisor ("invert_2", "invert_4", ...); stops early at a 1x1 level
+int openPyramidLevels( const BmpContext* aContext, FusedOutput* aOutput, const BitmapHeaders* aHeaders, int aNumLevels, const ProcessingOptions* aOptions, const char* aInputFilename )
+{
+    aOutput->numLevels = 0;
+    aOutput->levels = ( PyramidLevel* )allocateImageBuffer( aOutput->buffers, sizeof( PyramidLevel ) * aNumLevels );
+    if( !aOutput->levels )
+    {
+        return 0;
+    }
+    memset( aOutput->levels, 0, sizeof( PyramidLevel ) * aNumLevels );
+
+    int32_t theWidth = aHeaders->width;
+    int32_t theHeight = aHeaders->height;
+    int thePixelBytes = aHeaders->bitsPerPixel / 8;
+    for( int i = 0; i < aNumLevels && ( theWidth > 1 || theHeight > 1 ); i++ )
+    {
+        PyramidLevel* theLevel = &aOutput->levels[ aOutput->numLevels++ ];
+        char theFilterName[ 128 ];
+        theLevel->pixelBytes = thePixelBytes;
+        theLevel->sourceWidth = theWidth;
+        theLevel->pending = ( uint8_t* )allocateImageBuffer( aOutput->buffers, ( size_t )theWidth * thePixelBytes );
+        theWidth = theWidth > 1 ? theWidth / 2 : 1;
+        theHeight = theHeight > 1 ? theHeight / 2 : 1;
+        theLevel->width = theWidth;
+        theLevel->height = theHeight;
+        theLevel->stride = calculateRowStride( theWidth, aHeaders->bitsPerPixel );
+        theLevel->row = ( uint8_t* )allocateImageBuffer( aOutput->buffers, theLevel->stride );
+        if( theLevel->row )
+        {
+            memset( theLevel->row, 0, theLevel->stride );
+        }
+        snprintf( theFilterName, sizeof( theFilterName ), "%s_%d", aOutput->filterName, 2 << i );
+        if( !theLevel->pending || !theLevel->row || !buildOutputFilename( aOptions->nameTemplate, aOptions->outputDirectory, aInputFilename, theFilterName, theLevel->filename, sizeof( theLevel->filename ) ) )
+        {
+            return 0;
+        }
+
+        // levels are always written uncompressed
+        BitmapHeaders theHeaders = *aHeaders;
+        setBitmapHeaderCompression( &theHeaders, BITMAP_COMPRESSION_RGB );
+        setBitmapHeaderGeometry( &theHeaders, theWidth, theHeight, aHeaders->bitsPerPixel );
+        theLevel->file = fopen( theLevel->filename, "w+" );
+        if( !theLevel->file )
+        {
+            printf( "Could not create %s\n", theLevel->filename );
+            return 0;
+        }
+        writeBitmapHeaders( &theHeaders, theLevel->file );
+        writeBitmapColorTable( &theHeaders, theLevel->file );
+        if( !openOutputStream( &theLevel->stream, aContext->writer, aContext->buffers, theLevel->file, ( uint64_t )theLevel->stride * theHeight, aOptions->directOutput ) )
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// reads aFilename and writes every requested output; every buffer comes from the context's pool
+// and goes back to it, so a long run stops allocating once it has seen its largest image
+int processBitmapFile( const BmpContext* aContext, const char* aFilename, const ProcessingOptions* aOptions )
+{
+    WorkerPool* thePool = aContext->workers;
+    BufferPool* theBuffers = aContext->buffers;
+    FILE* theFile = NULL;
+    MappedFile theMapping = { -1, NULL, 0 };
+    int theInputOpened = aOptions->useMmap ? mapBitmapFile( aFilename, &theMapping ) : ( theFile = fopen( aFilename, "r" ) ) != NULL;
+    if( !theInputOpened )
+    {
+        printf( "%s does not exist!\n", aFilename );
+        return 0;
+    }
+
+    BitmapHeaders theHeaders;
+    PixelFormat theFormat;
+    int theHeadersValid = aOptions->useMmap ? mapBitmapHeaders( &theMapping, &theHeaders ) : readBitmapHeaders( theFile, &theHeaders );
+    if( !theHeadersValid || !selectPixelFormat( &theHeaders, &theFormat ) )
+    {
+        printf( "%s uses an unsupported bitmap header\n", aFilename );
+        if( theFile )
+        {
+            fclose( theFile );
+        }
+        unmapBitmapFile( &theMapping );
+        return 0;
+    }
+
+    // --roi: only the window is read, everything after sees an image of its size
+    ImageRegion theRegion = aOptions->region;
+    int theCropped = theRegion.width > 0;
+    int theRle = theHeaders.compression == BITMAP_COMPRESSION_RLE8 || theHeaders.compression == BITMAP_COMPRESSION_RLE4;
+    if( theCropped && ( theRle || !clipImageRegion( &theRegion, theHeaders.width, theHeaders.height ) ) )
+    {
+        printf( theRle ? "%s is RLE compressed, its rows cannot be read on their own\n" : "The region lies outside of %s\n", aFilename );
+        if( theFile )
+        {
+            fclose( theFile );
+        }
+        unmapBitmapFile( &theMapping );
+        return 0;
+    }
+
+    addRunCounter( &gRunStats.files, 1 );
+    int theNumRows = theCropped ? theRegion.height : ( theHeaders.height > 0 ? theHeaders.height : 0 );
+    addRunCounter( &gRunStats.rowsTotal, theNumRows );
+
+    // --cache: the load hashes every row it reads, the entry is looked up before any filtering
+    char theCacheEntry[ PATH_MAX ];
+    int theFd = aOptions->useMmap ? theMapping.fd : fileno( theFile );
+    uint32_t theImageOffset = theHeaders.fileHeader.image_offset;
+    uint64_t* theRowHashes = NULL;
+    int theCaching = aContext->cache && aOptions->numOutputs > 0 && !aOptions->histogramFile &&
+                     ( theRowHashes = allocateImageBuffer( theBuffers, sizeof( uint64_t ) * ( theNumRows > 0 ? theNumRows : 1 ) ) ) != NULL;
+
+    FusedOutput theOutputs[ MAX_FUSED_OUTPUTS ];
+    int theNumOutputs = aOptions->numOutputs;
+    int theProcessed = 1;
+    int theNeighborhoodOutputs = 0;
+    int theNeedStatistics = aOptions->histogramFile != NULL;
+    for( int i = 0; i < theNumOutputs; i++ )
+    {
+        FilterChain theChain = aOptions->outputs[ i ].chain;
+        removeHeaderFlips( &theChain, &theHeaders );
+        if( countNeighborhoodPrefix( &theChain ) > 0 )
+        {
+            theNeighborhoodOutputs++;
+        }
+        else if( hasAdaptiveFilterOps( &theChain, 0, theChain.numOps ) )
+        {
+            // tables built from the source, before any output is set up
+            theNeedStatistics = 1;
+        }
+    }
+    if( theNeighborhoodOutputs > 0 && ( theFormat.bitsPerPixel != 24 || theHeaders.compression != BITMAP_COMPRESSION_RGB ) )
+    {
+        // the convolution kernels work on packed BGR pixels only
+        printf( "%s is not a 24 bpp image, blur, unsharp, sobel, resize and rotations cannot filter it\n", aFilename );
+        theNumOutputs = 0;
+        theProcessed = 0;
+    }
+
+    CompiledFilterChain* theCompiledChains = allocateImageBuffer( theBuffers, sizeof( CompiledFilterChain ) * ( theNumOutputs > 0 ? theNumOutputs : 1 ) );
+    if( !theCompiledChains )
+    {
+        theNumOutputs = 0;
+        theProcessed = 0;
+    }
+
+    // with --mmap the source rows are read straight out of the page cache; streamed images are
+    // read by the strip pass, after a pass of their own for the statistics when those are needed
+    BitmapImage theImageData = { 0, 0, 0, 0, NULL };
+    int theImageOwned = !aOptions->useMmap;
+    int theStreaming = !theRle && !theCropped && aOptions->stripRows >= 0 && theNeighborhoodOutputs == 0;
+    if( !theProcessed || theStreaming )
+    {
+        // nothing to load up front; the strip pass holds a strip at a time, so a streamed input
+        // is hashed by a pass of its own
+        if( theProcessed && theCaching )
+        {
+            BitmapImage theLayout = { theHeaders.width, theNumRows, theHeaders.bitsPerPixel, ( int32_t )calculateRowStride( theHeaders.width, theHeaders.bitsPerPixel ), NULL };
+            theCaching = hashImageFileRows( aContext, &theLayout, theFd, theImageOffset, theRowHashes );
+        }
+    }
+    else if( theCropped )
+    {
+        theImageOwned = 1;
+        theImageData = readImageRegion( thePool, theBuffers, &theHeaders, theFd, &theRegion, theRowHashes );
+        setBitmapHeaderGeometry( &theHeaders, theRegion.width, theRegion.height, theHeaders.bitsPerPixel );
+        theProcessed = theImageData.data != NULL;
+    }
+    else if( theRle )
+    {
+        // RLE codes are always decoded as a whole image, --stream does not apply to them
+        theImageOwned = 1;
+        if( aOptions->useMmap )
+        {
+            uint32_t theOffset = theHeaders.fileHeader.image_offset;
+            theImageData = decodeRleImageData( thePool, theBuffers, &theHeaders, theMapping.data + theOffset, theMapping.size - theOffset, theRowHashes );
+        }
+        else
+        {
+            theImageData = readRleImageData( thePool, theBuffers, &theHeaders, theFile, theRowHashes );
+        }
+        theProcessed = theImageData.data != NULL;
+    }
+    else
+    {
+        if( aOptions->useMmap )
+        {
+            // the hashing pass is the first to touch the mapped pages
+            theImageData = mapImageData( theBuffers, &theHeaders, &theMapping, &theImageOwned );
+            theCaching = theCaching && theImageData.data && hashImageFileRows( aContext, &theImageData, theFd, theImageOffset, theRowHashes );
+        }
+        else
+        {
+            theImageData = readImageDataLocal( thePool, theBuffers, theHeaders.width, theHeaders.height, theHeaders.bitsPerPixel, theFile, theRowHashes );
+        }
+        theProcessed = theImageData.data != NULL;
+    }
+
+    // an input seen before with the same options gets the outputs of that run back, nothing is filtered
+    theCaching = theCaching && theProcessed && findCacheEntry( aContext, theFd, theImageOffset, theRowHashes, theNumRows, aOptions, theCacheEntry, sizeof( theCacheEntry ) );
+    if( theCaching && restoreCachedOutputs( theCacheEntry, aOptions, aFilename ) )
+    {
+        addRunCounter( &gRunStats.cacheHits, 1 );
+        addRunCounter( &gRunStats.rowsDone, theNumRows );
+        theCaching = 0;
+        theNumOutputs = 0;
+        theNeedStatistics = 0;
+    }
+    else if( theCaching )
+    {
+        addRunCounter( &gRunStats.cacheMisses, 1 );
+    }
+
+    ImageStatistics theStatistics;
+    AdaptiveTables theAdaptiveTables;
+    if( theProcessed && theNeedStatistics )
+    {
+        theProcessed = theStreaming ? readStreamingStatistics( thePool, theBuffers, &theHeaders, theFile, &theFormat, aOptions->stripRows, &theStatistics ) :
+                                      computeImageStatistics( thePool, theBuffers, &theImageData, &theFormat, theFormat.paletted ? theHeaders.palette : NULL, &theStatistics );
+        if( theProcessed && aOptions->histogramFile )
+        {
+            writeImageStatisticsJson( aOptions->histogramFile, aFilename, &theHeaders, &theStatistics );
+        }
+    }
+    if( !theProcessed )
+    {
+        theNumOutputs = 0;
+    }
+
+    for( int i = 0; i < theNumOutputs; i++ )
+    {
+        // resize ops and rotations give the output a size of its own
+        int32_t theWidth = theHeaders.width;
+        int32_t theHeight = theHeaders.height;
+        getFilterChainOutputSize( &aOptions->outputs[ i ].chain, &theWidth, &theHeight );
+
+        // outputs with neighborhood ops are built from a bottom-up view and written bottom-up, the
+        // others keep the input's row order, flipped by the header for every vertical flip dropped
+        FilterChain theTail = aOptions->outputs[ i ].chain;
+        int theFlips = removeHeaderFlips( &theTail, &theHeaders );
+        theOutputs[ i ].sourceChain = &aOptions->outputs[ i ].chain;
+        theOutputs[ i ].neighborhoodOps = countNeighborhoodPrefix( &theTail );
+        if( theOutputs[ i ].neighborhoodOps == 0 && hasAdaptiveFilterOps( &theTail, 0, theTail.numOps ) )
+        {
+            resolveAdaptiveOps( &theTail, &theStatistics, &theAdaptiveTables );
+        }
+        BitmapHeaders theOutputHeaders = theHeaders;
+        theOutputHeaders.topDown = theOutputs[ i ].neighborhoodOps > 0 ? 0 : theHeaders.topDown ^ ( theFlips & 1 );
+
+        // a gray result only needs one byte per pixel, the palette maps it back to gray
+        uint16_t theBitsPerPixel = theHeaders.bitsPerPixel;
+        int theGrayOutput = aOptions->grayOutput && !theFormat.paletted && isGrayFilterChain( &aOptions->outputs[ i ].chain );
+        if( theGrayOutput )
+        {
+            theBitsPerPixel = 8;
+            setGrayBitmapPalette( &theOutputHeaders );
+            setBitmapHeaderGeometry( &theOutputHeaders, theWidth, theHeight, theBitsPerPixel );
+        }
+        else if( theHeaders.fileHeader.image_offset != getBitmapHeaderEnd( &theHeaders ) + getBitmapColorTableSize( &theHeaders ) ||
+                 theWidth != theHeaders.width || theHeight != theHeaders.height || theOutputHeaders.topDown != theHeaders.topDown )
+        {
+            // only the color table is kept between the headers and the pixels
+            theOutputHeaders.fileHeader.image_offset = getBitmapHeaderEnd( &theHeaders ) + getBitmapColorTableSize( &theHeaders );
+            setBitmapHeaderGeometry( &theOutputHeaders, theWidth, theHeight, theBitsPerPixel );
+        }
+
+        // RLE inputs come out uncompressed unless --rle asks for RLE8, which only bottom-up 8 bpp can use
+        uint32_t theCompression = aOptions->rleOutput && theBitsPerPixel == 8 && !theOutputHeaders.topDown ? BITMAP_COMPRESSION_RLE8 : BITMAP_COMPRESSION_RGB;
+        if( theOutputHeaders.compression != theCompression && theOutputHeaders.compression != BITMAP_COMPRESSION_BITFIELDS )
+        {
+            setBitmapHeaderCompression( &theOutputHeaders, theCompression );
+            setBitmapHeaderGeometry( &theOutputHeaders, theWidth, theHeight, theBitsPerPixel );
+        }
+
+        if( theFormat.paletted )
+        {
+            // every filter works pixel by pixel, so filtering the palette filters the whole image
+            compileFilterChain( &theTail, &theCompiledChains[ i ], NULL, sizeof( BitmapColor ) * 8 );
+            applyFilterChain( &theCompiledChains[ i ], ( const uint8_t* )theHeaders.palette, ( uint8_t* )theOutputHeaders.palette, theHeaders.numColors );
+        }
+
+        // the strip pass only sees the point ops after the last neighborhood op
+        theTail.numOps -= theOutputs[ i ].neighborhoodOps;
+        memmove( theTail.ops, theTail.ops + theOutputs[ i ].neighborhoodOps, sizeof( FilterOp ) * theTail.numOps );
+        compileFilterChain( &theTail, &theCompiledChains[ i ], &theFormat, theBitsPerPixel );
+        theOutputs[ i ].chain = &theCompiledChains[ i ];
+        theOutputs[ i ].stride = calculateRowStride( theWidth > 0 ? theWidth : 0, theBitsPerPixel );
+        theOutputs[ i ].filterName = aOptions->outputs[ i ].filterName;
+        theOutputs[ i ].description = aOptions->outputs[ i ].description;
+        theOutputs[ i ].file = NULL;
+        theOutputs[ i ].stream = NULL;
+        theOutputs[ i ].strip = NULL;
+        theOutputs[ i ].reserved = 0;
+        theOutputs[ i ].levels = NULL;
+        theOutputs[ i ].numLevels = 0;
+        theOutputs[ i ].buffers = theBuffers;
+        if( !buildOutputFilename( aOptions->nameTemplate, aOptions->outputDirectory, aFilename, theOutputs[ i ].filterName, theOutputs[ i ].filename, sizeof( theOutputs[ i ].filename ) ) )
+        {
+            printf( "Output name for %s is too long\n", aFilename );
+            theProcessed = 0;
+            theNumOutputs = i;
+            break;
+        }
+
+        theOutputs[ i ].file = fopen( theOutputs[ i ].filename, "w+" );
+        if( !theOutputs[ i ].file )
+        {
+            printf( "Could not create %s\n", theOutputs[ i ].filename );
+        }
+        writeBitmapHeaders( &theOutputHeaders, theOutputs[ i ].file );
+        writeBitmapColorTable( &theOutputHeaders, theOutputs[ i ].file );
+        theOutputs[ i ].imageOffset = theOutputHeaders.fileHeader.image_offset;
+        theOutputs[ i ].rleRow = NULL;
+        if( theOutputHeaders.compression == BITMAP_COMPRESSION_RLE8 )
+        {
+            theOutputs[ i ].rleRow = allocateImageBuffer( theBuffers, 2 * ( size_t )theWidth + 2 );
+            theProcessed &= theOutputs[ i ].rleRow != NULL;
+        }
+
+        // the pixels go out through the shared writer, overlapping with the filtering
+        if( theOutputs[ i ].file )
+        {
+            theOutputs[ i ].stream = allocateImageBuffer( theBuffers, sizeof( OutputStream ) );
+            theProcessed &= theOutputs[ i ].stream &&
+                            openOutputStream( theOutputs[ i ].stream, aContext->writer, theBuffers, theOutputs[ i ].file, ( uint64_t )theOutputs[ i ].stride * theHeight, aOptions->directOutput );
+        }
+
+        // averaging pixels needs their values, not palette indices; a gray palette maps gray to itself
+        if( aOptions->pyramidLevels > 0 && theOutputs[ i ].file )
+        {
+            if( theBitsPerPixel != 24 && !theGrayOutput )
+            {
+                printf( "Pyramid levels of %s need a 24 bpp or --gray8 output\n", theOutputs[ i ].filename );
+            }
+            else if( !openPyramidLevels( aContext, &theOutputs[ i ], &theOutputHeaders, aOptions->pyramidLevels, aOptions, aFilename ) )
+            {
+                theProcessed = 0;
+            }
+        }
+    }
+
+    if( !theProcessed || theNumOutputs == 0 )
+    {
+        // nothing to do, the outputs could not be named or only the statistics were asked for
+    }
+    else if( theStreaming )
+    {
+        // --stream: the image is never held in memory as a whole; neighborhood ops need all of it
+        theProcessed = processImageStreaming( thePool, theBuffers, &theHeaders, theFile, theOutputs, theNumOutputs, aOptions->stripRows );
+    }
+    else
+    {
+        // point-only outputs are filtered from the same pass over the source, no scratch copy of the image
+        theProcessed = processImageOutputs( thePool, theBuffers, &theImageData, theHeaders.topDown, theOutputs, theNumOutputs );
+    }
+
+    if( !theProcessed )
+    {
+        printf( "Could not load the image data from %s\n", aFilename );
+    }
+    else
+    {
+        for( int i = 0; i < theNumOutputs; i++ )
+        {
+            if( !theOutputs[ i ].file )
+            {
+                // reported when it could not be created, the other outputs are still written
+                theProcessed = 0;
+                continue;
+            }
+            int theError = finishOutputFile( &theOutputs[ i ] );
+            if( theError )
+            {
+                printf( "Could not write %s: %s\n", theOutputs[ i ].filename, strerror( theError ) );
+                theProcessed = 0;
+                continue;
+            }
+            logMessage( "Wrote %s image to %s\n", theOutputs[ i ].description, theOutputs[ i ].filename );
+            for( int l = 0; l < theOutputs[ i ].numLevels; l++ )
+            {
+                logMessage( "Wrote %s image at 1/%d size to %s\n", theOutputs[ i ].description, 2 << l, theOutputs[ i ].levels[ l ].filename );
+            }
+        }
+    }
+
+    // only complete runs are cached, an output that could not be created may still hold an old image
+    int theComplete = theProcessed && theNumOutputs == aOptions->numOutputs;
+    for( int i = 0; theComplete && i < theNumOutputs; i++ )
+    {
+        theComplete = theOutputs[ i ].file != NULL;
+    }
+    if( theCaching && theComplete )
+    {
+        storeCachedOutputs( aContext->cache, theCacheEntry, theOutputs, theNumOutputs );
+    }
+
+    // MEMORY MANAGEMENT
+    if( theImageOwned && theImageData.data )
+    {
+        freeImageData( theBuffers, &theImageData );
+    }
+    for( int i = 0; i < theNumOutputs; i++ )
+    {
+        if( theOutputs[ i ].stream )
+        {
+            // nothing may still be writing from its buffers
+            closeOutputStream( theOutputs[ i ].stream, NULL );
+            freeImageBuffer( theBuffers, theOutputs[ i ].stream );
+        }
+        if( theOutputs[ i ].file )
+        {
+            fclose( theOutputs[ i ].file );
+        }
+        freeImageBuffer( theBuffers, theOutputs[ i ].rleRow );
+        closePyramidLevels( &theOutputs[ i ] );
+    }
+    if( theFile )
+    {
+        fclose( theFile );
+    }
+    unmapBitmapFile( &theMapping );
+    freeImageBuffer( theBuffers, theCompiledChains );
+    freeImageBuffer( theBuffers, theRowHashes );
+
+    return theProcessed;
+}
+
+// ---------- BATCH PROCESSING ----------
+
+void addBatchInput( BatchInputs* aInputs, const char* aFilename )
+{
+    struct stat theStat;
+    if( stat( aFilename, &theStat ) != 0 || !S_ISREG( theStat.st_mode ) )
+    {
+        printf( "%s does not exist!\n", aFilename );
+        return;
+    }
+
+    if( aInputs->count == aInputs->capacity )
+    {
+        int theCapacity = aInputs->capacity ? aInputs->capacity * 2 : 64;
+        BatchInput* theInputs = realloc( aInputs->inputs, sizeof( BatchInput ) * theCapacity );
+        if( !theInputs )
+        {
+            return;
+        }
+        aInputs->inputs = theInputs;
+        aInputs->capacity = theCapacity;
+    }
+
+    aInputs->inputs[ aInputs->count ].filename = strdup( aFilename );
+    aInputs->inputs[ aInputs->count ].size = theStat.st_size;
+    aInputs->count++;
+}
+
+void freeBatchInputs( BatchInputs* aInputs )
+{
+    for( int i = 0; i < aInputs->count; i++ )
+    {
+        free( aInputs->inputs[ i ].filename );
+    }
+    free( aInputs->inputs );
+    aInputs->inputs = NULL;
+    aInputs->count = 0;
+    aInputs->capacity = 0;
+}
+
+static int hasBitmapExtension( const char* aFilename )
+{
+    const char* theExtension = strrchr( aFilename, '.' );
+    return theExtension && strcasecmp( theExtension, ".bmp" ) == 0;
+}
+
+// aSource is a directory (every .bmp in it), a glob pattern, or a text file listing one path per line
+int collectBatchInputs( const char* aSource, BatchInputs* aInputs )
+{
+    struct stat theStat;
+    if( strpbrk( aSource, "*?[" ) )
+    {
+        glob_t theMatches;
+        if( glob( aSource, 0, NULL, &theMatches ) == 0 )
+        {
+            for( size_t i = 0; i < theMatches.gl_pathc; i++ )
+            {
+                addBatchInput( aInputs, theMatches.gl_pathv[ i ] );
+            }
+        }
+        globfree( &theMatches );
+    }
+    else if( stat( aSource, &theStat ) != 0 )
+    {
+        printf( "%s does not exist!\n", aSource );
+        return 0;
+    }
+    else if( S_ISDIR( theStat.st_mode ) )
+    {
+        DIR* theDirectory = opendir( aSource );
+        struct dirent* theEntry;
+        char thePath[ PATH_MAX ];
+        while( theDirectory && ( theEntry = readdir( theDirectory ) ) != NULL )
+        {
+            if( hasBitmapExtension( theEntry->d_name ) && snprintf( thePath, sizeof( thePath ), "%s/%s", aSource, theEntry->d_name ) < ( int )sizeof( thePath ) )
+            {
+                addBatchInput( aInputs, thePath );
+            }
+        }
+        if( theDirectory )
+        {
+            closedir( theDirectory );
+        }
+    }
+    else
+    {
+        FILE* theList = fopen( aSource, "r" );
+        char* theLine = NULL;
+        size_t theLineSize = 0;
+        ssize_t theLength;
+        while( theList && ( theLength = getline( &theLine, &theLineSize, theList ) ) != -1 )
+        {
+            while( theLength > 0 && ( theLine[ theLength - 1 ] == '\n' || theLine[ theLength - 1 ] == '\r' ) )
+            {
+                theLine[ --theLength ] = '\0';
+            }
+            if( theLength > 0 && theLine[ 0 ] != '#' )
+            {
+                addBatchInput( aInputs, theLine );
+            }
+        }
+        free( theLine );
+        if( theList )
+        {
+            fclose( theList );
+        }
+    }
+
+    return 1;
+}
+
+typedef struct
+{
+    BatchInput* inputs;
+    BmpContext serial;        // the batch's context without its workers
+    const ProcessingOptions* options;
+    int failures;
+} batchTaskArgs;
+
+// worker pool task: whole files, each one handled start to finish by a single worker
+void batchProcessingFiles( void* aContext, int aBegin, int aEnd )
+{
+    batchTaskArgs* theTask = ( batchTaskArgs* )aContext;
+    for( int i = aBegin; i < aEnd; i++ )
+    {
+        if( !processBitmapFile( &theTask->serial, theTask->inputs[ i ].filename, theTask->options ) )
+        {
+            __atomic_fetch_add( &theTask->failures, 1, __ATOMIC_RELAXED );
+        }
+    }
+}
+
+static int compareBatchInputSize( const void* aLeft, const void* aRight )
+{
+    off_t theLeft = ( ( const BatchInput* )aLeft )->size;
+    off_t theRight = ( ( const BatchInput* )aRight )->size;
+    return theLeft < theRight ? 1 : ( theLeft > theRight ? -1 : 0 );
+}
+
+// large files are split into strips across the whole pool one after another, small files are
+// spread over the pool one file per worker so per-file overhead does not leave cores idle
+int processBatch( const BmpContext* aContext, BatchInputs* aInputs, const ProcessingOptions* aOptions )
+{
+    qsort( aInputs->inputs, aInputs->count, sizeof( BatchInput ), compareBatchInputSize );
+
+    batchTaskArgs theTask;
+    theTask.inputs = aInputs->inputs;
+    theTask.serial = *aContext;
+    theTask.serial.workers = NULL;
+    theTask.options = aOptions;
+    theTask.failures = 0;
+
+    int theFirstSmall = 0;
+    while( theFirstSmall < aInputs->count && aInputs->inputs[ theFirstSmall ].size >= BATCH_SMALL_FILE_BYTES )
+    {
+        if( !processBitmapFile( aContext, aInputs->inputs[ theFirstSmall ].filename, aOptions ) )
+        {
+            theTask.failures++;
+        }
+        theFirstSmall++;
+    }
+
+    // largest first, so the long tail is made of the cheapest files
+    theTask.inputs = aInputs->inputs + theFirstSmall;
+    runParallel( aContext->workers, aInputs->count - theFirstSmall, 1, batchProcessingFiles, &theTask );
+
+    logMessage( "Processed %d files, %d failed\n", aInputs->count, theTask.failures );
+    return theTask.failures;
+}
+
+// ---------- RUN REPORTING ----------
+
+// a copy of the counters, safe to take while images are being processed
+void getRunStats( RunStats* aStats )
+{
+    const uint64_t* theCounters = ( const uint64_t* )&gRunStats;
+    uint64_t* theCopy = ( uint64_t* )aStats;
+    for( size_t i = 0; i < sizeof( RunStats ) / sizeof( uint64_t ); i++ )
+    {
+        theCopy[ i ] = __atomic_load_n( &theCounters[ i ], __ATOMIC_RELAXED );
+    }
+}
+
+void writeRunStatsJson( FILE* aFile, const BmpContext* aContext, uint64_t aWallNanoseconds, uint64_t aCpuNanoseconds )
+{
+    const WorkerPool* thePool = aContext->workers;
+    fprintf( aFile, "{\n" );
+    fprintf( aFile, "  \"wall_seconds\": %.6f,\n", aWallNanoseconds * 1e-9 );
+    fprintf( aFile, "  \"cpu_seconds\": %.6f,\n", aCpuNanoseconds * 1e-9 );
+    fprintf( aFile, "  \"files\": %" PRIu64 ",\n", gRunStats.files );
+    fprintf( aFile, "  \"rows\": %" PRIu64 ",\n", gRunStats.rowsDone );
+    fprintf( aFile, "  \"bytes_read\": %" PRIu64 ",\n", gRunStats.bytesRead );
+    fprintf( aFile, "  \"bytes_written\": %" PRIu64 ",\n", gRunStats.bytesWritten );
+    fprintf( aFile, "  \"peak_allocated_bytes\": %" PRIu64 ",\n", gRunStats.peakAllocatedBytes );
+    fprintf( aFile, "  \"buffer_allocations\": %" PRIu64 ",\n", gRunStats.bufferAllocations );
+    fprintf( aFile, "  \"buffer_reuses\": %" PRIu64 ",\n", gRunStats.bufferReuses );
+    fprintf( aFile, "  \"cache_hits\": %" PRIu64 ",\n", gRunStats.cacheHits );
+    fprintf( aFile, "  \"cache_misses\": %" PRIu64 ",\n", gRunStats.cacheMisses );
+    fprintf( aFile, "  \"writer\": \"%s\",\n", getAsyncWriterName( aContext->writer ) );
+    fprintf( aFile, "  \"stages\": {\n" );
+    for( int s = 0; s < NUM_RUN_STAGES; s++ )
+    {
+        fprintf( aFile, "    \"%s\": { \"calls\": %" PRIu64 ", \"wall_seconds\": %.6f, \"cpu_seconds\": %.6f }%s\n", gRunStageNames[ s ],
+                 gRunStats.calls[ s ], gRunStats.wallNanoseconds[ s ] * 1e-9, gRunStats.cpuNanoseconds[ s ] * 1e-9, s + 1 < NUM_RUN_STAGES ? "," : "" );
+    }
+    fprintf( aFile, "  },\n" );
+    fprintf( aFile, "  \"threads\": [" );
+    for( int i = 0; thePool && i < thePool->numThreads; i++ )
+    {
+        fprintf( aFile, "%s\n    { \"index\": %d, ", i ? "," : "", i );
+        if( thePool->pinned )
+        {
+            fprintf( aFile, "\"cpu\": %d, \"node\": %d, ", thePool->slots[ i ].cpu, thePool->slots[ i ].node );
+        }
+        fprintf( aFile, "\"busy_seconds\": %.6f }", thePool->slots[ i ].busyNanoseconds * 1e-9 );
+    }
+    fprintf( aFile, "\n  ]\n}\n" );
+}
+
@@ -0,0 +1,366 @@
+// reading, filtering and writing bitmaps as a library; a BmpContext holds what is worth keeping
+// from one image to the next (the worker threads, a pool of pixel buffers and the output writer),
+// so a process working through many images stops allocating once it has seen its largest one
+#ifndef BMPREADER_H
+#define BMPREADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+// symbols of the public interface; a shared build compiles with -fvisibility=hidden to keep the rest internal
+#define BMPREADER_API __attribute__(( visibility( "default" ) ))
+
+// image offsets based on header type
+#define BITMAPCOREHEADER_IMAGE_OFFSET 26
+#define BITMAPINFOHEADER_IMAGE_OFFSET 54
+#define BITMAPV4HEADER_IMAGE_OFFSET 122
+#define BITMAPV5HEADER_IMAGE_OFFSET 138
+
+#define BITMAP_COMPRESSION_RGB 0
+#define BITMAP_COMPRESSION_RLE8 1
+#define BITMAP_COMPRESSION_RLE4 2
+#define BITMAP_COMPRESSION_BITFIELDS 3
+
+#define MAX_FUSED_OUTPUTS 16
+#define MAX_FILTER_OPS 16
+#define MAX_PYRAMID_LEVELS 16
+#define NUM_DEFAULT_OUTPUTS 4
+
+typedef enum
+{
+    invert,
+    grayscaleBlue,
+    grayscaleRed,
+    grayscaleGreen,
+    lumaBt601,       // weighted sum of all three channels, BT.601 weights
+    lumaBt709,       // same with BT.709 weights
+    boxBlur,         // neighborhood ops, run as whole-image passes
+    gaussianBlur,
+    unsharpMask,
+    sobelEdges,
+    resizeBox,       // resampling ops, also whole-image passes; they change the image size
+    resizeBilinear,
+    resizeLanczos,
+    rotate90,        // geometry ops, clockwise rotations, mirrors and the transpose
+    rotate180,
+    rotate270,
+    flipHorizontal,
+    flipVertical,
+    transpose,
+    gammaCorrection, // point ops from here on, compiled into lookup tables
+    levels,
+    brightness,
+    contrast,
+    posterize,
+    threshold,
+    autoLevels,      // adaptive point ops, their tables come from the image statistics
+    equalize,
+    lookupTable      // a composed run of point ops, only produced by compileFilterChain
+} IMAGE_PROCESSING_TYPE;
+
+#pragma pack(push, 1) // no padding on the on-disk structs, need exact sizes
+
+typedef struct // first 14 bytes of every bitmap file
+{
+    uint16_t type;             // identifier, two ASCII characters, usually "BM"
+    uint32_t size;             // file size (bytes)
+    uint16_t reserved1;        // unused
+    uint16_t reserved2;        // unused
+    uint32_t image_offset;     // offset to image data in bytes from origin of file
+} BITMAPFILEHEADER;
+
+typedef struct // 12 bytes, for total offset of 26 bytes
+{
+    uint32_t header_size;      // this header's size
+    uint16_t width_px;         // image width
+    uint16_t height_px;        // image height
+    uint16_t num_planes;       // number of color planes
+    uint16_t bits_per_pixel;   // bits per pixel
+} BITMAPCOREHEADER;
+
+// altered from https://engineering.purdue.edu/ece264/17au/hw/HW15
+typedef struct // 40 bytes, for total offset of 54 bytes
+{
+    uint32_t header_size;  // DIB header size in bytes (40 bytes)
+    int32_t  width_px;         // image width
+    int32_t  height_px;        // image height
+    uint16_t num_planes;       // number of color planes
+    uint16_t bits_per_pixel;   // bits per pixel
+    uint32_t compression;      // compression type
+    uint32_t image_size_bytes; // image size (bytes)
+    int32_t  x_resolution_ppm; // pixels per meter
+    int32_t  y_resolution_ppm; // pixels per meter
+    uint32_t num_colors;       // number of colors  
+    uint32_t important_colors; // Important colors
+} BITMAPINFOHEADER;
+
+// https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-wmf/21164882-3cb3-49d6-8133-74396704f14d
+typedef struct
+{
+    uint32_t ciexyzX; // A 32-bit 2.30 fixed point type that defines the x chromaticity value.
+    uint32_t ciexyzY; // A 32-bit 2.30 fixed point type that defines the y chromaticity value.
+    uint32_t ciexyzZ; // A 32-bit 2.30 fixed point type that defines the z chromaticity value.
+} CIEXYZ;
+
+// https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-wmf/07b63c50-c07b-44bc-9523-be4e90d20a8e
+typedef struct
+{
+    CIEXYZ ciexyzRed;   // A 96-bit CIEXYZ Object that defines the red chromaticity values.
+    CIEXYZ ciexyzGreen; // A 96-bit CIEXYZ Object that defines the green chromaticity values.
+    CIEXYZ ciexyzBlue;  // A 96-bit CIEXYZ Object that defines the blue chromaticity values.
+} CIEXYZTRIPLE;
+
+// https://docs.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-bitmapv4header
+typedef struct // 108 bytes, for total offset of 122 bytes
+{
+    uint32_t     bV4Size;
+    int32_t      bV4Width;
+    int32_t      bV4Height;
+    uint16_t     bV4Planes;
+    uint16_t     bV4BitCount;
+    uint32_t     bV4V4Compression;
+    uint32_t     bV4SizeImage;
+    int32_t      bV4XPelsPerMeter;
+    int32_t      bV4YPelsPerMeter;
+    uint32_t     bV4ClrUsed;
+    uint32_t     bV4ClrImportant;
+    uint32_t     bV4RedMask;
+    uint32_t     bV4GreenMask;
+    uint32_t     bV4BlueMask;
+    uint32_t     bV4AlphaMask;
+    uint32_t     bV4CSType;
+    CIEXYZTRIPLE bV4Endpoints;
+    uint32_t     bV4GammaRed;
+    uint32_t     bV4GammaGreen;
+    uint32_t     bV4GammaBlue;
+} BITMAPV4HEADER;
+
+// https://docs.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-bitmapv5header
+typedef struct // 124 bytes, for a total offset of 138 bytes
+{
+    uint32_t     bV5Size;
+    int32_t      bV5Width;
+    int32_t      bV5Height;
+    uint16_t     bV5Planes;
+    uint16_t     bV5BitCount;
+    uint32_t     bV5Compression;
+    uint32_t     bV5SizeImage;
+    int32_t      bV5XPelsPerMeter;
+    int32_t      bV5YPelsPerMeter;
+    uint32_t     bV5ClrUsed;
+    uint32_t     bV5ClrImportant;
+    uint32_t     bV5RedMask;
+    uint32_t     bV5GreenMask;
+    uint32_t     bV5BlueMask;
+    uint32_t     bV5AlphaMask;
+    uint32_t     bV5CSType;
+    CIEXYZTRIPLE bV5Endpoints;
+    uint32_t     bV5GammaRed;
+    uint32_t     bV5GammaGreen;
+    uint32_t     bV5GammaBlue;
+    uint32_t     bV5Intent;
+    uint32_t     bV5ProfileData;
+    uint32_t     bV5ProfileSize;
+    uint32_t     bV5Reserved;
+} BITMAPV5HEADER;
+
+typedef struct
+{
+    uint8_t blue;
+    uint8_t green;
+    uint8_t red;
+} BitmapColor;
+
+#pragma pack(pop) // in-memory structs below keep their natural alignment (mutexes need it)
+
+typedef struct
+{
+    int32_t width;   // pixels per row
+    int32_t height;  // number of rows
+    uint16_t bitsPerPixel;
+    int32_t stride;  // bytes per row, including the padding stored on disk; negative walks the rows backwards
+    uint8_t* data;   // row 0, rows in file order unless the stride is negative; single aligned allocation
+} BitmapImage;
+
+typedef struct // every header of a file, whichever information header variant it uses
+{
+    BITMAPFILEHEADER fileHeader;
+    union
+    {
+        BITMAPCOREHEADER coreHeader;
+        BITMAPINFOHEADER infoHeader;
+        BITMAPV4HEADER v4Header;
+        BITMAPV5HEADER v5Header;
+    };
+    int32_t width;
+    int32_t height;                 // number of rows
+    int topDown;                    // negative height in the header: the first row is the top one
+    uint16_t bitsPerPixel;
+    uint32_t compression;
+    uint32_t colorMasks[ 3 ];       // 16 and 32 bpp: blue, green and red bits of a pixel
+    uint32_t numColors;             // palette entries, 0 without a palette
+    BitmapColor palette[ 256 ];
+} BitmapHeaders;
+
+typedef struct
+{
+    IMAGE_PROCESSING_TYPE type;
+    float parameters[ 2 ];
+    int channelMask;           // point ops: bit per BitmapColor channel they apply to, 0 for all
+    const uint8_t ( *tables )[ 256 ]; // adaptive ops once resolved: per channel table, NULL before
+} FilterOp;
+
+typedef struct
+{
+    FilterOp ops[ MAX_FILTER_OPS ]; // applied in order
+    int numOps;
+} FilterChain;
+
+typedef struct
+{
+    FilterChain chain;
+    char filterName[ 128 ];
+    char description[ 160 ];
+} OutputSpec;
+
+typedef struct
+{
+    int32_t x;       // left column
+    int32_t y;       // top row, counted from the top whatever the row order of the file
+    int32_t width;   // 0 for the whole image
+    int32_t height;
+} ImageRegion;
+
+typedef struct
+{
+    const OutputSpec* outputs;    // one output file per entry
+    int numOutputs;
+    int useMmap;
+    int stripRows;                // -1: whole image in memory, 0: streaming with the default strip size
+    const char* outputDirectory;  // NULL writes next to the working directory
+    const char* nameTemplate;     // {name} is the input file name without extension, {filter} the output's filter
+    int grayOutput;               // write gray outputs as 8 bpp with a gray palette
+    int rleOutput;                // write 8 bpp outputs RLE8 compressed
+    int pyramidLevels;            // also write this many halvings of every output
+    FILE* histogramFile;          // per image statistics as JSON Lines, NULL for none
+    int directOutput;             // write the pixels of the outputs with O_DIRECT
+    ImageRegion region;           // only this window of the input is read and processed
+} ProcessingOptions;
+
+typedef struct
+{
+    char* filename;
+    off_t size;
+} BatchInput;
+
+typedef struct
+{
+    BatchInput* inputs;
+    int count;
+    int capacity;
+} BatchInputs;
+
+typedef enum
+{
+    stageHeader,
+    stageRead,
+    stageFilter,
+    stageWrite,
+    NUM_RUN_STAGES
+} RUN_STAGE;
+
+typedef struct // every field is updated with atomics, stages can run concurrently
+{
+    uint64_t wallNanoseconds[ NUM_RUN_STAGES ];
+    uint64_t cpuNanoseconds[ NUM_RUN_STAGES ];   // process CPU time while the stage ran
+    uint64_t calls[ NUM_RUN_STAGES ];
+    uint64_t bytesRead;
+    uint64_t bytesWritten;
+    uint64_t allocatedBytes;                     // image, strip and scratch buffers currently handed out
+    uint64_t peakAllocatedBytes;
+    uint64_t bufferAllocations;                  // buffers that had to come from the heap
+    uint64_t bufferReuses;                       // buffers taken back out of a pool
+    uint64_t rowsTotal;
+    uint64_t rowsDone;
+    uint64_t files;
+    uint64_t cacheHits;                          // inputs whose outputs came from the result cache
+    uint64_t cacheMisses;
+} RunStats;
+
+typedef struct WorkerPool WorkerPool;
+typedef struct BufferPool BufferPool;
+typedef struct AsyncWriter AsyncWriter;
+typedef struct ResultCache ResultCache;
+
+typedef struct BmpContext // what lives on from one image to the next: threads, buffers and the output writer
+{
+    WorkerPool* workers;  // NULL works on the calling thread only
+    BufferPool* buffers;
+    AsyncWriter* writer;  // NULL writes synchronously
+    ResultCache* cache;   // NULL processes every input; closed with the context
+} BmpContext;
+
+// ---------- CONTEXT ----------
+
+BMPREADER_API BmpContext* createBmpContext( int aNumThreads, int aPinThreads, int aUseRing, uint64_t aMaxPooledBytes );
+BMPREADER_API void destroyBmpContext( BmpContext* aContext );
+BMPREADER_API int getDefaultThreadCount( void );
+BMPREADER_API void useScalarRowKernels( void );
+
+// ---------- BUFFERS ----------
+
+BMPREADER_API BufferPool* createBufferPool( uint64_t aMaxIdleBytes );
+BMPREADER_API void destroyBufferPool( BufferPool* aPool );
+BMPREADER_API void* allocateImageBuffer( BufferPool* aPool, size_t aSize );
+BMPREADER_API void freeImageBuffer( BufferPool* aPool, void* aBuffer );
+
+// ---------- RESULT CACHE ----------
+
+BMPREADER_API ResultCache* openResultCache( const char* aDirectory, uint64_t aMaxBytes );
+BMPREADER_API void closeResultCache( ResultCache* aCache );
+
+// ---------- READING AND WRITING ----------
+
+BMPREADER_API int readBitmapHeaders( FILE* aFile, BitmapHeaders* aHeaders );
+BMPREADER_API BitmapHeaders createBitmapHeaders( uint32_t aImageOffset, int32_t aWidth, int32_t aHeight, uint16_t aBitsPerPixel );
+BMPREADER_API void writeBitmapHeaders( const BitmapHeaders* aHeaders, FILE* aFile );
+BMPREADER_API void writeBitmapColorTable( const BitmapHeaders* aHeaders, FILE* aFile );
+BMPREADER_API int calculatePaddingSize( int32_t aImageWidth, uint16_t aBitsPerPixel );
+BMPREADER_API uint32_t calculateRowStride( int32_t aImageWidth, uint16_t aBitsPerPixel );
+BMPREADER_API BitmapImage allocateImageMemory( BufferPool* aBuffers, int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel );
+BMPREADER_API BitmapImage readImageData( BufferPool* aBuffers, int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel, FILE* aFile );
+BMPREADER_API void copyImageData( BitmapImage* aDataDest, const BitmapImage* aDataSrc );
+BMPREADER_API void writeImageData( const BitmapImage* aImage, FILE* aFile );
+BMPREADER_API void freeImageData( BufferPool* aBuffers, BitmapImage* aImage );
+
+// ---------- FILTERS ----------
+
+BMPREADER_API int parseFilterChain( const char* aSpec, FilterChain* aChain );
+BMPREADER_API void formatFilterChainName( const FilterChain* aChain, char* aResult, size_t aResultSize );
+BMPREADER_API void processImageChain( WorkerPool* aPool, const FilterChain* aChain, const BitmapImage* aSource, BitmapImage* aDestination );
+
+// ---------- FILES ----------
+
+extern BMPREADER_API const OutputSpec gDefaultOutputs[ NUM_DEFAULT_OUTPUTS ];
+
+BMPREADER_API int parseOutputSpec( const char* aSpec, OutputSpec* aOutput );
+BMPREADER_API int parseImageRegion( const char* aSpec, ImageRegion* aRegion );
+BMPREADER_API int processBitmapFile( const BmpContext* aContext, const char* aFilename, const ProcessingOptions* aOptions );
+BMPREADER_API void addBatchInput( BatchInputs* aInputs, const char* aFilename );
+BMPREADER_API int collectBatchInputs( const char* aSource, BatchInputs* aInputs );
+BMPREADER_API void freeBatchInputs( BatchInputs* aInputs );
+BMPREADER_API int processBatch( const BmpContext* aContext, BatchInputs* aInputs, const ProcessingOptions* aOptions );
+
+// ---------- RUN STATISTICS ----------
+
+BMPREADER_API void setVerbose( int aVerbose );
+BMPREADER_API void logMessage( const char* aFormat, ... );
+BMPREADER_API uint64_t readClockNanoseconds( clockid_t aClock );
+BMPREADER_API void getRunStats( RunStats* aStats );
+BMPREADER_API void writeJsonString( FILE* aFile, const char* aString );
+BMPREADER_API void writeRunStatsJson( FILE* aFile, const BmpContext* aContext, uint64_t aWallNanoseconds, uint64_t aCpuNanoseconds );
+
+#endif // BMPREADER_H
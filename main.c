@@ -1,650 +1,1555 @@
+#define _GNU_SOURCE // accept4, open_memstream
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "bmpreader.h"
+
+#define BUFFER_POOL_MAX_BYTES ( 1024ull * 1024 * 1024 ) // idle buffers kept for reuse between images
+#define BENCHMARK_MAX_VALUES 32
+#define BENCHMARK_MAX_STAGES 16
+#define BENCHMARK_MAX_SIZE 30000
+#define SERVER_DEFAULT_QUEUE 64
+#define SERVER_MAX_LINE 16384
+#define SERVER_MAX_TOKENS 64
+#define SERVER_MAX_CONNECTIONS 64
+#define CACHE_DEFAULT_MEGABYTES 1024
+
+// ---------- BENCHMARK ----------
 
-#pragma pack(1) // no padding on structs, need exact sizes
-
-// image offsets based on header type
-#define BITMAPCOREHEADER_IMAGE_OFFSET 26
-#define BITMAPINFOHEADER_IMAGE_OFFSET 54
-#define BITMAPV4HEADER_IMAGE_OFFSET 122
-#define BITMAPV5HEADER_IMAGE_OFFSET 138
-
-#define MAXPADDINGSIZE 3
-
-typedef enum
-{
-    invert,
-    grayscaleBlue,
-    grayscaleRed,
-    grayscaleGreen
-} IMAGE_PROCESSING_TYPE;
-
-typedef struct // first 14 bytes of every bitmap file
-{
-    uint16_t type;             // identifier, two ASCII characters, usually "BM"
-    uint32_t size;             // file size (bytes)
-    uint16_t reserved1;        // unused
-    uint16_t reserved2;        // unused
-    uint32_t image_offset;     // offset to image data in bytes from origin of file
-} BITMAPFILEHEADER;
-
-typedef struct 
-{
-    uint32_t header_size;      // this header's size
-    int32_t  width_px;         // image width
-    int32_t  height_px;        // image height
-    uint16_t num_planes;       // number of color planes
-    uint16_t bits_per_pixel;   // bits per pixel
-} BITMAPCOREHEADER;
-
-// altered from https://engineering.purdue.edu/ece264/17au/hw/HW15
-typedef struct // 40 bytes, for total offset of 54 bytes
-{
-    uint32_t header_size;  // DIB header size in bytes (40 bytes)
-    int32_t  width_px;         // image width
-    int32_t  height_px;        // image height
-    uint16_t num_planes;       // number of color planes
-    uint16_t bits_per_pixel;   // bits per pixel
-    uint32_t compression;      // compression type
-    uint32_t image_size_bytes; // image size (bytes)
-    int32_t  x_resolution_ppm; // pixels per meter
-    int32_t  y_resolution_ppm; // pixels per meter
-    uint32_t num_colors;       // number of colors  
-    uint32_t important_colors; // Important colors
-} BITMAPINFOHEADER;
-
-// https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-wmf/21164882-3cb3-49d6-8133-74396704f14d
 typedef struct
 {
-    uint32_t ciexyzX; // A 32-bit 2.30 fixed point type that defines the x chromaticity value.
-    uint32_t ciexyzY; // A 32-bit 2.30 fixed point type that defines the y chromaticity value.
-    uint32_t ciexyzZ; // A 32-bit 2.30 fixed point type that defines the z chromaticity value.
-} CIEXYZ;
+    int sizes[ BENCHMARK_MAX_VALUES ];        // square-ish images of size x size, width also size + 1..3
+    int numSizes;
+    int threadCounts[ BENCHMARK_MAX_VALUES ];
+    int numThreadCounts;
+    int repeat;                               // best of this many runs is reported
+    int pinThreads;
+    int json;
+    const char* directory;                    // where the synthetic images are generated
+} BenchmarkOptions;
 
-// https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-wmf/07b63c50-c07b-44bc-9523-be4e90d20a8e
 typedef struct
 {
-    CIEXYZ ciexyzRed;   // A 96-bit CIEXYZ Object that defines the red chromaticity values.
-    CIEXYZ ciexyzGreen; // A 96-bit CIEXYZ Object that defines the green chromaticity values.
-    CIEXYZ ciexyzBlue;  // A 96-bit CIEXYZ Object that defines the blue chromaticity values.
-} CIEXYZTRIPLE;
-
-// https://docs.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-bitmapv4header
-typedef struct // 108 bytes, for total offset of 122 bytes
-{
-    uint32_t     bV4Size;
-    int32_t      bV4Width;
-    int32_t      bV4Height;
-    uint16_t     bV4Planes;
-    uint16_t     bV4BitCount;
-    uint32_t     bV4V4Compression;
-    uint32_t     bV4SizeImage;
-    int32_t      bV4XPelsPerMeter;
-    int32_t      bV4YPelsPerMeter;
-    uint32_t     bV4ClrUsed;
-    uint32_t     bV4ClrImportant;
-    uint32_t     bV4RedMask;
-    uint32_t     bV4GreenMask;
-    uint32_t     bV4BlueMask;
-    uint32_t     bV4AlphaMask;
-    uint32_t     bV4CSType;
-    CIEXYZTRIPLE bV4Endpoints;
-    uint32_t     bV4GammaRed;
-    uint32_t     bV4GammaGreen;
-    uint32_t     bV4GammaBlue;
-} BITMAPV4HEADER;
-
-// https://docs.microsoft.com/en-us/windows/win32/api/wingdi/ns-wingdi-bitmapv5header
-typedef struct // 124 bytes, for a total offset of 138 bytes
-{
-    uint32_t     bV5Size;
-    int32_t      bV5Width;
-    int32_t      bV5Height;
-    uint16_t     bV5Planes;
-    uint16_t     bV5BitCount;
-    uint32_t     bV5Compression;
-    uint32_t     bV5SizeImage;
-    int32_t      bV5XPelsPerMeter;
-    int32_t      bV5YPelsPerMeter;
-    uint32_t     bV5ClrUsed;
-    uint32_t     bV5ClrImportant;
-    uint32_t     bV5RedMask;
-    uint32_t     bV5GreenMask;
-    uint32_t     bV5BlueMask;
-    uint32_t     bV5AlphaMask;
-    uint32_t     bV5CSType;
-    CIEXYZTRIPLE bV5Endpoints;
-    uint32_t     bV5GammaRed;
-    uint32_t     bV5GammaGreen;
-    uint32_t     bV5GammaBlue;
-    uint32_t     bV5Intent;
-    uint32_t     bV5ProfileData;
-    uint32_t     bV5ProfileSize;
-    uint32_t     bV5Reserved;
-} BITMAPV5HEADER;
+    const char* stage;
+    double seconds;
+} BenchmarkStage;
 
-typedef struct
+static const uint32_t gBenchmarkHeaderOffsets[] =
 {
-    uint8_t blue;
-    uint8_t green;
-    uint8_t red;
-} BitmapColor;
-
-// ---------- HEADER READ FUNCTIONS ----------
-
-BITMAPFILEHEADER readBitmapFileHeader( FILE* aFile )
+    BITMAPCOREHEADER_IMAGE_OFFSET,
+    BITMAPINFOHEADER_IMAGE_OFFSET,
+    BITMAPV4HEADER_IMAGE_OFFSET,
+    BITMAPV5HEADER_IMAGE_OFFSET
+};
+static const char* gBenchmarkHeaderNames[] = { "core", "info", "v4", "v5" };
+
+double getMonotonicSeconds( void )
 {
-    BITMAPFILEHEADER theHeader;
-    if( aFile )
-    {
-        fread( &theHeader, sizeof( BITMAPFILEHEADER ), 1, aFile );
-        printf( "Bitmap file header read.\n" );
-    }
-    return theHeader;
+    struct timespec theTime;
+    clock_gettime( CLOCK_MONOTONIC, &theTime );
+    return theTime.tv_sec + theTime.tv_nsec * 1e-9;
 }
 
-BITMAPCOREHEADER readBitmapCoreHeader( FILE* aFile )
+// parses "1,2,4" into aValues, returns the number of values or -1 on bad input
+int parseIntegerList( const char* aList, int* aValues, int aMaxValues, int aMinValue, int aMaxValue )
 {
-    BITMAPCOREHEADER theHeader;
-    if( aFile )
+    int theCount = 0;
+    const char* c = aList;
+    while( *c )
     {
-        fread( &theHeader, sizeof( BITMAPCOREHEADER ), 1, aFile );
-        printf( "Information header read: BITMAP CORE\n" );        
+        char* theEnd;
+        long theValue = strtol( c, &theEnd, 10 );
+        if( theEnd == c || theValue < aMinValue || theValue > aMaxValue || theCount == aMaxValues )
+        {
+            return -1;
+        }
+        aValues[ theCount++ ] = ( int )theValue;
+        c = *theEnd == ',' ? theEnd + 1 : theEnd;
+        if( *theEnd && *theEnd != ',' )
+        {
+            return -1;
+        }
     }
-    return theHeader;
+    return theCount;
 }
 
-BITMAPINFOHEADER readBitmapInfoHeader( FILE* aFile )
+int generateSyntheticBitmap( const char* aFilename, uint32_t aImageOffset, int32_t aWidth, int32_t aHeight )
 {
-    BITMAPINFOHEADER theHeader;
-    if( aFile )
+    FILE* theFile = fopen( aFilename, "w" );
+    if( !theFile )
     {
-        fread( &theHeader, sizeof( BITMAPINFOHEADER ), 1, aFile );
-        printf( "Information header read: BITMAP INFO\n" );        
+        return 0;
     }
-    return theHeader;
-}
 
-BITMAPV4HEADER readBitmapV4Header( FILE* aFile )
-{
-    BITMAPV4HEADER theHeader;
-    if( aFile )
+    BitmapHeaders theHeaders = createBitmapHeaders( aImageOffset, aWidth, aHeight, 24 );
+    writeBitmapHeaders( &theHeaders, theFile );
+
+    // diagonal gradients, a different one per channel, padding left at zero
+    uint32_t theStride = calculateRowStride( aWidth, 24 );
+    uint8_t* theRow = calloc( theStride, 1 );
+    for( int32_t y = 0; y < aHeight && theRow; y++ )
     {
-        fread( &theHeader, sizeof( BITMAPV4HEADER ), 1, aFile );
-        printf( "Information header read: BITMAP V4\n" );        
+        BitmapColor* thePixels = ( BitmapColor* )theRow;
+        for( int32_t x = 0; x < aWidth; x++ )
+        {
+            thePixels[ x ].blue = ( uint8_t )( x + y );
+            thePixels[ x ].green = ( uint8_t )( x * 3 - y );
+            thePixels[ x ].red = ( uint8_t )( x ^ y );
+        }
+        fwrite( theRow, sizeof( uint8_t ), theStride, theFile );
     }
-    return theHeader;
+    free( theRow );
+
+    return fclose( theFile ) == 0 && theRow;
 }
 
-BITMAPV5HEADER readBitmapV5Header( FILE* aFile )
+// runs every stage once and keeps the fastest time seen for each of them in aStages; 0 if the
+// input could not be read or the output could not be written
+static int runBenchmarkPass( const BmpContext* aContext, const char* aInputName, const char* aOutputName, BenchmarkStage* aStages )
 {
-    BITMAPV5HEADER theHeader;
-    if( aFile )
+    int theNumStages = 0;
+    double theStart = getMonotonicSeconds();
+
+    FILE* theFile = fopen( aInputName, "r" );
+    BitmapHeaders theHeaders;
+    if( !theFile || !readBitmapHeaders( theFile, &theHeaders ) )
     {
-        fread( &theHeader, sizeof( BITMAPV5HEADER ), 1, aFile );
-        printf( "Information header read: BITMAP V5\n" );        
+        if( theFile )
+        {
+            fclose( theFile );
+        }
+        return 0;
+    }
+    double theEnd = getMonotonicSeconds();
+    aStages[ theNumStages ].stage = "header";
+    aStages[ theNumStages ].seconds = fmin( aStages[ theNumStages ].seconds, theEnd - theStart );
+    theNumStages++;
+
+    theStart = theEnd;
+    BitmapImage theImageData = readImageData( aContext->buffers, theHeaders.width, theHeaders.height, theHeaders.bitsPerPixel, theFile );
+    theEnd = getMonotonicSeconds();
+    fclose( theFile );
+    aStages[ theNumStages ].stage = "readImageData";
+    aStages[ theNumStages ].seconds = fmin( aStages[ theNumStages ].seconds, theEnd - theStart );
+    theNumStages++;
+
+    BitmapImage theNewImageData = allocateImageMemory( aContext->buffers, theHeaders.width, theHeaders.height, theHeaders.bitsPerPixel );
+    if( !theImageData.data || !theNewImageData.data )
+    {
+        freeImageData( aContext->buffers, &theImageData );
+        freeImageData( aContext->buffers, &theNewImageData );
+        return 0;
     }
-    return theHeader;
-}
 
-// ---------- HEADER WRITE FUNCTIONS ----------
+    theStart = getMonotonicSeconds();
+    copyImageData( &theNewImageData, &theImageData );
+    theEnd = getMonotonicSeconds();
+    aStages[ theNumStages ].stage = "copyImageData";
+    aStages[ theNumStages ].seconds = fmin( aStages[ theNumStages ].seconds, theEnd - theStart );
+    theNumStages++;
 
-void writeBitmapFileHeader( BITMAPFILEHEADER aHeader, FILE* aFile )
-{
-    if( aFile )
+    for( size_t i = 0; i < sizeof( gDefaultOutputs ) / sizeof( gDefaultOutputs[ 0 ] ); i++ )
     {
-        fwrite( &aHeader, sizeof( BITMAPFILEHEADER ), 1, aFile );
+        theStart = getMonotonicSeconds();
+        processImageChain( aContext->workers, &gDefaultOutputs[ i ].chain, &theImageData, &theNewImageData );
+        theEnd = getMonotonicSeconds();
+        aStages[ theNumStages ].stage = gDefaultOutputs[ i ].filterName;
+        aStages[ theNumStages ].seconds = fmin( aStages[ theNumStages ].seconds, theEnd - theStart );
+        theNumStages++;
     }
-}
 
-void writeBitmapCoreHeader( BITMAPCOREHEADER aHeader, FILE* aFile )
-{
-    if( aFile )
+    FILE* theOutput = fopen( aOutputName, "w" );
+    int theWritten = 0;
+    if( theOutput )
     {
-        fwrite( &aHeader, sizeof( BITMAPCOREHEADER ), 1, aFile );
+        theStart = getMonotonicSeconds();
+        writeImageData( &theNewImageData, theOutput );
+        theWritten = fflush( theOutput ) == 0;
+        theEnd = getMonotonicSeconds();
+        theWritten &= fclose( theOutput ) == 0;
     }
+    if( !theWritten )
+    {
+        freeImageData( aContext->buffers, &theImageData );
+        freeImageData( aContext->buffers, &theNewImageData );
+        return 0;
+    }
+    aStages[ theNumStages ].stage = "writeImageData";
+    aStages[ theNumStages ].seconds = fmin( aStages[ theNumStages ].seconds, theEnd - theStart );
+    theNumStages++;
+
+    freeImageData( aContext->buffers, &theImageData );
+    freeImageData( aContext->buffers, &theNewImageData );
+    return theNumStages;
 }
 
-void writeBitmapInfoHeader( BITMAPINFOHEADER aHeader, FILE* aFile )
+// generates one image per size, padding value and header variant, then times every stage for
+// every thread count; results go to stdout as CSV or JSON
+int runBenchmark( const BenchmarkOptions* aOptions )
 {
-    if( aFile )
+    char theInputName[ PATH_MAX ];
+    char theOutputName[ PATH_MAX ];
+    int theFirstRecord = 1;
+
+    if( aOptions->json )
     {
-        fwrite( &aHeader, sizeof( BITMAPINFOHEADER ), 1, aFile );
+        printf( "[\n" );
+    }
+    else
+    {
+        printf( "header,width,height,padding,threads,stage,seconds,mpixels_per_s,gbytes_per_s\n" );
     }
-}
 
-void writeBitmapV4Header( BITMAPV4HEADER aHeader, FILE* aFile )
-{
-    if( aFile )
+    for( int s = 0; s < aOptions->numSizes; s++ )
     {
-        fwrite( &aHeader, sizeof( BITMAPV4HEADER ), 1, aFile );
+        // widths size .. size + 3 hit every padding value, each with a different header variant
+        for( int v = 0; v < 4; v++ )
+        {
+            int32_t theWidth = aOptions->sizes[ s ] + v;
+            int32_t theHeight = aOptions->sizes[ s ];
+            snprintf( theInputName, sizeof( theInputName ), "%s/bench_%dx%d_%s.bmp", aOptions->directory, theWidth, theHeight, gBenchmarkHeaderNames[ v ] );
+            snprintf( theOutputName, sizeof( theOutputName ), "%s/bench_output.bmp", aOptions->directory );
+            if( !generateSyntheticBitmap( theInputName, gBenchmarkHeaderOffsets[ v ], theWidth, theHeight ) )
+            {
+                fprintf( stderr, "Could not generate %s\n", theInputName );
+                return 1;
+            }
+
+            double thePixels = ( double )theWidth * theHeight;
+            double theBytes = ( double )calculateRowStride( theWidth, 24 ) * theHeight;
+
+            for( int t = 0; t < aOptions->numThreadCounts; t++ )
+            {
+                BmpContext* theContext = createBmpContext( aOptions->threadCounts[ t ], aOptions->pinThreads, 0, BUFFER_POOL_MAX_BYTES );
+                if( !theContext )
+                {
+                    fprintf( stderr, "Could not start %d threads\n", aOptions->threadCounts[ t ] );
+                    return 1;
+                }
+                BenchmarkStage theStages[ BENCHMARK_MAX_STAGES ];
+                for( int i = 0; i < BENCHMARK_MAX_STAGES; i++ )
+                {
+                    theStages[ i ].seconds = INFINITY;
+                }
+
+                int theNumStages = 0;
+                for( int r = 0; r < aOptions->repeat; r++ )
+                {
+                    theNumStages = runBenchmarkPass( theContext, theInputName, theOutputName, theStages );
+                }
+                destroyBmpContext( theContext );
+                if( theNumStages == 0 )
+                {
+                    fprintf( stderr, "Could not read %s or write %s\n", theInputName, theOutputName );
+                    unlink( theInputName );
+                    unlink( theOutputName );
+                    return 1;
+                }
+
+                for( int i = 0; i < theNumStages; i++ )
+                {
+                    double theSeconds = theStages[ i ].seconds > 0 ? theStages[ i ].seconds : 1e-9;
+                    if( aOptions->json )
+                    {
+                        printf( "%s  { \"header\": \"%s\", \"width\": %d, \"height\": %d, \"padding\": %d, \"threads\": %d, \"stage\": \"%s\", \"seconds\": %.9f, \"mpixels_per_s\": %.3f, \"gbytes_per_s\": %.3f }",
+                                theFirstRecord ? "" : ",\n", gBenchmarkHeaderNames[ v ], theWidth, theHeight, calculatePaddingSize( theWidth, 24 ), aOptions->threadCounts[ t ],
+                                theStages[ i ].stage, theSeconds, thePixels / theSeconds / 1e6, theBytes / theSeconds / 1e9 );
+                    }
+                    else
+                    {
+                        printf( "%s,%d,%d,%d,%d,%s,%.9f,%.3f,%.3f\n", gBenchmarkHeaderNames[ v ], theWidth, theHeight, calculatePaddingSize( theWidth, 24 ), aOptions->threadCounts[ t ],
+                                theStages[ i ].stage, theSeconds, thePixels / theSeconds / 1e6, theBytes / theSeconds / 1e9 );
+                    }
+                    theFirstRecord = 0;
+                }
+                fflush( stdout );
+            }
+
+            unlink( theInputName );
+            unlink( theOutputName );
+        }
     }
-}
 
-void writeBitmapV5Header( BITMAPV5HEADER aHeader, FILE* aFile )
-{
-    if( aFile )
+    if( aOptions->json )
     {
-        fwrite( &aHeader, sizeof( BITMAPV5HEADER ), 1, aFile );
+        printf( "\n]\n" );
     }
+    return 0;
 }
 
-// ---------- IMAGE DATA FUNCTIONS ----------
+// ---------- SERVER ----------
+
+typedef struct JobServer JobServer;
+
+typedef struct
+{
+    JobServer* server;
+    int fd;                     // jobs are read from here
+    int responseFd;             // one JSON line per job
+    int dropped;                // a response could not be sent, the rest are not either
+    pthread_mutex_t lock;       // guards the responses, dropped and references
+    int references;             // the reader plus every job still queued or running
+} ServerConnection;
 
-int findNextMultipleOf4( int aNum )
+typedef struct
 {
-    return ( aNum + 3 ) & ~0x03;
+    ServerConnection* connection;
+    char* line;                 // the request, id, input and the option strings point into it
+    const char* id;
+    const char* input;
+    ProcessingOptions options;
+    OutputSpec outputs[ MAX_FUSED_OUTPUTS ];
+    uint64_t receivedNanoseconds;
+    char error[ 256 ];          // a request that cannot run is only answered, in its turn
+} ServerJob;
+
+struct JobServer
+{
+    const BmpContext* context;
+    const ProcessingOptions* defaults;  // every job starts from the command line options
+    ServerJob** queue;                  // ring of jobs waiting for the dispatcher
+    int capacity;
+    int head;
+    int count;
+    int closed;                         // no more jobs, the dispatcher exits once the queue is empty
+    int connections;
+    pthread_mutex_t lock;
+    pthread_cond_t jobQueued;
+    pthread_cond_t jobTaken;
+    pthread_cond_t connectionClosed;
+    int wakeFds[ 2 ];                   // readable once the server is asked to stop
+    uint64_t jobsDone;
+    uint64_t jobsFailed;
+};
+
+// SIGINT and SIGTERM are taken by sigwait in one thread, so every thread started after this has them blocked
+void blockServerSignals( void )
+{
+    sigset_t theSignals;
+    sigemptyset( &theSignals );
+    sigaddset( &theSignals, SIGINT );
+    sigaddset( &theSignals, SIGTERM );
+    pthread_sigmask( SIG_BLOCK, &theSignals, NULL );
+    signal( SIGPIPE, SIG_IGN );
 }
 
-int calculatePaddingSize( int32_t aImageWidth, uint16_t aBitsPerPixel )
+static void* serverSignalThread( void* args )
 {
-    // number of pixels in a row, divide by 8 to convert bits to bytes 
-    int thePixelDataPerRow = aBitsPerPixel * aImageWidth / 8;
+    JobServer* theServer = ( JobServer* )args;
+    sigset_t theSignals;
+    sigemptyset( &theSignals );
+    sigaddset( &theSignals, SIGINT );
+    sigaddset( &theSignals, SIGTERM );
+    int theSignal;
+    sigwait( &theSignals, &theSignal );
+
+    // never read, so every poll on it returns from now on
+    if( write( theServer->wakeFds[ 1 ], "", 1 ) < 0 )
+    {
+        perror( "wake" );
+    }
+    return NULL;
+}
 
-    // padding must bring row size to next multiple of 4
-    return findNextMultipleOf4( thePixelDataPerRow ) - thePixelDataPerRow;
+// sends the response without ever blocking on a socket: a client that stopped reading until its
+// socket buffer is full is dropped rather than holding up the dispatcher, and every other client
+static void writeJobResponse( ServerConnection* aConnection, const ServerJob* aJob, const char* aError, uint64_t aQueueNanoseconds, uint64_t aRunNanoseconds )
+{
+    char* theText = NULL;
+    size_t theSize = 0;
+    FILE* theFile = open_memstream( &theText, &theSize );
+    if( !theFile )
+    {
+        return;
+    }
+    const char* theFields[ 2 ] = { aJob->id, aJob->input };
+    for( int i = 0; i < 2; i++ )
+    {
+        fprintf( theFile, i ? ", \"input\": " : "{\"id\": " );
+        if( theFields[ i ] )
+        {
+            writeJsonString( theFile, theFields[ i ] );
+        }
+        else
+        {
+            fprintf( theFile, "null" );
+        }
+    }
+    fprintf( theFile, ", \"status\": \"%s\"", aError ? "error" : "ok" );
+    if( aError )
+    {
+        fprintf( theFile, ", \"error\": " );
+        writeJsonString( theFile, aError );
+    }
+    fprintf( theFile, ", \"queue_seconds\": %.6f, \"run_seconds\": %.6f}\n", aQueueNanoseconds * 1e-9, aRunNanoseconds * 1e-9 );
+    fclose( theFile );
+
+    pthread_mutex_lock( &aConnection->lock );
+    size_t theSent = 0;
+    while( !aConnection->dropped && theSent < theSize )
+    {
+        // stdout is not a socket; with - it is the only client, so it may block
+        ssize_t theResult = send( aConnection->responseFd, theText + theSent, theSize - theSent, MSG_DONTWAIT | MSG_NOSIGNAL );
+        if( theResult < 0 && errno == ENOTSOCK )
+        {
+            theResult = write( aConnection->responseFd, theText + theSent, theSize - theSent );
+        }
+        if( theResult < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( theResult <= 0 )
+        {
+            // the reader sees the end of its input; jobs already queued still run, unanswered
+            logMessage( "Dropped a client that does not read its responses\n" );
+            aConnection->dropped = 1;
+            shutdown( aConnection->fd, SHUT_RDWR );
+            break;
+        }
+        theSent += theResult;
+    }
+    pthread_mutex_unlock( &aConnection->lock );
+    free( theText );
 }
 
-BitmapColor** allocateImageMemory( int32_t aImageWidth, int32_t aImageHeight )
+static void releaseServerConnection( ServerConnection* aConnection )
 {
-    BitmapColor** theImageData = ( BitmapColor** )malloc( aImageWidth * sizeof( BitmapColor* ) );
-    for( int i = 0; i < aImageWidth; i++ )
+    pthread_mutex_lock( &aConnection->lock );
+    int theReferences = --aConnection->references;
+    pthread_mutex_unlock( &aConnection->lock );
+    if( theReferences > 0 )
     {
-        theImageData[ i ] = ( BitmapColor* )malloc( aImageHeight * sizeof( BitmapColor ) );
+        return;
     }
 
-    return theImageData;
+    JobServer* theServer = aConnection->server;
+    close( aConnection->responseFd );
+    close( aConnection->fd );
+    pthread_mutex_destroy( &aConnection->lock );
+    free( aConnection );
+
+    pthread_mutex_lock( &theServer->lock );
+    theServer->connections--;
+    pthread_cond_broadcast( &theServer->connectionClosed );
+    pthread_mutex_unlock( &theServer->lock );
 }
 
-BitmapColor** readImageData( int32_t aImageWidth, int32_t aImageHeight, uint16_t aBitsPerPixel, FILE* aFile )
+static ServerConnection* createServerConnection( JobServer* aServer, int aFd, int aResponseFd )
 {
-    BitmapColor** theImageData = allocateImageMemory( aImageWidth, aImageHeight );
+    ServerConnection* theConnection = malloc( sizeof( ServerConnection ) );
+    if( !theConnection )
+    {
+        return NULL;
+    }
+    theConnection->server = aServer;
+    theConnection->fd = aFd;
+    theConnection->responseFd = aResponseFd;
+    theConnection->dropped = 0;
+    theConnection->references = 1;
+    pthread_mutex_init( &theConnection->lock, NULL );
+
+    pthread_mutex_lock( &aServer->lock );
+    aServer->connections++;
+    pthread_mutex_unlock( &aServer->lock );
+    return theConnection;
+}
 
-    int thePaddingSize = calculatePaddingSize( aImageWidth, aBitsPerPixel );
-    // memory does not need to be initialized as it will be used to temporarily store data while reading
-    
-    // loops through every row (from bottom to top)
-    for( int y = 0; y < aImageHeight; y++ )
+// splits aLine in place at spaces and tabs; double quotes keep spaces inside a token and are removed
+static int splitJobTokens( char* aLine, char** aTokens, int aMaxTokens )
+{
+    int theCount = 0;
+    char* c = aLine;
+    for( ;; )
     {
-        // loops within the row, less than or equal to accomodate padding at the end of each line
-        for( int x = 0; x <= aImageWidth; x++ )
+        while( *c == ' ' || *c == '\t' )
+        {
+            c++;
+        }
+        if( !*c )
+        {
+            return theCount;
+        }
+        if( theCount == aMaxTokens )
         {
-            if( x < aImageWidth )
+            return -1;
+        }
+
+        aTokens[ theCount++ ] = c;
+        char* theOut = c;
+        int theQuoted = 0;
+        while( *c && ( theQuoted || ( *c != ' ' && *c != '\t' ) ) )
+        {
+            if( *c == '"' )
             {
-                fread( &( theImageData[ x ][ y ] ), sizeof( BitmapColor ), 1, aFile );
+                theQuoted = !theQuoted;
             }
             else
             {
-                // skip over the padding
-                fseek( aFile, sizeof( uint8_t ) * thePaddingSize, SEEK_CUR );
+                *theOut++ = *c;
             }
+            c++;
         }
+        if( *c )
+        {
+            c++;
+        }
+        *theOut = '\0';
     }
-
-    return theImageData;
 }
 
-void copyImageData( int32_t aImageWidth, int32_t aImageHeight, BitmapColor** aDataDest, BitmapColor** aDataSrc )
+// a job is a line of key=value options and flags, e.g.
+//   id=7 input="/in/a b.bmp" output-dir=/out pipeline=blur:3,invert pipeline=luma gray8
+// anything it does not set is taken from the command line
+static int parseServerJob( ServerJob* aJob, const ProcessingOptions* aDefaults, char* aError, size_t aErrorSize )
 {
-    for( int i = 0; i < aImageWidth; i++ )
+    char* theTokens[ SERVER_MAX_TOKENS ];
+    int theNumTokens = splitJobTokens( aJob->line, theTokens, SERVER_MAX_TOKENS );
+    ProcessingOptions* theOptions = &aJob->options;
+    *theOptions = *aDefaults;
+    if( theNumTokens < 0 )
     {
-        memcpy( aDataDest[ i ], aDataSrc[ i ], sizeof( BitmapColor ) * aImageHeight );
+        snprintf( aError, aErrorSize, "more than %d options", SERVER_MAX_TOKENS );
+        return 0;
     }
-}
 
-void freeImageData( int32_t aImageWidth, int32_t aImageHeight, BitmapColor** aImageData )
-{
-    for( int i = 0; i < aImageWidth; i++ )
+    for( int i = 0; i < theNumTokens; i++ )
+    {
+        char* theValue = strchr( theTokens[ i ], '=' );
+        if( theValue )
+        {
+            *theValue++ = '\0';
+        }
+        const char* theKey = theTokens[ i ];
+        int theValid = 1;
+        if( strcmp( theKey, "id" ) == 0 && theValue )
+        {
+            aJob->id = theValue;
+        }
+        else if( strcmp( theKey, "input" ) == 0 && theValue )
+        {
+            aJob->input = theValue;
+        }
+        else if( strcmp( theKey, "pipeline" ) == 0 && theValue )
+        {
+            // the first pipeline replaces the outputs of the command line
+            if( theOptions->outputs != aJob->outputs )
+            {
+                theOptions->outputs = aJob->outputs;
+                theOptions->numOutputs = 0;
+            }
+            theValid = theOptions->numOutputs < MAX_FUSED_OUTPUTS && parseOutputSpec( theValue, &aJob->outputs[ theOptions->numOutputs++ ] );
+        }
+        else if( strcmp( theKey, "output-dir" ) == 0 && theValue )
+        {
+            theOptions->outputDirectory = theValue;
+        }
+        else if( strcmp( theKey, "name" ) == 0 && theValue )
+        {
+            theOptions->nameTemplate = theValue;
+        }
+        else if( strcmp( theKey, "roi" ) == 0 && theValue )
+        {
+            theValid = parseImageRegion( theValue, &theOptions->region );
+        }
+        else if( strcmp( theKey, "strip-rows" ) == 0 && theValue )
+        {
+            theOptions->stripRows = atoi( theValue );
+            theValid = theOptions->stripRows > 0;
+        }
+        else if( strcmp( theKey, "pyramid" ) == 0 && theValue )
+        {
+            theOptions->pyramidLevels = atoi( theValue );
+            theValid = theOptions->pyramidLevels > 0 && theOptions->pyramidLevels <= MAX_PYRAMID_LEVELS;
+        }
+        else if( strcmp( theKey, "stream" ) == 0 && !theValue )
+        {
+            theOptions->stripRows = theOptions->stripRows > 0 ? theOptions->stripRows : 0;
+        }
+        else if( strcmp( theKey, "mmap" ) == 0 && !theValue )
+        {
+            theOptions->useMmap = 1;
+        }
+        else if( strcmp( theKey, "gray8" ) == 0 && !theValue )
+        {
+            theOptions->grayOutput = 1;
+        }
+        else if( strcmp( theKey, "rle" ) == 0 && !theValue )
+        {
+            theOptions->rleOutput = 1;
+        }
+        else if( strcmp( theKey, "direct" ) == 0 && !theValue )
+        {
+            theOptions->directOutput = 1;
+        }
+        else
+        {
+            theValid = 0;
+        }
+
+        if( !theValid )
+        {
+            snprintf( aError, aErrorSize, theValue ? "invalid %s: %s" : "invalid option %s", theKey, theValue );
+            return 0;
+        }
+    }
+
+    if( !aJob->input )
+    {
+        snprintf( aError, aErrorSize, "no input" );
+        return 0;
+    }
+    if( theOptions->useMmap && theOptions->stripRows >= 0 )
+    {
+        snprintf( aError, aErrorSize, "mmap and stream cannot be combined" );
+        return 0;
+    }
+    if( theOptions->outputDirectory && mkdir( theOptions->outputDirectory, 0777 ) != 0 && errno != EEXIST )
     {
-        free( aImageData[ i ] );
+        snprintf( aError, aErrorSize, "could not create %s", theOptions->outputDirectory );
+        return 0;
     }
-    free( aImageData );
+    return 1;
 }
 
-void writeImageData( int32_t aImageWidth, int32_t aImageHeight, uint32_t aBitsPerPixel, BitmapColor** aImageData, FILE* aFile )
+// queues the job of one request line, blocking while the queue is full. A request that cannot run,
+// aError or a line that does not parse, is queued too, so every client gets its responses in order
+static void submitServerJob( ServerConnection* aConnection, const char* aLine, const char* aError )
 {
-    int thePaddingSize = calculatePaddingSize( aImageWidth, aBitsPerPixel );
-    uint8_t thePadding[ MAXPADDINGSIZE ];
-    
-    for( int i = 0; i < MAXPADDINGSIZE; i++ )
+    JobServer* theServer = aConnection->server;
+    ServerJob* theJob = malloc( sizeof( ServerJob ) );
+    char* theLine = strdup( aLine );
+    if( !theJob || !theLine )
+    {
+        // nothing to queue it with
+        ServerJob theFailed = { .connection = aConnection };
+        writeJobResponse( aConnection, &theFailed, "out of memory", 0, 0 );
+        free( theJob );
+        free( theLine );
+        return;
+    }
+    theJob->connection = aConnection;
+    theJob->line = theLine;
+    theJob->id = NULL;
+    theJob->input = NULL;
+    theJob->receivedNanoseconds = readClockNanoseconds( CLOCK_MONOTONIC );
+    theJob->error[ 0 ] = '\0';
+    if( aError )
     {
-        thePadding[ i ] = 0;
+        snprintf( theJob->error, sizeof( theJob->error ), "%s", aError );
     }
+    else
+    {
+        parseServerJob( theJob, theServer->defaults, theJob->error, sizeof( theJob->error ) );
+    }
+
+    pthread_mutex_lock( &aConnection->lock );
+    aConnection->references++;
+    pthread_mutex_unlock( &aConnection->lock );
 
-    for( int y = 0; y < aImageHeight; y++ )
+    // a full queue stops this reader, and the client's writes back up behind it
+    pthread_mutex_lock( &theServer->lock );
+    while( theServer->count == theServer->capacity )
     {
-        for( int x = 0; x < aImageWidth; x++ )
-        {
-            fwrite( &( aImageData[ x ][ y ] ), sizeof( aImageData[ x ][ y ] ), 1, aFile );
-        }
-        
-        // write padding at the end of the row
-        fwrite( thePadding, sizeof( uint8_t ), thePaddingSize, aFile );
+        pthread_cond_wait( &theServer->jobTaken, &theServer->lock );
     }
+    theServer->queue[ ( theServer->head + theServer->count ) % theServer->capacity ] = theJob;
+    theServer->count++;
+    pthread_cond_signal( &theServer->jobQueued );
+    pthread_mutex_unlock( &theServer->lock );
 }
 
-// ---------- IMAGE MANIPULATION FUNCTIONS ----------
-
-typedef struct
+// reads newline separated jobs until the end of the input or until the server stops
+static void readServerJobs( ServerConnection* aConnection )
 {
-    IMAGE_PROCESSING_TYPE processingType;
-    uint32_t imageHeight;
-    BitmapColor* row;
-} threadArgs;
-
-void* imageProcessingThread( void* args ) 
-{ 
-    threadArgs* theThreadArgs = (threadArgs*)args;
-    switch( theThreadArgs->processingType )
+    char* theBuffer = malloc( SERVER_MAX_LINE + 1 );
+    size_t theLength = 0;
+    int theSkipping = 0;  // inside a line that was too long
+    struct pollfd theFds[ 2 ] =
+    {
+        { aConnection->fd, POLLIN, 0 },
+        { aConnection->server->wakeFds[ 0 ], POLLIN, 0 }
+    };
+    while( theBuffer )
     {
-        case invert:
+        if( poll( theFds, 2, -1 ) < 0 )
         {
-            for( int y = 0; y < theThreadArgs->imageHeight; y++ )
+            if( errno == EINTR )
             {
-                theThreadArgs->row[ y ].blue = UINT8_MAX - theThreadArgs->row[ y ].blue;
-                theThreadArgs->row[ y ].red = UINT8_MAX - theThreadArgs->row[ y ].red;
-                theThreadArgs->row[ y ].green = UINT8_MAX - theThreadArgs->row[ y ].green;
+                continue;
             }
             break;
         }
-        case grayscaleBlue:
+        if( theFds[ 1 ].revents )
         {
-            for( int y = 0; y < theThreadArgs->imageHeight; y++ )
+            break;
+        }
+
+        ssize_t theRead = read( aConnection->fd, theBuffer + theLength, SERVER_MAX_LINE - theLength );
+        if( theRead < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        if( theRead <= 0 )
+        {
+            // the last line does not need a newline
+            if( theRead == 0 && theLength > 0 && !theSkipping )
             {
-                theThreadArgs->row[ y ].blue = theThreadArgs->row[ y ].blue;
-                theThreadArgs->row[ y ].red = theThreadArgs->row[ y ].blue;
-                theThreadArgs->row[ y ].green = theThreadArgs->row[ y ].blue;
+                theBuffer[ theLength ] = '\0';
+                submitServerJob( aConnection, theBuffer, NULL );
             }
             break;
         }
-        case grayscaleGreen:
+        theLength += theRead;
+
+        char* theStart = theBuffer;
+        char* theEnd;
+        while( ( theEnd = memchr( theStart, '\n', theBuffer + theLength - theStart ) ) )
         {
-            for( int y = 0; y < theThreadArgs->imageHeight; y++ )
+            *theEnd = '\0';
+            if( theEnd > theStart && theEnd[ -1 ] == '\r' )
             {
-                theThreadArgs->row[ y ].blue = theThreadArgs->row[ y ].green;
-                theThreadArgs->row[ y ].red = theThreadArgs->row[ y ].green;
-                theThreadArgs->row[ y ].green = theThreadArgs->row[ y ].green;
+                theEnd[ -1 ] = '\0';
             }
-            break;
+            // blank lines and # comments are not jobs
+            if( !theSkipping && theStart[ strspn( theStart, " \t" ) ] != '\0' && *theStart != '#' )
+            {
+                submitServerJob( aConnection, theStart, NULL );
+            }
+            theSkipping = 0;
+            theStart = theEnd + 1;
         }
-        case grayscaleRed:
+        theLength -= theStart - theBuffer;
+        memmove( theBuffer, theStart, theLength );
+
+        if( theLength == SERVER_MAX_LINE )
         {
-            for( int y = 0; y < theThreadArgs->imageHeight; y++ )
+            if( !theSkipping )
             {
-                theThreadArgs->row[ y ].blue = theThreadArgs->row[ y ].red;
-                theThreadArgs->row[ y ].red = theThreadArgs->row[ y ].red;
-                theThreadArgs->row[ y ].green = theThreadArgs->row[ y ].red;
+                submitServerJob( aConnection, "", "line too long" );
             }
-            break;
+            theSkipping = 1;
+            theLength = 0;
         }
     }
+    free( theBuffer );
+}
 
+static void* serverConnectionThread( void* args )
+{
+    ServerConnection* theConnection = ( ServerConnection* )args;
+    readServerJobs( theConnection );
+    releaseServerConnection( theConnection );
     return NULL;
 }
 
-void invertImage( uint32_t aImageWidth, uint32_t aImageHeight, BitmapColor** aImage )
+// runs the queued jobs one after another, each one on the whole warm worker pool
+static void* jobDispatcherThread( void* args )
 {
-    pthread_t* threadIDs = malloc( sizeof( pthread_t ) * aImageWidth );
-    threadArgs* theArgs = malloc( sizeof( threadArgs ) * aImageWidth );
-    for( int x = 0; x < aImageWidth; x++ )
+    JobServer* theServer = ( JobServer* )args;
+    for( ;; )
     {
-        theArgs[ x ].processingType = invert;
-        theArgs[ x ].imageHeight = aImageHeight;
-        theArgs[ x ].row = aImage[ x ];
-        pthread_create( &threadIDs[ x ], NULL, imageProcessingThread, &theArgs[ x ] );        
+        pthread_mutex_lock( &theServer->lock );
+        while( theServer->count == 0 && !theServer->closed )
+        {
+            pthread_cond_wait( &theServer->jobQueued, &theServer->lock );
+        }
+        if( theServer->count == 0 )
+        {
+            pthread_mutex_unlock( &theServer->lock );
+            return NULL;
+        }
+        ServerJob* theJob = theServer->queue[ theServer->head ];
+        theServer->head = ( theServer->head + 1 ) % theServer->capacity;
+        theServer->count--;
+        pthread_cond_signal( &theServer->jobTaken );
+        pthread_mutex_unlock( &theServer->lock );
+
+        uint64_t theStart = readClockNanoseconds( CLOCK_MONOTONIC );
+        if( theJob->error[ 0 ] )
+        {
+            writeJobResponse( theJob->connection, theJob, theJob->error, theStart - theJob->receivedNanoseconds, 0 );
+        }
+        else
+        {
+            int theProcessed = processBitmapFile( theServer->context, theJob->input, &theJob->options );
+            uint64_t theEnd = readClockNanoseconds( CLOCK_MONOTONIC );
+            if( theProcessed )
+            {
+                theServer->jobsDone++;
+            }
+            else
+            {
+                theServer->jobsFailed++;
+            }
+            writeJobResponse( theJob->connection, theJob, theProcessed ? NULL : "processing failed", theStart - theJob->receivedNanoseconds, theEnd - theStart );
+        }
+        releaseServerConnection( theJob->connection );
+        free( theJob->line );
+        free( theJob );
     }
+}
 
-    for( int x = 0; x < aImageWidth; x++ )
+// a socket file nobody accepts on is left over from a server that did not stop cleanly
+static int isStaleServerSocket( const struct sockaddr_un* aAddress )
+{
+    struct stat theStat;
+    if( lstat( aAddress->sun_path, &theStat ) != 0 || !S_ISSOCK( theStat.st_mode ) )
     {
-        pthread_join( threadIDs[ x ], NULL );
+        return 0;
     }
-
-    free( threadIDs );
-    free( theArgs );
+    int theProbe = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    int theStale = theProbe >= 0 && connect( theProbe, ( const struct sockaddr* )aAddress, sizeof( *aAddress ) ) != 0 && errno == ECONNREFUSED;
+    if( theProbe >= 0 )
+    {
+        close( theProbe );
+    }
+    return theStale;
 }
 
-void grayscaleImageBlue( uint32_t aImageWidth, uint32_t aImageHeight, BitmapColor** aImage )
+static int openServerSocket( const char* aPath )
 {
-    pthread_t* threadIDs = malloc( sizeof( pthread_t ) * aImageWidth );
-    threadArgs* theArgs = malloc( sizeof( threadArgs ) * aImageWidth );
-    for( int x = 0; x < aImageWidth; x++ )
+    struct sockaddr_un theAddress;
+    memset( &theAddress, 0, sizeof( theAddress ) );
+    theAddress.sun_family = AF_UNIX;
+    if( strlen( aPath ) >= sizeof( theAddress.sun_path ) )
     {
-        theArgs[ x ].processingType = grayscaleBlue;
-        theArgs[ x ].imageHeight = aImageHeight;
-        theArgs[ x ].row = aImage[ x ];
-        pthread_create( &threadIDs[ x ], NULL, imageProcessingThread, &theArgs[ x ] );        
+        errno = ENAMETOOLONG;
+        return -1;
     }
+    strcpy( theAddress.sun_path, aPath );
 
-    for( int x = 0; x < aImageWidth; x++ )
+    int theSocket = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0 );
+    if( theSocket < 0 )
+    {
+        return -1;
+    }
+    int theBound = bind( theSocket, ( struct sockaddr* )&theAddress, sizeof( theAddress ) ) == 0;
+    if( !theBound && errno == EADDRINUSE && isStaleServerSocket( &theAddress ) && unlink( aPath ) == 0 )
     {
-        pthread_join( threadIDs[ x ], NULL );
+        theBound = bind( theSocket, ( struct sockaddr* )&theAddress, sizeof( theAddress ) ) == 0;
     }
+    if( !theBound || listen( theSocket, SOMAXCONN ) != 0 )
+    {
+        int theError = errno;
+        close( theSocket );
+        errno = theError;
+        return -1;
+    }
+    return theSocket;
+}
 
-    free( threadIDs );
-    free( theArgs );
+// accepts clients until the server is asked to stop, one reader thread per connection
+static void acceptServerConnections( JobServer* aServer, int aSocket )
+{
+    struct pollfd theFds[ 2 ] =
+    {
+        { aSocket, POLLIN, 0 },
+        { aServer->wakeFds[ 0 ], POLLIN, 0 }
+    };
+    pthread_attr_t theAttributes;
+    pthread_attr_init( &theAttributes );
+    pthread_attr_setdetachstate( &theAttributes, PTHREAD_CREATE_DETACHED );
+    for( ;; )
+    {
+        if( poll( theFds, 2, -1 ) < 0 && errno != EINTR )
+        {
+            break;
+        }
+        if( theFds[ 1 ].revents )
+        {
+            break;
+        }
+        if( !theFds[ 0 ].revents )
+        {
+            continue;
+        }
+
+        // past the connection limit new clients wait in the listen backlog
+        pthread_mutex_lock( &aServer->lock );
+        while( aServer->connections >= SERVER_MAX_CONNECTIONS )
+        {
+            pthread_cond_wait( &aServer->connectionClosed, &aServer->lock );
+        }
+        pthread_mutex_unlock( &aServer->lock );
+
+        int theClient = accept4( aSocket, NULL, NULL, SOCK_CLOEXEC );
+        if( theClient < 0 )
+        {
+            continue;
+        }
+        int theResponseFd = dup( theClient );
+        ServerConnection* theConnection = theResponseFd >= 0 ? createServerConnection( aServer, theClient, theResponseFd ) : NULL;
+        pthread_t theThread;
+        if( !theConnection )
+        {
+            if( theResponseFd >= 0 )
+            {
+                close( theResponseFd );
+            }
+            close( theClient );
+        }
+        else if( pthread_create( &theThread, &theAttributes, serverConnectionThread, theConnection ) != 0 )
+        {
+            releaseServerConnection( theConnection );
+        }
+    }
+    pthread_attr_destroy( &theAttributes );
 }
 
-void grayscaleImageGreen( uint32_t aImageWidth, uint32_t aImageHeight, BitmapColor** aImage )
+// serves jobs from a Unix socket, or from stdin with the responses on stdout when aSocketPath is "-";
+// returns once stdin ends or on SIGINT/SIGTERM, after the queued jobs are done
+int runJobServer( const BmpContext* aContext, const ProcessingOptions* aDefaults, const char* aSocketPath, int aQueueSize )
 {
-    pthread_t* threadIDs = malloc( sizeof( pthread_t ) * aImageWidth );
-    threadArgs* theArgs = malloc( sizeof( threadArgs ) * aImageWidth );
-    for( int x = 0; x < aImageWidth; x++ )
+    JobServer theServer;
+    memset( &theServer, 0, sizeof( theServer ) );
+    theServer.context = aContext;
+    theServer.defaults = aDefaults;
+    theServer.capacity = aQueueSize;
+    theServer.queue = malloc( sizeof( ServerJob* ) * aQueueSize );
+    if( !theServer.queue || pipe( theServer.wakeFds ) != 0 )
+    {
+        printf( "Could not start the server\n" );
+        free( theServer.queue );
+        return 1;
+    }
+    pthread_mutex_init( &theServer.lock, NULL );
+    pthread_cond_init( &theServer.jobQueued, NULL );
+    pthread_cond_init( &theServer.jobTaken, NULL );
+    pthread_cond_init( &theServer.connectionClosed, NULL );
+
+    int theResult = 0;
+    pthread_t theDispatcher;
+    pthread_t theSignalThread;
+    int theDispatcherStarted = pthread_create( &theDispatcher, NULL, jobDispatcherThread, &theServer ) == 0;
+    int theSignalThreadStarted = theDispatcherStarted && pthread_create( &theSignalThread, NULL, serverSignalThread, &theServer ) == 0;
+    if( !theSignalThreadStarted )
     {
-        theArgs[ x ].processingType = grayscaleGreen;
-        theArgs[ x ].imageHeight = aImageHeight;
-        theArgs[ x ].row = aImage[ x ];
-        pthread_create( &threadIDs[ x ], NULL, imageProcessingThread, &theArgs[ x ] );        
+        printf( "Could not start the server\n" );
+        theResult = 1;
+    }
+    else if( strcmp( aSocketPath, "-" ) == 0 )
+    {
+        // responses keep the real stdout, everything else printed goes to stderr
+        fflush( stdout );
+        int theResponseFd = dup( STDOUT_FILENO );
+        ServerConnection* theConnection = NULL;
+        if( theResponseFd >= 0 && dup2( STDERR_FILENO, STDOUT_FILENO ) >= 0 )
+        {
+            theConnection = createServerConnection( &theServer, STDIN_FILENO, theResponseFd );
+        }
+        if( theConnection )
+        {
+            readServerJobs( theConnection );
+            releaseServerConnection( theConnection );
+        }
+        else
+        {
+            printf( "Could not read jobs from stdin\n" );
+            theResult = 1;
+        }
+    }
+    else
+    {
+        int theSocket = openServerSocket( aSocketPath );
+        if( theSocket < 0 )
+        {
+            printf( "Could not listen on %s: %s\n", aSocketPath, strerror( errno ) );
+            theResult = 1;
+        }
+        else
+        {
+            logMessage( "Listening on %s\n", aSocketPath );
+            acceptServerConnections( &theServer, theSocket );
+            close( theSocket );
+            unlink( aSocketPath );
+        }
     }
 
-    for( int x = 0; x < aImageWidth; x++ )
+    // readers stop on the wake pipe, their queued jobs still run and are answered
+    if( theSignalThreadStarted )
+    {
+        pthread_kill( theSignalThread, SIGTERM );
+        pthread_join( theSignalThread, NULL );
+    }
+    pthread_mutex_lock( &theServer.lock );
+    while( theServer.connections > 0 )
     {
-        pthread_join( threadIDs[ x ], NULL );
+        pthread_cond_wait( &theServer.connectionClosed, &theServer.lock );
+    }
+    theServer.closed = 1;
+    pthread_cond_signal( &theServer.jobQueued );
+    pthread_mutex_unlock( &theServer.lock );
+    if( theDispatcherStarted )
+    {
+        pthread_join( theDispatcher, NULL );
+    }
+    if( theResult == 0 )
+    {
+        logMessage( "Served %" PRIu64 " jobs, %" PRIu64 " failed\n", theServer.jobsDone + theServer.jobsFailed, theServer.jobsFailed );
     }
 
-    free( threadIDs );
-    free( theArgs );
+    pthread_cond_destroy( &theServer.connectionClosed );
+    pthread_cond_destroy( &theServer.jobTaken );
+    pthread_cond_destroy( &theServer.jobQueued );
+    pthread_mutex_destroy( &theServer.lock );
+    close( theServer.wakeFds[ 0 ] );
+    close( theServer.wakeFds[ 1 ] );
+    free( theServer.queue );
+    return theResult;
 }
 
-void grayscaleImageRed( uint32_t aImageWidth, uint32_t aImageHeight, BitmapColor** aImage )
+// ---------- RUN REPORTING ----------
+
+typedef struct
 {
-    pthread_t* threadIDs = malloc( sizeof( pthread_t ) * aImageWidth );
-    threadArgs* theArgs = malloc( sizeof( threadArgs ) * aImageWidth );
-    for( int x = 0; x < aImageWidth; x++ )
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stopped;
+    int stop;
+    int intervalSeconds;
+    uint64_t startNanoseconds;
+} ProgressReporter;
+
+static void* progressReporterThread( void* args )
+{
+    ProgressReporter* theReporter = ( ProgressReporter* )args;
+    pthread_mutex_lock( &theReporter->lock );
+    while( !theReporter->stop )
     {
-        theArgs[ x ].processingType = grayscaleRed;
-        theArgs[ x ].imageHeight = aImageHeight;
-        theArgs[ x ].row = aImage[ x ];
-        pthread_create( &threadIDs[ x ], NULL, imageProcessingThread, &theArgs[ x ] );        
+        struct timespec theDeadline;
+        clock_gettime( CLOCK_REALTIME, &theDeadline );
+        theDeadline.tv_sec += theReporter->intervalSeconds;
+        if( pthread_cond_timedwait( &theReporter->stopped, &theReporter->lock, &theDeadline ) == ETIMEDOUT )
+        {
+            RunStats theStats;
+            getRunStats( &theStats );
+            fprintf( stderr, "progress: %.1fs, %" PRIu64 "/%" PRIu64 " rows (%.1f%%), %.1f MB read, %.1f MB written\n",
+                     ( readClockNanoseconds( CLOCK_MONOTONIC ) - theReporter->startNanoseconds ) * 1e-9, theStats.rowsDone, theStats.rowsTotal,
+                     theStats.rowsTotal ? 100.0 * theStats.rowsDone / theStats.rowsTotal : 0.0,
+                     theStats.bytesRead / 1e6, theStats.bytesWritten / 1e6 );
+        }
     }
+    pthread_mutex_unlock( &theReporter->lock );
+    return NULL;
+}
 
-    for( int x = 0; x < aImageWidth; x++ )
-    {
-        pthread_join( threadIDs[ x ], NULL );
-    }
+// prints progress to stderr every aIntervalSeconds until stopProgressReporter
+int startProgressReporter( ProgressReporter* aReporter, int aIntervalSeconds )
+{
+    pthread_mutex_init( &aReporter->lock, NULL );
+    pthread_cond_init( &aReporter->stopped, NULL );
+    aReporter->stop = 0;
+    aReporter->intervalSeconds = aIntervalSeconds;
+    aReporter->startNanoseconds = readClockNanoseconds( CLOCK_MONOTONIC );
+    return pthread_create( &aReporter->thread, NULL, progressReporterThread, aReporter ) == 0;
+}
+
+void stopProgressReporter( ProgressReporter* aReporter )
+{
+    pthread_mutex_lock( &aReporter->lock );
+    aReporter->stop = 1;
+    pthread_cond_signal( &aReporter->stopped );
+    pthread_mutex_unlock( &aReporter->lock );
+    pthread_join( aReporter->thread, NULL );
+    pthread_cond_destroy( &aReporter->stopped );
+    pthread_mutex_destroy( &aReporter->lock );
+}
 
-    free( threadIDs );
-    free( theArgs );
+void printUsage( const char* aProgramName )
+{
+    printf( "Usage: %s [options] [path to bitmap (.bmp) image]\n", aProgramName );
+    printf( "       %s [options] --batch [directory | glob | list file]\n", aProgramName );
+    printf( "       %s [options] --serve [socket path | -]\n", aProgramName );
+    printf( "Options:\n" );
+    printf( "  -t, --threads N    number of worker threads (default: number of cores)\n" );
+    printf( "  -m, --mmap         map the input file instead of reading it into memory\n" );
+    printf( "      --no-simd      use the scalar filter kernels even if the CPU has SSE/AVX\n" );
+    printf( "      --pin          bind the worker threads to CPUs, node by node, and give each a fixed band\n" );
+    printf( "                     of rows that it reads, filters and writes\n" );
+    printf( "      --no-io-uring  write the outputs from writer threads even if io_uring is available\n" );
+    printf( "      --direct       write the pixels of the outputs with O_DIRECT, bypassing the page cache\n" );
+    printf( "  -s, --stream       process the image in strips without loading it whole\n" );
+    printf( "  -r, --strip-rows N rows per strip when streaming (implies --stream)\n" );
+    printf( "  -b, --batch        process every .bmp in a directory, a glob or a list file\n" );
+    printf( "  -o, --output-dir D directory the outputs are written to\n" );
+    printf( "  -n, --name T       output name template, {name} and {filter} are substituted\n" );
+    printf( "                     (default: {filter}.bmp, or {name}_{filter}.bmp with --batch)\n" );
+    printf( "  -p, --pipeline P   write an output filtered by the comma separated ops in P, applied in order\n" );
+    printf( "                     in a single pass; repeat for more outputs (default: one output per op)\n" );
+    printf( "                     ops: invert, grayscale:red, grayscale:green, grayscale:blue, luma:601,\n" );
+    printf( "                     luma:709, gamma:G, levels:BLACK:WHITE, brightness:OFFSET, contrast:FACTOR,\n" );
+    printf( "                     posterize:LEVELS, threshold:T, autolevels, equalize; point ops take an optional\n" );
+    printf( "                     @red, @green or @blue\n" );
+    printf( "                     24 bpp inputs also take blur:RADIUS, gaussian:SIGMA, unsharp:AMOUNT:SIGMA, sobel,\n" );
+    printf( "                     resize[:box|:bilinear|:lanczos]:WIDTH:HEIGHT (0 keeps the aspect ratio),\n" );
+    printf( "                     rotate:90, rotate:180, rotate:270 (clockwise), hflip and transpose; vflip\n" );
+    printf( "                     works on any input\n" );
+    printf( "      --roi X,Y,W,H  read and process only the W x H window whose top left pixel is X,Y; the\n" );
+    printf( "                     outputs are that size (uncompressed inputs only)\n" );
+    printf( "      --gray8        write gray outputs as 8 bpp images with a gray palette\n" );
+    printf( "      --rle          write 8 bpp outputs RLE8 compressed\n" );
+    printf( "      --pyramid N    also write N halvings of every output (invert_2, invert_4, ...) in the same pass\n" );
+    printf( "      --cache D      keep the outputs of every input in directory D, keyed by a hash of the input\n" );
+    printf( "                     file and the options; an input seen before is still read to hash it, but\n" );
+    printf( "                     not processed or written again, its outputs are reflinked or copied from D\n" );
+    printf( "      --cache-size MB  drop the least recently used results beyond this size (default: %d)\n", CACHE_DEFAULT_MEGABYTES );
+    printf( "      --histogram FILE  write channel and luma histograms of every input as JSON Lines to FILE\n" );
+    printf( "                     (- for stdout); without --pipeline no images are written\n" );
+    printf( "      --serve S      keep the threads and buffers warm and run the jobs sent to the Unix socket S,\n" );
+    printf( "                     or read from stdin with the responses on stdout if S is -; one job per line,\n" );
+    printf( "                     e.g. id=1 input=a.bmp output-dir=out pipeline=blur:2,invert gray8\n" );
+    printf( "      --queue N      jobs waiting to run before the server stops reading new ones (default: %d)\n", SERVER_DEFAULT_QUEUE );
+    printf( "  -q, --quiet        no progress messages\n" );
+    printf( "      --stats FILE   write run statistics as JSON to FILE (- for stdout)\n" );
+    printf( "      --progress N   print progress to stderr every N seconds\n" );
+    printf( "      --bench        generate synthetic images and time every stage, no input needed\n" );
+    printf( "      --bench-sizes L      comma separated image sizes, up to %d (default: 64,256,1024,4096)\n", BENCHMARK_MAX_SIZE );
+    printf( "      --bench-threads L    comma separated thread counts (default: powers of two up to the core count)\n" );
+    printf( "      --bench-repeat N     report the best of N runs (default: 3)\n" );
+    printf( "      --bench-format F     csv or json (default: csv)\n" );
 }
 
 int main( int argc, char* argv[] )
 {
-    if( argc == 2 )
+    int theNumThreads = getDefaultThreadCount();
+    int theBatchMode = 0;
+    int theBenchmarkMode = 0;
+    const char* theServerSocket = NULL;
+    int theQueueSize = SERVER_DEFAULT_QUEUE;
+    const char* theStatsFilename = NULL;
+    const char* theHistogramFilename = NULL;
+    int theUseRing = 1;
+    int thePinThreads = 0;
+    const char* theCacheDirectory = NULL;
+    uint64_t theCacheMegabytes = CACHE_DEFAULT_MEGABYTES;
+    int theProgressInterval = 0;
+    BenchmarkOptions theBenchmark;
+    theBenchmark.sizes[ 0 ] = 64;
+    theBenchmark.sizes[ 1 ] = 256;
+    theBenchmark.sizes[ 2 ] = 1024;
+    theBenchmark.sizes[ 3 ] = 4096;
+    theBenchmark.numSizes = 4;
+    theBenchmark.numThreadCounts = 0;
+    theBenchmark.repeat = 3;
+    theBenchmark.json = 0;
+    theBenchmark.pinThreads = 0;
+    ProcessingOptions theOptions;
+    OutputSpec theOutputSpecs[ MAX_FUSED_OUTPUTS ];
+    theOptions.outputs = gDefaultOutputs;
+    theOptions.numOutputs = sizeof( gDefaultOutputs ) / sizeof( gDefaultOutputs[ 0 ] );
+    theOptions.useMmap = 0;
+    theOptions.stripRows = -1;
+    theOptions.outputDirectory = NULL;
+    theOptions.nameTemplate = NULL;
+    theOptions.grayOutput = 0;
+    theOptions.rleOutput = 0;
+    theOptions.pyramidLevels = 0;
+    theOptions.histogramFile = NULL;
+    theOptions.directOutput = 0;
+    memset( &theOptions.region, 0, sizeof( theOptions.region ) );
+
+    static struct option theLongOptions[] =
     {
-        const char* theOriginalFilename = argv[ 1 ];
-        FILE* theFile = fopen( theOriginalFilename, "r" );
-        if( theFile )
+        { "threads", required_argument, NULL, 't' },
+        { "mmap", no_argument, NULL, 'm' },
+        { "no-simd", no_argument, NULL, 'S' },
+        { "pin", no_argument, NULL, 1014 },
+        { "roi", required_argument, NULL, 1015 },
+        { "cache", required_argument, NULL, 1016 },
+        { "cache-size", required_argument, NULL, 1017 },
+        { "stream", no_argument, NULL, 's' },
+        { "strip-rows", required_argument, NULL, 'r' },
+        { "batch", no_argument, NULL, 'b' },
+        { "output-dir", required_argument, NULL, 'o' },
+        { "name", required_argument, NULL, 'n' },
+        { "pipeline", required_argument, NULL, 'p' },
+        { "quiet", no_argument, NULL, 'q' },
+        { "gray8", no_argument, NULL, 1006 },
+        { "rle", no_argument, NULL, 1007 },
+        { "pyramid", required_argument, NULL, 1008 },
+        { "histogram", required_argument, NULL, 1009 },
+        { "no-io-uring", no_argument, NULL, 1010 },
+        { "direct", no_argument, NULL, 1011 },
+        { "serve", required_argument, NULL, 1012 },
+        { "queue", required_argument, NULL, 1013 },
+        { "stats", required_argument, NULL, 1004 },
+        { "progress", required_argument, NULL, 1005 },
+        { "bench", no_argument, NULL, 'B' },
+        { "bench-sizes", required_argument, NULL, 1000 },
+        { "bench-threads", required_argument, NULL, 1001 },
+        { "bench-repeat", required_argument, NULL, 1002 },
+        { "bench-format", required_argument, NULL, 1003 },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int theOption;
+    while( ( theOption = getopt_long( argc, argv, "t:msr:bo:n:qp:", theLongOptions, NULL ) ) != -1 )
+    {
+        switch( theOption )
         {
-            BITMAPFILEHEADER theBitmapFileHeader = readBitmapFileHeader( theFile );
-            int32_t theImageWidth = 0;
-            int32_t theImageHeight = 0;
-            uint16_t theImageBitCount = 0;
-            const char* theInvertedImageName = "invert.bmp";
-            const char* theRedGrayscaleImageName = "grayscaleRed.bmp";
-            const char* theGreenGrayscaleImageName = "grayscaleGreen.bmp";
-            const char* theBlueGrayscaleImageName = "grayscaleBlue.bmp";
-
-            FILE* theInvertedFile = fopen( theInvertedImageName, "w" );
-            FILE* theRedGrayscaleFile = fopen( theRedGrayscaleImageName, "w" );
-            FILE* theGreenGrayscaleFile = fopen( theGreenGrayscaleImageName, "w" );
-            FILE* theBlueGrayscaleFile = fopen( theBlueGrayscaleImageName, "w" );
-
-            switch( theBitmapFileHeader.image_offset )
+            case 't':
             {
-                case BITMAPCOREHEADER_IMAGE_OFFSET:
+                theNumThreads = atoi( optarg );
+                if( theNumThreads < 1 )
                 {
-                    BITMAPCOREHEADER theHeader = readBitmapCoreHeader( theFile );
-                    theImageWidth = theHeader.width_px;
-                    theImageHeight = theHeader.height_px;
-                    theImageBitCount = theHeader.bits_per_pixel;
-                    
-                    // write headers to inverted file
-                    writeBitmapFileHeader( theBitmapFileHeader, theInvertedFile );
-                    writeBitmapCoreHeader( theHeader, theInvertedFile );
-
-                    // write headers to grayscale red file
-                    writeBitmapFileHeader( theBitmapFileHeader, theRedGrayscaleFile );
-                    writeBitmapCoreHeader( theHeader, theRedGrayscaleFile );
-
-                    // write headers to grayscale green file
-                    writeBitmapFileHeader( theBitmapFileHeader, theGreenGrayscaleFile );
-                    writeBitmapCoreHeader( theHeader, theGreenGrayscaleFile );
-
-                    // write headers to grayscale blue file
-                    writeBitmapFileHeader( theBitmapFileHeader, theBlueGrayscaleFile );
-                    writeBitmapCoreHeader( theHeader, theBlueGrayscaleFile );
-                    break;
+                    printf( "Invalid thread count: %s\n", optarg );
+                    return 1;
                 }
-
-                case BITMAPINFOHEADER_IMAGE_OFFSET:
+                break;
+            }
+            case 'm':
+            {
+                theOptions.useMmap = 1;
+                break;
+            }
+            case 'S':
+            {
+                useScalarRowKernels();
+                break;
+            }
+            case 's':
+            {
+                theOptions.stripRows = theOptions.stripRows > 0 ? theOptions.stripRows : 0;
+                break;
+            }
+            case 'r':
+            {
+                theOptions.stripRows = atoi( optarg );
+                if( theOptions.stripRows < 1 )
                 {
-                    BITMAPINFOHEADER theHeader = readBitmapInfoHeader( theFile );
-                    theImageWidth = theHeader.width_px;
-                    theImageHeight = theHeader.height_px;
-                    theImageBitCount = theHeader.bits_per_pixel;
-                    
-                    // write headers to inverted file
-                    writeBitmapFileHeader( theBitmapFileHeader, theInvertedFile );
-                    writeBitmapInfoHeader( theHeader, theInvertedFile );
-
-                    // write headers to grayscale red file
-                    writeBitmapFileHeader( theBitmapFileHeader, theRedGrayscaleFile );
-                    writeBitmapInfoHeader( theHeader, theRedGrayscaleFile );
-
-                    // write headers to grayscale green file
-                    writeBitmapFileHeader( theBitmapFileHeader, theGreenGrayscaleFile );
-                    writeBitmapInfoHeader( theHeader, theGreenGrayscaleFile );
-
-                    // write headers to grayscale blue file
-                    writeBitmapFileHeader( theBitmapFileHeader, theBlueGrayscaleFile );
-                    writeBitmapInfoHeader( theHeader, theBlueGrayscaleFile );
-                    break;
+                    printf( "Invalid strip size: %s\n", optarg );
+                    return 1;
                 }
-
-                case BITMAPV4HEADER_IMAGE_OFFSET:
+                break;
+            }
+            case 'b':
+            {
+                theBatchMode = 1;
+                break;
+            }
+            case 'o':
+            {
+                theOptions.outputDirectory = optarg;
+                break;
+            }
+            case 'n':
+            {
+                theOptions.nameTemplate = optarg;
+                break;
+            }
+            case 'q':
+            {
+                setVerbose( 0 );
+                break;
+            }
+            case 'p':
+            {
+                // the first --pipeline replaces the default outputs
+                if( theOptions.outputs == gDefaultOutputs )
                 {
-                    BITMAPV4HEADER theHeader = readBitmapV4Header( theFile );
-                    theImageWidth = theHeader.bV4Width;
-                    theImageHeight = theHeader.bV4Height;
-                    theImageBitCount = theHeader.bV4BitCount;
-                    
-                    // write headers to inverted file
-                    writeBitmapFileHeader( theBitmapFileHeader, theInvertedFile );
-                    writeBitmapV4Header( theHeader, theInvertedFile );
-
-                    // write headers to grayscale red file
-                    writeBitmapFileHeader( theBitmapFileHeader, theRedGrayscaleFile );
-                    writeBitmapV4Header( theHeader, theRedGrayscaleFile );
-
-                    // write headers to grayscale green file
-                    writeBitmapFileHeader( theBitmapFileHeader, theGreenGrayscaleFile );
-                    writeBitmapV4Header( theHeader, theGreenGrayscaleFile );
-
-                    // write headers to grayscale blue file
-                    writeBitmapFileHeader( theBitmapFileHeader, theBlueGrayscaleFile );
-                    writeBitmapV4Header( theHeader, theBlueGrayscaleFile );
-                    break;
+                    theOptions.outputs = theOutputSpecs;
+                    theOptions.numOutputs = 0;
                 }
-
-                case BITMAPV5HEADER_IMAGE_OFFSET:
+                if( theOptions.numOutputs == MAX_FUSED_OUTPUTS || !parseOutputSpec( optarg, &theOutputSpecs[ theOptions.numOutputs ] ) )
                 {
-                    BITMAPV5HEADER theHeader = readBitmapV5Header( theFile );
-                    theImageWidth = theHeader.bV5Width;
-                    theImageHeight = theHeader.bV5Height;
-                    theImageBitCount = theHeader.bV5BitCount;
-                    
-                    // write headers to inverted file
-                    writeBitmapFileHeader( theBitmapFileHeader, theInvertedFile );
-                    writeBitmapV5Header( theHeader, theInvertedFile );
-
-                    // write headers to grayscale red file
-                    writeBitmapFileHeader( theBitmapFileHeader, theRedGrayscaleFile );
-                    writeBitmapV5Header( theHeader, theRedGrayscaleFile );
-
-                    // write headers to grayscale green file
-                    writeBitmapFileHeader( theBitmapFileHeader, theGreenGrayscaleFile );
-                    writeBitmapV5Header( theHeader, theGreenGrayscaleFile );
-
-                    // write headers to grayscale blue file
-                    writeBitmapFileHeader( theBitmapFileHeader, theBlueGrayscaleFile );
-                    writeBitmapV5Header( theHeader, theBlueGrayscaleFile );
-                    break;
+                    printf( "Invalid pipeline: %s\n", optarg );
+                    return 1;
                 }
+                theOptions.numOutputs++;
+                break;
             }
+            case 1006:
+            {
+                theOptions.grayOutput = 1;
+                break;
+            }
+            case 1007:
+            {
+                theOptions.rleOutput = 1;
+                break;
+            }
+            case 1008:
+            {
+                theOptions.pyramidLevels = atoi( optarg );
+                if( theOptions.pyramidLevels < 1 || theOptions.pyramidLevels > MAX_PYRAMID_LEVELS )
+                {
+                    printf( "Invalid number of pyramid levels: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1009:
+            {
+                theHistogramFilename = optarg;
+                break;
+            }
+            case 1010:
+            {
+                theUseRing = 0;
+                break;
+            }
+            case 1011:
+            {
+                theOptions.directOutput = 1;
+                break;
+            }
+            case 1015:
+            {
+                if( !parseImageRegion( optarg, &theOptions.region ) )
+                {
+                    printf( "Invalid region: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1016:
+            {
+                theCacheDirectory = optarg;
+                break;
+            }
+            case 1017:
+            {
+                char* theEnd;
+                theCacheMegabytes = strtoull( optarg, &theEnd, 10 );
+                if( theEnd == optarg || *theEnd || theCacheMegabytes < 1 )
+                {
+                    printf( "Invalid cache size: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1014:
+            {
+                thePinThreads = 1;
+                theBenchmark.pinThreads = 1;
+                break;
+            }
+            case 1012:
+            {
+                theServerSocket = optarg;
+                break;
+            }
+            case 1013:
+            {
+                theQueueSize = atoi( optarg );
+                if( theQueueSize < 1 )
+                {
+                    printf( "Invalid queue size: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1004:
+            {
+                theStatsFilename = optarg;
+                break;
+            }
+            case 1005:
+            {
+                theProgressInterval = atoi( optarg );
+                if( theProgressInterval < 1 )
+                {
+                    printf( "Invalid progress interval: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 'B':
+            {
+                theBenchmarkMode = 1;
+                break;
+            }
+            case 1000:
+            {
+                theBenchmark.numSizes = parseIntegerList( optarg, theBenchmark.sizes, BENCHMARK_MAX_VALUES, 1, BENCHMARK_MAX_SIZE );
+                if( theBenchmark.numSizes < 1 )
+                {
+                    printf( "Invalid benchmark sizes: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1001:
+            {
+                theBenchmark.numThreadCounts = parseIntegerList( optarg, theBenchmark.threadCounts, BENCHMARK_MAX_VALUES, 1, INT_MAX );
+                if( theBenchmark.numThreadCounts < 1 )
+                {
+                    printf( "Invalid benchmark thread counts: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1002:
+            {
+                theBenchmark.repeat = atoi( optarg );
+                if( theBenchmark.repeat < 1 )
+                {
+                    printf( "Invalid benchmark repeat count: %s\n", optarg );
+                    return 1;
+                }
+                break;
+            }
+            case 1003:
+            {
+                if( strcmp( optarg, "json" ) != 0 && strcmp( optarg, "csv" ) != 0 )
+                {
+                    printf( "Invalid benchmark format: %s\n", optarg );
+                    return 1;
+                }
+                theBenchmark.json = strcmp( optarg, "json" ) == 0;
+                break;
+            }
+            default:
+            {
+                printUsage( argv[ 0 ] );
+                return 1;
+            }
+        }
+    }
 
-            BitmapColor** theImageData = readImageData( theImageWidth, theImageHeight, theImageBitCount, theFile );
-
-            BitmapColor** theNewImageData = allocateImageMemory( theImageWidth, theImageHeight ); 
-            copyImageData( theImageWidth, theImageHeight, theNewImageData, theImageData );
-            
-            // write inverted image data
-            invertImage( theImageWidth, theImageHeight, theNewImageData );
-            writeImageData( theImageWidth, theImageHeight, theImageBitCount, theNewImageData, theInvertedFile );
-            printf( "Wrote inverted image to %s\n", theInvertedImageName );
-
-            copyImageData( theImageWidth, theImageHeight, theNewImageData, theImageData );
-
-            // write grayscale red image data
-            grayscaleImageRed( theImageWidth, theImageHeight, theNewImageData );
-            writeImageData( theImageWidth, theImageHeight, theImageBitCount, theNewImageData, theRedGrayscaleFile );
-            printf( "Wrote grayscale (from red) image to %s\n", theRedGrayscaleImageName );
+    if( theOptions.useMmap && theOptions.stripRows >= 0 )
+    {
+        printf( "--mmap and --stream cannot be combined\n" );
+        return 1;
+    }
 
-            copyImageData( theImageWidth, theImageHeight, theNewImageData, theImageData );
+    if( !theOptions.nameTemplate )
+    {
+        theOptions.nameTemplate = theBatchMode || theServerSocket ? "{name}_{filter}.bmp" : "{filter}.bmp";
+    }
 
-            // write grayscale green image data
-            grayscaleImageGreen( theImageWidth, theImageHeight, theNewImageData );
-            writeImageData( theImageWidth, theImageHeight, theImageBitCount, theNewImageData, theGreenGrayscaleFile );
-            printf( "Wrote grayscale (from green) image to %s\n", theGreenGrayscaleImageName );
+    if( theHistogramFilename )
+    {
+        // without any --pipeline only the statistics are written
+        if( theOptions.outputs == gDefaultOutputs )
+        {
+            theOptions.numOutputs = 0;
+        }
+        theOptions.histogramFile = strcmp( theHistogramFilename, "-" ) == 0 ? stdout : fopen( theHistogramFilename, "w" );
+        if( !theOptions.histogramFile )
+        {
+            printf( "Could not create %s\n", theHistogramFilename );
+            return 1;
+        }
+    }
 
-            copyImageData( theImageWidth, theImageHeight, theNewImageData, theImageData );
+    if( theOptions.outputDirectory && mkdir( theOptions.outputDirectory, 0777 ) != 0 && errno != EEXIST )
+    {
+        printf( "Could not create %s\n", theOptions.outputDirectory );
+        return 1;
+    }
 
-            // write grayscale blue image data
-            grayscaleImageBlue( theImageWidth, theImageHeight, theNewImageData );
-            writeImageData( theImageWidth, theImageHeight, theImageBitCount, theNewImageData, theBlueGrayscaleFile );
-            printf( "Wrote grayscale (from blue) image to %s\n", theBlueGrayscaleImageName );
+    if( theBenchmarkMode )
+    {
+        // default sweep: 1, 2, 4, ... up to the core count, and the core count itself
+        if( theBenchmark.numThreadCounts == 0 )
+        {
+            int theCores = getDefaultThreadCount();
+            for( int t = 1; t < theCores && theBenchmark.numThreadCounts < BENCHMARK_MAX_VALUES - 1; t *= 2 )
+            {
+                theBenchmark.threadCounts[ theBenchmark.numThreadCounts++ ] = t;
+            }
+            theBenchmark.threadCounts[ theBenchmark.numThreadCounts++ ] = theCores;
+        }
+        theBenchmark.directory = theOptions.outputDirectory ? theOptions.outputDirectory : ".";
+        setVerbose( 0 );
+        return runBenchmark( &theBenchmark );
+    }
 
-            // MEMORY MANAGEMENT
-            freeImageData( theImageWidth, theImageHeight, theImageData );
-            freeImageData( theImageWidth, theImageHeight, theNewImageData );
-            fclose( theInvertedFile );
-            fclose( theRedGrayscaleFile );
-            fclose( theGreenGrayscaleFile );
-            fclose( theBlueGrayscaleFile );
-            fclose( theFile );
-            printf( "Complete.\n" );
+    int theResult = 0;
+    if( optind == argc - 1 || ( theServerSocket && optind == argc ) )
+    {
+        if( theServerSocket )
+        {
+            blockServerSignals();
+        }
+        uint64_t theWallStart = readClockNanoseconds( CLOCK_MONOTONIC );
+        uint64_t theCpuStart = readClockNanoseconds( CLOCK_PROCESS_CPUTIME_ID );
+        ProgressReporter theProgress;
+        int theProgressStarted = theProgressInterval > 0 && startProgressReporter( &theProgress, theProgressInterval );
+        BmpContext* theContext = createBmpContext( theNumThreads, thePinThreads, theUseRing, BUFFER_POOL_MAX_BYTES );
+        if( !theContext )
+        {
+            printf( "Could not start %d threads\n", theNumThreads );
+            theResult = 1;
+        }
+        else if( theCacheDirectory && !( theContext->cache = openResultCache( theCacheDirectory, theCacheMegabytes * 1024 * 1024 ) ) )
+        {
+            printf( "Could not open the cache directory %s\n", theCacheDirectory );
+            theResult = 1;
+        }
+        else if( theServerSocket )
+        {
+            theResult = runJobServer( theContext, &theOptions, theServerSocket, theQueueSize );
+        }
+        else if( theBatchMode )
+        {
+            BatchInputs theInputs = { NULL, 0, 0 };
+            if( collectBatchInputs( argv[ optind ], &theInputs ) )
+            {
+                theResult = processBatch( theContext, &theInputs, &theOptions ) > 0;
+            }
+            else
+            {
+                theResult = 1;
+            }
+            freeBatchInputs( &theInputs );
+        }
+        else if( processBitmapFile( theContext, argv[ optind ], &theOptions ) )
+        {
+            logMessage( "Complete.\n" );
         }
         else
         {
-            printf( "%s does not exist!\n", theOriginalFilename );
+            theResult = 1;
+        }
+
+        if( theProgressStarted )
+        {
+            stopProgressReporter( &theProgress );
         }
+        if( theStatsFilename && theContext )
+        {
+            FILE* theStatsFile = strcmp( theStatsFilename, "-" ) == 0 ? stdout : fopen( theStatsFilename, "w" );
+            if( theStatsFile )
+            {
+                writeRunStatsJson( theStatsFile, theContext, readClockNanoseconds( CLOCK_MONOTONIC ) - theWallStart,
+                                   readClockNanoseconds( CLOCK_PROCESS_CPUTIME_ID ) - theCpuStart );
+                if( theStatsFile != stdout )
+                {
+                    fclose( theStatsFile );
+                }
+            }
+            else
+            {
+                printf( "Could not create %s\n", theStatsFilename );
+            }
+        }
+        destroyBmpContext( theContext );
     }
     else
     {
-        printf( "Usage: %s [path to bitmap (.bmp) image]\n", argv[ 0 ] );
+        printUsage( argv[ 0 ] );
+    }
+
+    if( theOptions.histogramFile && theOptions.histogramFile != stdout )
+    {
+        fclose( theOptions.histogramFile );
     }
     
-    return 0;
+    return theResult;
 }
@@ -0,0 +1,211 @@
+// checks every SIMD row kernel the CPU can run against its scalar version, byte for byte;
+// the kernels are internal, so the library source is compiled into the test
+#include "../bmpreader.c"
+
+#define TEST_MAX_BYTES 4200
+#define TEST_GUARD_BYTES 64 // past the end of every destination, must stay untouched
+#define TEST_MAX_TAPS 12
+
+typedef struct
+{
+    const char* name;
+    InvertRowKernel invertRow; // one of the three is set
+    ChannelRowKernel channelRow;
+    LumaRowKernel lumaRow;
+    int numParameters;         // channels 0 to 2, BT.601 and BT.709 weights
+} ByteKernelCase;
+
+static int gFailures = 0;
+static int gChecks = 0;
+
+static void fillRandom( uint8_t* aData, size_t aSize, unsigned* aSeed )
+{
+    for( size_t i = 0; i < aSize; i++ )
+    {
+        aData[ i ] = ( uint8_t )( rand_r( aSeed ) >> 7 );
+    }
+}
+
+static void expectSame( const char* aKernel, const char* aMode, size_t aLength, int aParameter, const void* aExpected, const void* aActual, size_t aSize )
+{
+    const uint8_t* theExpected = ( const uint8_t* )aExpected;
+    const uint8_t* theActual = ( const uint8_t* )aActual;
+    gChecks++;
+    if( memcmp( theExpected, theActual, aSize ) != 0 )
+    {
+        size_t theFirst = 0;
+        while( theExpected[ theFirst ] == theActual[ theFirst ] )
+        {
+            theFirst++;
+        }
+        printf( "FAIL %s %s: length %zu, parameter %d, first difference at byte %zu (%u instead of %u)\n",
+                aKernel, aMode, aLength, aParameter, theFirst, theActual[ theFirst ], theExpected[ theFirst ] );
+        gFailures++;
+    }
+}
+
+// every length up to 200, below, at and above each vector width with every tail, then longer rows
+// made of whole pixels of aUnit bytes; -1 past the end
+static int nextLength( int aLength, int aUnit )
+{
+    int theNext = aLength < 200 ? aLength + 1 : ( aLength < 1000 ? aLength + 97 : aLength + 1531 );
+    theNext += theNext > 200 ? ( aUnit - theNext % aUnit ) % aUnit : 0;
+    return theNext <= TEST_MAX_BYTES ? theNext : -1;
+}
+
+static void runByteKernel( const ByteKernelCase* aCase, const uint8_t* aSource, uint8_t* aDest, size_t aBytes, int aParameter )
+{
+    if( aCase->invertRow )
+    {
+        aCase->invertRow( aSource, aDest, aBytes );
+    }
+    else if( aCase->channelRow )
+    {
+        aCase->channelRow( aSource, aDest, aBytes, aParameter );
+    }
+    else
+    {
+        aCase->lumaRow( aSource, aDest, aBytes, aParameter ? gLumaWeightsBt709 : gLumaWeightsBt601 );
+    }
+}
+
+// out of place and in place, from an aligned and a misaligned start, for rows of 1, 3 and 4 byte pixels
+static void checkByteKernel( const ByteKernelCase* aScalar, const ByteKernelCase* aKernel )
+{
+    static const int theUnits[] = { 1, 3, 4 };
+    static uint8_t theSource[ TEST_MAX_BYTES + TEST_GUARD_BYTES + 1 ];
+    static uint8_t theExpected[ TEST_MAX_BYTES + TEST_GUARD_BYTES + 1 ];
+    static uint8_t theActual[ TEST_MAX_BYTES + TEST_GUARD_BYTES + 1 ];
+    unsigned theSeed = 1;
+    for( size_t u = 0; u < sizeof( theUnits ) / sizeof( theUnits[ 0 ] ); u++ )
+    {
+        for( int theBytes = 0; theBytes >= 0; theBytes = nextLength( theBytes, theUnits[ u ] ) )
+        {
+            for( int theParameter = 0; theParameter < aKernel->numParameters; theParameter++ )
+            {
+                for( int theOffset = 0; theOffset < 2; theOffset++ )
+                {
+                    fillRandom( theSource, sizeof( theSource ), &theSeed );
+                    fillRandom( theExpected, sizeof( theExpected ), &theSeed );
+                    memcpy( theActual, theExpected, sizeof( theActual ) );
+                    runByteKernel( aScalar, theSource + theOffset, theExpected + theOffset, theBytes, theParameter );
+                    runByteKernel( aKernel, theSource + theOffset, theActual + theOffset, theBytes, theParameter );
+                    expectSame( aKernel->name, "out of place", theBytes, theParameter, theExpected, theActual, sizeof( theActual ) );
+
+                    memcpy( theExpected, theSource, sizeof( theSource ) );
+                    memcpy( theActual, theSource, sizeof( theSource ) );
+                    runByteKernel( aScalar, theExpected + theOffset, theExpected + theOffset, theBytes, theParameter );
+                    runByteKernel( aKernel, theActual + theOffset, theActual + theOffset, theBytes, theParameter );
+                    expectSame( aKernel->name, "in place", theBytes, theParameter, theExpected, theActual, sizeof( theActual ) );
+                }
+            }
+        }
+    }
+}
+
+// aTaps positive weights adding up to 1 << CONVOLUTION_WEIGHT_BITS, followed by the zero the kernels expect
+static void makeConvolutionWeights( int16_t* aWeights, int aTaps, unsigned* aSeed )
+{
+    int theLeft = 1 << CONVOLUTION_WEIGHT_BITS;
+    for( int k = 0; k < aTaps - 1; k++ )
+    {
+        aWeights[ k ] = ( int16_t )( rand_r( aSeed ) % ( theLeft / ( aTaps - k ) + 1 ) );
+        theLeft -= aWeights[ k ];
+    }
+    aWeights[ aTaps - 1 ] = ( int16_t )theLeft;
+    aWeights[ aTaps ] = 0;
+}
+
+static void checkHorizontalPass( const char* aName, HorizontalPassKernel aKernel )
+{
+    // the line carries 3 * aTaps bytes of edge pixels and 32 readable bytes past the end
+    static uint8_t theLine[ TEST_MAX_BYTES + 3 * TEST_MAX_TAPS + 32 ];
+    static uint16_t theExpected[ TEST_MAX_BYTES + TEST_GUARD_BYTES ];
+    static uint16_t theActual[ TEST_MAX_BYTES + TEST_GUARD_BYTES ];
+    int16_t theWeights[ TEST_MAX_TAPS + 1 ];
+    unsigned theSeed = 2;
+    for( int theTaps = 1; theTaps < TEST_MAX_TAPS; theTaps++ )
+    {
+        for( int theBytes = 0; theBytes >= 0; theBytes = nextLength( theBytes, 3 ) )
+        {
+            makeConvolutionWeights( theWeights, theTaps, &theSeed );
+            fillRandom( theLine, sizeof( theLine ), &theSeed );
+            fillRandom( ( uint8_t* )theExpected, sizeof( theExpected ), &theSeed );
+            memcpy( theActual, theExpected, sizeof( theActual ) );
+            horizontalPassScalar( theLine, theExpected, theBytes, theWeights, theTaps );
+            aKernel( theLine, theActual, theBytes, theWeights, theTaps );
+            expectSame( aName, "out of place", theBytes, theTaps, theExpected, theActual, sizeof( theActual ) );
+        }
+    }
+}
+
+static void checkVerticalPass( const char* aName, VerticalPassKernel aKernel )
+{
+    static uint16_t theInputs[ TEST_MAX_TAPS ][ TEST_MAX_BYTES ];
+    static uint8_t theExpected[ TEST_MAX_BYTES + TEST_GUARD_BYTES ];
+    static uint8_t theActual[ TEST_MAX_BYTES + TEST_GUARD_BYTES ];
+    const uint16_t* theRows[ TEST_MAX_TAPS ];
+    int16_t theWeights[ TEST_MAX_TAPS + 1 ];
+    unsigned theSeed = 3;
+    for( int theTaps = 1; theTaps < TEST_MAX_TAPS; theTaps++ )
+    {
+        for( int theCount = 0; theCount >= 0; theCount = nextLength( theCount, 3 ) )
+        {
+            makeConvolutionWeights( theWeights, theTaps, &theSeed );
+            for( int k = 0; k < theTaps; k++ )
+            {
+                // horizontal pass results: bytes with CONVOLUTION_FRACTION_BITS of fraction
+                for( int i = 0; i < theCount; i++ )
+                {
+                    theInputs[ k ][ i ] = ( uint16_t )( rand_r( &theSeed ) % ( ( UINT8_MAX << CONVOLUTION_FRACTION_BITS ) + 1 ) );
+                }
+                theRows[ k ] = theInputs[ k ];
+            }
+            fillRandom( theExpected, sizeof( theExpected ), &theSeed );
+            memcpy( theActual, theExpected, sizeof( theActual ) );
+            verticalPassScalar( theRows, theExpected, theCount, theWeights, theTaps );
+            aKernel( theRows, theActual, theCount, theWeights, theTaps );
+            expectSame( aName, "out of place", theCount, theTaps, theExpected, theActual, sizeof( theActual ) );
+        }
+    }
+}
+
+int main( void )
+{
+#if defined( __x86_64__ ) || defined( __i386__ )
+    const ByteKernelCase theScalarInvert = { "invertRowScalar", invertRowScalar, NULL, NULL, 1 };
+    const ByteKernelCase theScalarChannel = { "broadcastChannelRowScalar", NULL, broadcastChannelRowScalar, NULL, 3 };
+    const ByteKernelCase theScalarLuma = { "lumaRowScalar", NULL, NULL, lumaRowScalar, 2 };
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "sse2" ) )
+    {
+        const ByteKernelCase theInvert = { "invertRowSse2", invertRowSse2, NULL, NULL, 1 };
+        checkByteKernel( &theScalarInvert, &theInvert );
+    }
+    if( __builtin_cpu_supports( "ssse3" ) )
+    {
+        const ByteKernelCase theChannel = { "broadcastChannelRowSsse3", NULL, broadcastChannelRowSsse3, NULL, 3 };
+        const ByteKernelCase theLuma = { "lumaRowSsse3", NULL, NULL, lumaRowSsse3, 2 };
+        checkByteKernel( &theScalarChannel, &theChannel );
+        checkByteKernel( &theScalarLuma, &theLuma );
+    }
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        const ByteKernelCase theInvert = { "invertRowAvx2", invertRowAvx2, NULL, NULL, 1 };
+        const ByteKernelCase theChannel = { "broadcastChannelRowAvx2", NULL, broadcastChannelRowAvx2, NULL, 3 };
+        checkByteKernel( &theScalarInvert, &theInvert );
+        checkByteKernel( &theScalarChannel, &theChannel );
+        checkHorizontalPass( "horizontalPassAvx2", horizontalPassAvx2 );
+        checkVerticalPass( "verticalPassAvx2", verticalPassAvx2 );
+    }
+    else
+    {
+        printf( "no AVX2, its kernels were not checked\n" );
+    }
+#else
+    printf( "no SIMD kernels on this architecture\n" );
+#endif
+
+    printf( "%d of %d row kernel checks failed\n", gFailures, gChecks );
+    return gFailures > 0;
+}